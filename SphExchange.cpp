@@ -0,0 +1,153 @@
+#include "SphExchange.hpp"
+
+#include <algorithm> // std::swap
+
+#ifdef _OPENMP
+#	include <omp.h>
+#endif // _OPENMP
+
+namespace sph
+{
+////////////////////////////////////////////////////////////////////////////////
+// StateExchange implementation
+//
+////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////
+// Mutex (without OpenMP, there is a single thread)
+struct StateExchange::_Mutex
+{
+	_Mutex()
+	{
+#ifdef _OPENMP
+		omp_init_lock(&lock);
+#endif
+	}
+
+	~_Mutex()
+	{
+#ifdef _OPENMP
+		omp_destroy_lock(&lock);
+#endif
+	}
+
+#ifdef _OPENMP
+	omp_lock_t lock;
+#endif
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Constructor
+StateExchange::StateExchange() :
+	mBack(0), mReady(1), mFront(2),
+	mFresh(false), mClosed(false),
+	mPublishCount(0), mAcquireCount(0),
+	mMutex(new _Mutex)
+{
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Destructor
+StateExchange::~StateExchange()
+{
+	delete mMutex;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Lock / Unlock (the lock also flushes the slots to the other thread)
+void StateExchange::_Lock() const
+{
+#ifdef _OPENMP
+	omp_set_lock(&mMutex->lock);
+#endif
+}
+
+void StateExchange::_Unlock() const
+{
+#ifdef _OPENMP
+	omp_unset_lock(&mMutex->lock);
+#endif
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Back arrays (only the producer touches them, no lock)
+ParticleArrays& StateExchange::Back()
+{
+	return mStates[mBack];
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Publish
+bool StateExchange::Publish()
+{
+	_Lock();
+	std::swap(mBack, mReady);
+	mFresh = true;
+	++mPublishCount;
+	bool open = !mClosed;
+	_Unlock();
+	return open;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Acquire
+bool StateExchange::Acquire()
+{
+	_Lock();
+	bool fresh = mFresh;
+	if(fresh)
+	{
+		std::swap(mFront, mReady);
+		mFresh = false;
+		++mAcquireCount;
+	}
+	_Unlock();
+	return fresh;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Close
+void StateExchange::Close()
+{
+	_Lock();
+	mClosed = true;
+	_Unlock();
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Front arrays (only the consumer touches them, no lock)
+const ParticleArrays& StateExchange::Front() const
+{
+	return mStates[mFront];
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Counters
+unsigned StateExchange::PublishCount() const
+{
+	_Lock();
+	unsigned count = mPublishCount;
+	_Unlock();
+	return count;
+}
+
+unsigned StateExchange::AcquireCount() const
+{
+	_Lock();
+	unsigned count = mAcquireCount;
+	_Unlock();
+	return count;
+}
+
+
+} // namespace sph
+
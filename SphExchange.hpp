@@ -0,0 +1,70 @@
+////////////////////////////////////////////////////////////////////////////////
+// \author   Jonathan Dupuy
+// \brief    Hands the particle states of a solver running on its own thread
+//           over to the render thread. States are triple buffered: the
+//           producer fills the back arrays while the consumer reads the
+//           front ones, and completed states are swapped through a third,
+//           ready slot under a lock, so that neither thread waits for the
+//           other (the consumer only sees the latest completed state).
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef SPH_EXCHANGE_HPP
+#define SPH_EXCHANGE_HPP
+
+#include "SphParticles.hpp"
+
+namespace sph
+{
+	// State exchange
+	class StateExchange
+	{
+	public:
+		// Constructors / Destructor
+		StateExchange();
+		~StateExchange();
+
+		// Manipulation (producer)
+			// arrays of the state being computed
+		ParticleArrays& Back();
+			// publish the back arrays as the latest state (false once closed,
+			// the producer must then stop)
+		bool Publish();
+
+		// Manipulation (consumer)
+			// take the latest state if it is newer than the front arrays
+		bool Acquire();
+			// ask the producer to stop
+		void Close();
+
+		// Queries
+		const ParticleArrays& Front() const;
+		unsigned PublishCount() const; // states published
+		unsigned AcquireCount() const; // states acquired (the rest was skipped)
+
+	private:
+		// Non copyable
+		StateExchange(const StateExchange& exchange);
+		StateExchange& operator=(const StateExchange& exchange);
+
+		// Internal manipulation
+		void _Lock() const;
+		void _Unlock() const;
+
+		// Internal types
+		struct _Mutex; // lock of the ready slot and the flags
+
+		// Members
+		ParticleArrays mStates[3];
+		int      mBack, mReady, mFront; // slot of each role
+		bool     mFresh;     // ready slot holds a state not acquired yet
+		bool     mClosed;    // producer must stop
+		unsigned mPublishCount;
+		unsigned mAcquireCount;
+		_Mutex   *mMutex;
+	};
+
+} // namespace sph
+
+#endif
+
@@ -0,0 +1,693 @@
+#include "SphKernels.hpp"
+
+#include <cmath>     // std::sqrt
+#include <cstring>   // strcmp
+
+// instruction sets available in this build (the kernels are compiled for
+// their own target, the rest of the program does not require them)
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#	define _SPH_TARGET(isa) __attribute__((target(isa)))
+#	if defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)
+#		define _SPH_AVX2
+#	endif
+#	if defined(__clang__) || __GNUC__ >= 7
+#		define _SPH_AVX512
+#	endif
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#	define _SPH_TARGET(isa)
+#	if _MSC_VER >= 1700
+#		define _SPH_AVX2
+#	endif
+#	if _MSC_VER >= 1910
+#		define _SPH_AVX512
+#	endif
+#	include <intrin.h> // __cpuid __cpuidex _xgetbv
+#endif
+
+#if defined(_SPH_AVX2) || defined(_SPH_AVX512)
+#	include <immintrin.h>
+#endif
+
+namespace sph
+{
+////////////////////////////////////////////////////////////////////////////////
+// Local functions
+//
+////////////////////////////////////////////////////////////////////////////////
+
+// names of the instruction sets
+static const char* _SIMD_ISA_NAMES[] = {"scalar", "avx2", "avx512"};
+
+
+////////////////////////////////////////////////////////////////////////////////
+// compute the pressure for a given density
+static inline float _pressure(float k, float d, float d0)
+{
+	return k * (d - d0);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// scalar kernels (see eval_density() and sph_forces())
+static float _density_scalar(const ParticleArrays& particles,
+                             int i,
+                             const int *neighbours,
+                             int count,
+                             float h2,
+                             int *pairs,
+                             int *pairCount)
+{
+	const float *x = particles[PARTICLE_X];
+	const float *y = particles[PARTICLE_Y];
+	const float *z = particles[PARTICLE_Z];
+	float density  = 0.0f;
+	int found      = 0;
+
+	for(int n=0; n<count; ++n)
+	{
+		const int j = neighbours[n];
+		if(j == i)
+			continue;
+
+		float rij[3] = {x[i]-x[j], y[i]-y[j], z[i]-z[j]};
+		float dist2  = h2 - (rij[0]*rij[0] + rij[1]*rij[1] + rij[2]*rij[2]);
+		if(dist2 > 0.0f)
+		{
+			density += dist2*dist2*dist2;
+			if(pairs)
+				pairs[found++] = j;
+		}
+	}
+	if(pairs)
+		*pairCount = found;
+	return density;
+}
+
+static void _force_scalar(const ParticleArrays& particles,
+                          int i,
+                          const int *neighbours,
+                          int count,
+                          const ForceKernelArgs& args,
+                          float *fPressure,
+                          float *fViscosity,
+                          float *densityRate)
+{
+	const float *r[3] = {particles[PARTICLE_X],
+	                     particles[PARTICLE_Y],
+	                     particles[PARTICLE_Z]};
+	const float *v[3] = {particles[PARTICLE_VX],
+	                     particles[PARTICLE_VY],
+	                     particles[PARTICLE_VZ]};
+	const float *d    = particles[PARTICLE_DENSITY];
+	const float h     = args.smoothingLength;
+	float rate        = 0.0f;
+
+	for(int n=0; n<count; ++n)
+	{
+		const int j = neighbours[n];
+		if(j == i)
+			continue;
+
+		float rij[3] = {r[0][i]-r[0][j], r[1][i]-r[1][j], r[2][i]-r[2][j]};
+		float r2     = rij[0]*rij[0] + rij[1]*rij[1] + rij[2]*rij[2];
+
+		// kernels vanish beyond h (and are undefined at r=0)
+		if(r2 >= args.smoothingLengthSquared || r2 == 0.0f)
+			continue;
+
+		float rn    = std::sqrt(r2);
+		float invDj = 1.0f/d[j];
+		float hr    = h - rn;
+		float spiky = (args.pressure + _pressure(args.k, d[j], args.restDensity))
+		            * invDj * hr * hr / rn;
+		float visc  = invDj * hr;
+		float w     = args.smoothingLengthSquared - r2;
+		for(int c=0; c<3; ++c)
+		{
+			fPressure[c]  += spiky * rij[c];
+			fViscosity[c] += visc * (v[c][j] - v[c][i]);
+			rate          += w * w * rij[c] * (v[c][j] - v[c][i]);
+		}
+	}
+	if(densityRate)
+		*densityRate += rate;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// decode the words of a list one by one if there is an escape code among
+// them (they were converted as deltas, see NeighbourDecoder)
+static inline int _decode_escapes(int i,
+                                  const short *words,
+                                  int count,
+                                  bool escaped,
+                                  int *neighbours,
+                                  int *wordCount)
+{
+	if(!escaped)
+	{
+		*wordCount = count;
+		return count;
+	}
+
+	// the deltas before the first escape code are decoded already
+	int n = 0;
+	while(NEIGHBOUR_ESCAPE != words[n])
+		++n;
+	int size = n;
+	while(n < count)
+		if(NEIGHBOUR_ESCAPE == words[n])
+		{
+			neighbours[size++] = static_cast<unsigned short>(words[n+1])
+			                   | (words[n+2] << 16);
+			n+= 3;
+		}
+		else
+			neighbours[size++] = i + words[n++];
+	*wordCount = n;
+	return size;
+}
+
+static int _decode_neighbours_scalar(int i,
+                                     const short *words,
+                                     int count,
+                                     int *neighbours,
+                                     int *wordCount)
+{
+	int escaped = 0;
+	for(int n=0; n<count; ++n)
+	{
+		neighbours[n] = i + words[n];
+		escaped|= NEIGHBOUR_ESCAPE == words[n];
+	}
+	return _decode_escapes(i, words, count, 0 != escaped, neighbours,
+	                       wordCount);
+}
+
+
+#ifdef _SPH_AVX2
+////////////////////////////////////////////////////////////////////////////////
+// AVX2 kernels (8 neighbours per packet, the tail is masked)
+_SPH_TARGET("avx2")
+static inline float _sum_avx2(__m256 v)
+{
+	__m128 s = _mm_add_ps(_mm256_castps256_ps128(v),
+	                      _mm256_extractf128_ps(v, 1));
+	s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+	s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+	return _mm_cvtss_f32(s);
+}
+
+// load the indices of a packet (returns the mask of the valid lanes)
+_SPH_TARGET("avx2")
+static inline __m256 _load_packet_avx2(const int *neighbours,
+                                       int count,
+                                       int i,
+                                       __m256i& j)
+{
+	const __m256i LANES = _mm256_setr_epi32(0,1,2,3,4,5,6,7);
+	__m256i valid = _mm256_cmpgt_epi32(_mm256_set1_epi32(count), LANES);
+	j     = _mm256_maskload_epi32(neighbours, valid);
+	valid = _mm256_andnot_si256(_mm256_cmpeq_epi32(j, _mm256_set1_epi32(i)),
+	                            valid);
+	return _mm256_castsi256_ps(valid);
+}
+
+_SPH_TARGET("avx2")
+static float _density_avx2(const ParticleArrays& particles,
+                           int i,
+                           const int *neighbours,
+                           int count,
+                           float h2,
+                           int *pairs,
+                           int *pairCount)
+{
+	const float *x    = particles[PARTICLE_X];
+	const float *y    = particles[PARTICLE_Y];
+	const float *z    = particles[PARTICLE_Z];
+	const __m256 ZERO = _mm256_setzero_ps();
+	const __m256 H2   = _mm256_set1_ps(h2);
+	const __m256 RIX  = _mm256_set1_ps(x[i]);
+	const __m256 RIY  = _mm256_set1_ps(y[i]);
+	const __m256 RIZ  = _mm256_set1_ps(z[i]);
+	__m256 density    = ZERO;
+	int found         = 0;
+
+	for(int n=0; n<count; n+=8)
+	{
+		__m256i j;
+		__m256 mask = _load_packet_avx2(neighbours+n, count-n, i, j);
+		__m256 rx   = _mm256_sub_ps(RIX, _mm256_mask_i32gather_ps(ZERO, x, j,
+		                                                          mask, 4));
+		__m256 ry   = _mm256_sub_ps(RIY, _mm256_mask_i32gather_ps(ZERO, y, j,
+		                                                          mask, 4));
+		__m256 rz   = _mm256_sub_ps(RIZ, _mm256_mask_i32gather_ps(ZERO, z, j,
+		                                                          mask, 4));
+		__m256 dist2 = _mm256_sub_ps(H2,
+		               _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(rx, rx),
+		                                           _mm256_mul_ps(ry, ry)),
+		                             _mm256_mul_ps(rz, rz)));
+		mask  = _mm256_and_ps(mask, _mm256_cmp_ps(dist2, ZERO, _CMP_GT_OQ));
+		dist2 = _mm256_and_ps(mask, dist2);
+		density = _mm256_add_ps(density,
+		                        _mm256_mul_ps(_mm256_mul_ps(dist2, dist2),
+		                                      dist2));
+
+		// pack the lanes within h (no compress instruction)
+		if(pairs)
+			for(int bits=_mm256_movemask_ps(mask); bits; bits&= bits-1)
+			{
+				int lane = 0;
+				while(0 == (bits & (1 << lane)))
+					++lane;
+				pairs[found++] = neighbours[n+lane];
+			}
+	}
+	if(pairs)
+		*pairCount = found;
+	return _sum_avx2(density);
+}
+
+_SPH_TARGET("avx2")
+static void _force_avx2(const ParticleArrays& particles,
+                        int i,
+                        const int *neighbours,
+                        int count,
+                        const ForceKernelArgs& args,
+                        float *fPressure,
+                        float *fViscosity,
+                        float *densityRate)
+{
+	const float *r[3] = {particles[PARTICLE_X],
+	                     particles[PARTICLE_Y],
+	                     particles[PARTICLE_Z]};
+	const float *v[3] = {particles[PARTICLE_VX],
+	                     particles[PARTICLE_VY],
+	                     particles[PARTICLE_VZ]};
+	const float *d    = particles[PARTICLE_DENSITY];
+	const __m256 ZERO = _mm256_setzero_ps();
+	const __m256 ONE  = _mm256_set1_ps(1.0f);
+	const __m256 H    = _mm256_set1_ps(args.smoothingLength);
+	const __m256 H2   = _mm256_set1_ps(args.smoothingLengthSquared);
+	const __m256 K    = _mm256_set1_ps(args.k);
+	const __m256 D0   = _mm256_set1_ps(args.restDensity);
+	const __m256 PI   = _mm256_set1_ps(args.pressure);
+	const __m256 RI[3] = {_mm256_set1_ps(r[0][i]),
+	                      _mm256_set1_ps(r[1][i]),
+	                      _mm256_set1_ps(r[2][i])};
+	const __m256 VI[3] = {_mm256_set1_ps(v[0][i]),
+	                      _mm256_set1_ps(v[1][i]),
+	                      _mm256_set1_ps(v[2][i])};
+	__m256 pressure[3]  = {ZERO, ZERO, ZERO};
+	__m256 viscosity[3] = {ZERO, ZERO, ZERO};
+	__m256 rate         = ZERO;
+
+	for(int n=0; n<count; n+=8)
+	{
+		__m256i j;
+		__m256 mask = _load_packet_avx2(neighbours+n, count-n, i, j);
+		__m256 rij[3], vj[3];
+		for(int c=0; c<3; ++c)
+		{
+			rij[c] = _mm256_sub_ps(RI[c],
+			         _mm256_mask_i32gather_ps(ZERO, r[c], j, mask, 4));
+			vj[c]  = _mm256_mask_i32gather_ps(ZERO, v[c], j, mask, 4);
+		}
+		__m256 dj = _mm256_mask_i32gather_ps(ZERO, d, j, mask, 4);
+		__m256 r2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(rij[0], rij[0]),
+		                                        _mm256_mul_ps(rij[1], rij[1])),
+		                          _mm256_mul_ps(rij[2], rij[2]));
+
+		// kernels vanish beyond h (and are undefined at r=0)
+		mask = _mm256_and_ps(mask, _mm256_and_ps(
+		                           _mm256_cmp_ps(r2, H2, _CMP_LT_OQ),
+		                           _mm256_cmp_ps(r2, ZERO, _CMP_GT_OQ)));
+
+		__m256 rn    = _mm256_sqrt_ps(r2);
+		__m256 invDj = _mm256_div_ps(ONE, dj);
+		__m256 hr    = _mm256_sub_ps(H, rn);
+		__m256 pj    = _mm256_mul_ps(K, _mm256_sub_ps(dj, D0));
+		__m256 spiky = _mm256_div_ps(_mm256_mul_ps(_mm256_mul_ps(
+		               _mm256_mul_ps(_mm256_add_ps(PI, pj), invDj), hr), hr), rn);
+		__m256 visc  = _mm256_mul_ps(invDj, hr);
+		spiky = _mm256_and_ps(mask, spiky);
+		visc  = _mm256_and_ps(mask, visc);
+		for(int c=0; c<3; ++c)
+		{
+			pressure[c]  = _mm256_add_ps(pressure[c],
+			                             _mm256_mul_ps(spiky, rij[c]));
+			viscosity[c] = _mm256_add_ps(viscosity[c],
+			               _mm256_mul_ps(visc, _mm256_sub_ps(vj[c], VI[c])));
+		}
+		if(densityRate)
+		{
+			__m256 w  = _mm256_and_ps(mask, _mm256_sub_ps(H2, r2));
+			__m256 vr = ZERO;
+			for(int c=0; c<3; ++c)
+				vr = _mm256_add_ps(vr, _mm256_mul_ps(rij[c],
+				                       _mm256_sub_ps(vj[c], VI[c])));
+			rate = _mm256_add_ps(rate, _mm256_mul_ps(_mm256_mul_ps(w, w), vr));
+		}
+	}
+
+	for(int c=0; c<3; ++c)
+	{
+		fPressure[c]  += _sum_avx2(pressure[c]);
+		fViscosity[c] += _sum_avx2(viscosity[c]);
+	}
+	if(densityRate)
+		*densityRate += _sum_avx2(rate);
+}
+
+// 8 words per iteration (scalar tail)
+_SPH_TARGET("avx2")
+static int _decode_neighbours_avx2(int i,
+                                   const short *words,
+                                   int count,
+                                   int *neighbours,
+                                   int *wordCount)
+{
+	const __m128i ESCAPE = _mm_set1_epi16(NEIGHBOUR_ESCAPE);
+	const __m256i I      = _mm256_set1_epi32(i);
+	__m128i escapes = _mm_setzero_si128();
+	int n = 0;
+	for(; n+8<=count; n+=8)
+	{
+		__m128i w = _mm_loadu_si128(reinterpret_cast<const __m128i*>(words+n));
+		escapes = _mm_or_si128(escapes, _mm_cmpeq_epi16(w, ESCAPE));
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(neighbours+n),
+		                    _mm256_add_epi32(I, _mm256_cvtepi16_epi32(w)));
+	}
+	int escaped = _mm_movemask_epi8(escapes);
+	for(; n<count; ++n)
+	{
+		neighbours[n] = i + words[n];
+		escaped|= NEIGHBOUR_ESCAPE == words[n];
+	}
+	return _decode_escapes(i, words, count, 0 != escaped, neighbours,
+	                       wordCount);
+}
+#endif // _SPH_AVX2
+
+
+#ifdef _SPH_AVX512
+////////////////////////////////////////////////////////////////////////////////
+// AVX-512 kernels (16 neighbours per packet, the tail is masked)
+_SPH_TARGET("avx512f")
+static inline __mmask16 _load_packet_avx512(const int *neighbours,
+                                            int count,
+                                            int i,
+                                            __m512i& j)
+{
+	__mmask16 valid = count >= 16 ? __mmask16(0xFFFF)
+	                              : __mmask16((1u << count) - 1u);
+	j = _mm512_maskz_loadu_epi32(valid, neighbours);
+	return _mm512_mask_cmpneq_epi32_mask(valid, j, _mm512_set1_epi32(i));
+}
+
+_SPH_TARGET("avx512f")
+static float _density_avx512(const ParticleArrays& particles,
+                             int i,
+                             const int *neighbours,
+                             int count,
+                             float h2,
+                             int *pairs,
+                             int *pairCount)
+{
+	const float *x    = particles[PARTICLE_X];
+	const float *y    = particles[PARTICLE_Y];
+	const float *z    = particles[PARTICLE_Z];
+	const __m512 ZERO = _mm512_setzero_ps();
+	const __m512 H2   = _mm512_set1_ps(h2);
+	const __m512 RIX  = _mm512_set1_ps(x[i]);
+	const __m512 RIY  = _mm512_set1_ps(y[i]);
+	const __m512 RIZ  = _mm512_set1_ps(z[i]);
+	__m512 density    = ZERO;
+	int found         = 0;
+
+	for(int n=0; n<count; n+=16)
+	{
+		__m512i j;
+		__mmask16 mask = _load_packet_avx512(neighbours+n, count-n, i, j);
+		__m512 rx = _mm512_sub_ps(RIX, _mm512_mask_i32gather_ps(ZERO, mask,
+		                                                        j, x, 4));
+		__m512 ry = _mm512_sub_ps(RIY, _mm512_mask_i32gather_ps(ZERO, mask,
+		                                                        j, y, 4));
+		__m512 rz = _mm512_sub_ps(RIZ, _mm512_mask_i32gather_ps(ZERO, mask,
+		                                                        j, z, 4));
+		__m512 dist2 = _mm512_sub_ps(H2,
+		               _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(rx, rx),
+		                                           _mm512_mul_ps(ry, ry)),
+		                             _mm512_mul_ps(rz, rz)));
+		mask    = _mm512_mask_cmp_ps_mask(mask, dist2, ZERO, _CMP_GT_OQ);
+		density = _mm512_mask_add_ps(density, mask, density,
+		                             _mm512_mul_ps(_mm512_mul_ps(dist2, dist2),
+		                                           dist2));
+		if(pairs)
+		{
+			_mm512_mask_compressstoreu_epi32(pairs + found, mask, j);
+			for(unsigned bits=mask; bits; bits&= bits-1)
+				++found;
+		}
+	}
+	if(pairs)
+		*pairCount = found;
+	return _mm512_reduce_add_ps(density);
+}
+
+_SPH_TARGET("avx512f")
+static void _force_avx512(const ParticleArrays& particles,
+                          int i,
+                          const int *neighbours,
+                          int count,
+                          const ForceKernelArgs& args,
+                          float *fPressure,
+                          float *fViscosity,
+                          float *densityRate)
+{
+	const float *r[3] = {particles[PARTICLE_X],
+	                     particles[PARTICLE_Y],
+	                     particles[PARTICLE_Z]};
+	const float *v[3] = {particles[PARTICLE_VX],
+	                     particles[PARTICLE_VY],
+	                     particles[PARTICLE_VZ]};
+	const float *d    = particles[PARTICLE_DENSITY];
+	const __m512 ZERO = _mm512_setzero_ps();
+	const __m512 ONE  = _mm512_set1_ps(1.0f);
+	const __m512 H    = _mm512_set1_ps(args.smoothingLength);
+	const __m512 H2   = _mm512_set1_ps(args.smoothingLengthSquared);
+	const __m512 K    = _mm512_set1_ps(args.k);
+	const __m512 D0   = _mm512_set1_ps(args.restDensity);
+	const __m512 PI   = _mm512_set1_ps(args.pressure);
+	const __m512 RI[3] = {_mm512_set1_ps(r[0][i]),
+	                      _mm512_set1_ps(r[1][i]),
+	                      _mm512_set1_ps(r[2][i])};
+	const __m512 VI[3] = {_mm512_set1_ps(v[0][i]),
+	                      _mm512_set1_ps(v[1][i]),
+	                      _mm512_set1_ps(v[2][i])};
+	__m512 pressure[3]  = {ZERO, ZERO, ZERO};
+	__m512 viscosity[3] = {ZERO, ZERO, ZERO};
+	__m512 rate         = ZERO;
+
+	for(int n=0; n<count; n+=16)
+	{
+		__m512i j;
+		__mmask16 mask = _load_packet_avx512(neighbours+n, count-n, i, j);
+		__m512 rij[3], vj[3];
+		for(int c=0; c<3; ++c)
+		{
+			rij[c] = _mm512_sub_ps(RI[c],
+			         _mm512_mask_i32gather_ps(ZERO, mask, j, r[c], 4));
+			vj[c]  = _mm512_mask_i32gather_ps(ZERO, mask, j, v[c], 4);
+		}
+		__m512 dj = _mm512_mask_i32gather_ps(ONE, mask, j, d, 4);
+		__m512 r2 = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(rij[0], rij[0]),
+		                                        _mm512_mul_ps(rij[1], rij[1])),
+		                          _mm512_mul_ps(rij[2], rij[2]));
+
+		// kernels vanish beyond h (and are undefined at r=0)
+		mask = _mm512_mask_cmp_ps_mask(mask, r2, H2, _CMP_LT_OQ);
+		mask = _mm512_mask_cmp_ps_mask(mask, r2, ZERO, _CMP_GT_OQ);
+
+		__m512 rn    = _mm512_sqrt_ps(r2);
+		__m512 invDj = _mm512_div_ps(ONE, dj);
+		__m512 hr    = _mm512_sub_ps(H, rn);
+		__m512 pj    = _mm512_mul_ps(K, _mm512_sub_ps(dj, D0));
+		__m512 spiky = _mm512_maskz_div_ps(mask, _mm512_mul_ps(_mm512_mul_ps(
+		               _mm512_mul_ps(_mm512_add_ps(PI, pj), invDj), hr), hr), rn);
+		__m512 visc  = _mm512_mul_ps(invDj, hr);
+		for(int c=0; c<3; ++c)
+		{
+			pressure[c]  = _mm512_mask_add_ps(pressure[c], mask, pressure[c],
+			                                  _mm512_mul_ps(spiky, rij[c]));
+			viscosity[c] = _mm512_mask_add_ps(viscosity[c], mask, viscosity[c],
+			               _mm512_mul_ps(visc, _mm512_sub_ps(vj[c], VI[c])));
+		}
+		if(densityRate)
+		{
+			__m512 w  = _mm512_sub_ps(H2, r2);
+			__m512 vr = ZERO;
+			for(int c=0; c<3; ++c)
+				vr = _mm512_add_ps(vr, _mm512_mul_ps(rij[c],
+				                       _mm512_sub_ps(vj[c], VI[c])));
+			rate = _mm512_mask_add_ps(rate, mask, rate,
+			                          _mm512_mul_ps(_mm512_mul_ps(w, w), vr));
+		}
+	}
+
+	for(int c=0; c<3; ++c)
+	{
+		fPressure[c]  += _mm512_reduce_add_ps(pressure[c]);
+		fViscosity[c] += _mm512_reduce_add_ps(viscosity[c]);
+	}
+	if(densityRate)
+		*densityRate += _mm512_reduce_add_ps(rate);
+}
+
+// 16 words per iteration (the tail is masked, it may read the padding)
+_SPH_TARGET("avx512f")
+static int _decode_neighbours_avx512(int i,
+                                     const short *words,
+                                     int count,
+                                     int *neighbours,
+                                     int *wordCount)
+{
+	const __m512i ESCAPE = _mm512_set1_epi32(NEIGHBOUR_ESCAPE);
+	const __m512i I      = _mm512_set1_epi32(i);
+	__mmask16 escapes = 0;
+	int n = 0;
+	for(; n+16<=count; n+=16)
+	{
+		__m512i w = _mm512_cvtepi16_epi32(_mm256_loadu_si256(
+		                reinterpret_cast<const __m256i*>(words+n)));
+		escapes|= _mm512_cmpeq_epi32_mask(w, ESCAPE);
+		_mm512_storeu_si512(neighbours+n, _mm512_add_epi32(I, w));
+	}
+	if(n < count)
+	{
+		const __mmask16 VALID = __mmask16((1u << (count - n)) - 1u);
+		__m512i w = _mm512_cvtepi16_epi32(_mm256_loadu_si256(
+		                reinterpret_cast<const __m256i*>(words+n)));
+		escapes|= _mm512_mask_cmpeq_epi32_mask(VALID, w, ESCAPE);
+		_mm512_mask_storeu_epi32(neighbours+n, VALID, _mm512_add_epi32(I, w));
+	}
+	return _decode_escapes(i, words, count, 0 != escapes, neighbours,
+	                       wordCount);
+}
+#endif // _SPH_AVX512
+
+
+////////////////////////////////////////////////////////////////////////////////
+// check if the CPU (and the OS) supports an instruction set
+static bool _cpu_supports(SimdIsa simdIsa)
+{
+#if defined(__GNUC__) && defined(_SPH_AVX2)
+	__builtin_cpu_init();
+	if(SIMD_ISA_AVX2 == simdIsa)
+		return __builtin_cpu_supports("avx2");
+#	ifdef _SPH_AVX512
+	if(SIMD_ISA_AVX512 == simdIsa)
+		return __builtin_cpu_supports("avx512f");
+#	endif
+#elif defined(_MSC_VER) && defined(_SPH_AVX2)
+	int regs[4];
+	__cpuid(regs, 0);
+	if(regs[0] < 7)
+		return false;
+
+	// the OS must save the ymm (and zmm) registers
+	__cpuid(regs, 1);
+	if(0 == (regs[2] & (1<<27))) // osxsave
+		return false;
+	unsigned long long xcr0 = _xgetbv(0);
+	__cpuidex(regs, 7, 0);
+	if(SIMD_ISA_AVX2 == simdIsa)
+		return (xcr0 & 0x06) == 0x06 && 0 != (regs[1] & (1<<5));
+	if(SIMD_ISA_AVX512 == simdIsa)
+		return (xcr0 & 0xE6) == 0xE6 && 0 != (regs[1] & (1<<16));
+#endif
+	return SIMD_ISA_SCALAR == simdIsa;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Functions implementation
+//
+////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////
+// Instruction set names
+const char* simd_isa_name(SimdIsa simdIsa)
+{
+	return _SIMD_ISA_NAMES[simdIsa];
+}
+
+SimdIsa simd_isa_from_name(const char* name)
+{
+	for(int i=0; i<SIMD_ISA_COUNT; ++i)
+		if(0 == strcmp(name, _SIMD_ISA_NAMES[i]))
+			return SimdIsa(i);
+	return get_simd_isa_support();
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Widest instruction set
+SimdIsa get_simd_isa_support()
+{
+#ifdef _SPH_AVX512
+	if(_cpu_supports(SIMD_ISA_AVX512))
+		return SIMD_ISA_AVX512;
+#endif
+#ifdef _SPH_AVX2
+	if(_cpu_supports(SIMD_ISA_AVX2))
+		return SIMD_ISA_AVX2;
+#endif
+	return SIMD_ISA_SCALAR;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Kernels
+DensityKernel get_density_kernel(SimdIsa simdIsa)
+{
+#ifdef _SPH_AVX512
+	if(SIMD_ISA_AVX512 == simdIsa && _cpu_supports(simdIsa))
+		return &_density_avx512;
+#endif
+#ifdef _SPH_AVX2
+	if(SIMD_ISA_AVX2 == simdIsa && _cpu_supports(simdIsa))
+		return &_density_avx2;
+#endif
+	return &_density_scalar;
+}
+
+ForceKernel get_force_kernel(SimdIsa simdIsa)
+{
+#ifdef _SPH_AVX512
+	if(SIMD_ISA_AVX512 == simdIsa && _cpu_supports(simdIsa))
+		return &_force_avx512;
+#endif
+#ifdef _SPH_AVX2
+	if(SIMD_ISA_AVX2 == simdIsa && _cpu_supports(simdIsa))
+		return &_force_avx2;
+#endif
+	return &_force_scalar;
+}
+
+NeighbourDecoder get_neighbour_decoder(SimdIsa simdIsa)
+{
+#ifdef _SPH_AVX512
+	if(SIMD_ISA_AVX512 == simdIsa && _cpu_supports(simdIsa))
+		return &_decode_neighbours_avx512;
+#endif
+#ifdef _SPH_AVX2
+	if(SIMD_ISA_AVX2 == simdIsa && _cpu_supports(simdIsa))
+		return &_decode_neighbours_avx2;
+#endif
+	return &_decode_neighbours_scalar;
+}
+
+
+} // namespace sph
+
@@ -0,0 +1,90 @@
+////////////////////////////////////////////////////////////////////////////////
+// \author   Jonathan Dupuy
+// \brief    SPH kernels of the CPU solver, evaluated over packets of
+//           neighbour candidates. The widest instruction set supported by
+//           the CPU is picked at runtime (scalar fallback).
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef SPH_KERNELS_HPP
+#define SPH_KERNELS_HPP
+
+#include "SphParticles.hpp"
+
+namespace sph
+{
+	// Instruction sets
+	enum SimdIsa
+	{
+		SIMD_ISA_SCALAR = 0, // no vector instructions
+		SIMD_ISA_AVX2,       // 8 lanes
+		SIMD_ISA_AVX512,     // 16 lanes
+		SIMD_ISA_COUNT
+	};
+
+	// Instruction set names ("scalar", "avx2" or "avx512")
+	const char* simd_isa_name(SimdIsa simdIsa);
+	SimdIsa     simd_isa_from_name(const char* name); // widest if unknown
+
+	// Widest instruction set supported by both the build and the CPU
+	SimdIsa get_simd_isa_support();
+
+
+	// Per particle arguments of the force kernel
+	struct ForceKernelArgs
+	{
+		float smoothingLength;        // h
+		float smoothingLengthSquared; // h2
+		float k;                      // pressure constant
+		float restDensity;            // rest density
+		float pressure;               // pressure of the particle
+	};
+
+	// Sum of (h2-r2)^3 over the neighbours of particle i
+	// (particle i is skipped if present). If pairs is not NULL, the
+	// neighbours within h are also written to it, in order (count entries
+	// at most), and their number is returned in pairCount.
+	typedef float (*DensityKernel)(const ParticleArrays& particles,
+	                               int i,
+	                               const int *neighbours,
+	                               int count,
+	                               float h2,
+	                               int *pairs,
+	                               int *pairCount);
+
+	// Accumulate the pressure and viscosity sums of particle i, and the sum
+	// of (h2-r2)^2 (vj-vi).rij of the continuity equation if densityRate is
+	// not NULL (results are added to the outputs)
+	typedef void (*ForceKernel)(const ParticleArrays& particles,
+	                            int i,
+	                            const int *neighbours,
+	                            int count,
+	                            const ForceKernelArgs& args,
+	                            float *fPressure,
+	                            float *fViscosity,
+	                            float *densityRate);
+
+	// Compressed neighbour lists: neighbour j of particle i is stored as the
+	// delta j - i on 16 bits, or as the escape code followed by the low and
+	// high halves of j if the delta does not fit
+	const short NEIGHBOUR_ESCAPE = -32768;
+	const int   NEIGHBOUR_PADDING = 16; // words readable past the last list
+
+	// Decode count words of the compressed list of particle i into
+	// neighbours (the last far neighbour may end past them); returns the
+	// number of neighbours, and the number of words read in wordCount
+	typedef int (*NeighbourDecoder)(int i,
+	                                const short *words,
+	                                int count,
+	                                int *neighbours,
+	                                int *wordCount);
+
+	// Kernels of an instruction set (scalar ones if unsupported)
+	DensityKernel    get_density_kernel(SimdIsa simdIsa);
+	ForceKernel      get_force_kernel(SimdIsa simdIsa);
+	NeighbourDecoder get_neighbour_decoder(SimdIsa simdIsa);
+
+} // namespace sph
+
+#endif
+
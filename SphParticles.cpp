@@ -0,0 +1,139 @@
+#include "SphParticles.hpp"
+
+#include <cstddef>   // size_t
+#include <algorithm> // std::copy
+
+namespace sph
+{
+////////////////////////////////////////////////////////////////////////////////
+// Local constants
+//
+////////////////////////////////////////////////////////////////////////////////
+
+// alignment of the arrays, in floats (64 bytes, a cache line / a zmm register)
+static const unsigned _ALIGNMENT = 16;
+
+
+////////////////////////////////////////////////////////////////////////////////
+// ParticleArrays implementation
+//
+////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////
+// Constructor
+ParticleArrays::ParticleArrays() :
+	mStorage(), mSize(0), mStride(0)
+{
+}
+
+ParticleArrays::ParticleArrays(const ParticleArrays& particles) :
+	mStorage(), mSize(0), mStride(0)
+{
+	*this = particles;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Copy
+ParticleArrays& ParticleArrays::operator=(const ParticleArrays& particles)
+{
+	if(this == &particles)
+		return *this;
+
+	Resize(particles.mSize);
+	for(int a=0; a<PARTICLE_ATTRIBUTE_COUNT; ++a)
+		std::copy(particles[a], particles[a]+mSize, _Array(a));
+	return *this;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Resize
+void ParticleArrays::Resize(unsigned size)
+{
+	mSize   = size;
+	mStride = (size + _ALIGNMENT - 1) / _ALIGNMENT * _ALIGNMENT;
+	mStorage.resize(mStride * PARTICLE_ATTRIBUTE_COUNT + _ALIGNMENT);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Arrays
+float* ParticleArrays::operator[](int attribute)
+{
+	return _Array(attribute);
+}
+
+const float* ParticleArrays::operator[](int attribute) const
+{
+	return _Array(attribute);
+}
+
+float* ParticleArrays::_Array(int attribute) const
+{
+	if(mStorage.empty())
+		return NULL;
+
+	const size_t ALIGNMENT = _ALIGNMENT * sizeof(float);
+	const float *storage   = &mStorage[0];
+	size_t misalignment    = reinterpret_cast<size_t>(storage) % ALIGNMENT;
+	size_t offset          = misalignment ? (ALIGNMENT - misalignment)
+	                                        / sizeof(float) : 0;
+	return const_cast<float*>(storage) + offset + attribute * mStride;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Load from the GL layout
+void ParticleArrays::Load(const Vector4 *data0,
+                          const Vector4 *data1,
+                          unsigned size)
+{
+	Resize(size);
+	for(int c=0; c<4; ++c)
+	{
+		float *attribute0 = _Array(PARTICLE_X + c);
+		float *attribute1 = _Array(PARTICLE_VX + c);
+		for(unsigned i=0; i<size; ++i)
+		{
+			attribute0[i] = data0[i][c];
+			attribute1[i] = data1[i][c];
+		}
+	}
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Size
+unsigned ParticleArrays::Size() const
+{
+	return mSize;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Stride
+unsigned ParticleArrays::Stride() const
+{
+	return mStride;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Store to the GL layout
+void ParticleArrays::Store(Vector4 *data0, Vector4 *data1) const
+{
+	for(int c=0; c<4; ++c)
+	{
+		const float *attribute0 = _Array(PARTICLE_X + c);
+		const float *attribute1 = _Array(PARTICLE_VX + c);
+		for(unsigned i=0; data0 && i<mSize; ++i)
+			data0[i][c] = attribute0[i];
+		for(unsigned i=0; data1 && i<mSize; ++i)
+			data1[i][c] = attribute1[i];
+	}
+}
+
+
+} // namespace sph
+
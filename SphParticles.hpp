@@ -0,0 +1,75 @@
+////////////////////////////////////////////////////////////////////////////////
+// \author   Jonathan Dupuy
+// \brief    Structure of arrays particle storage for the CPU. Each attribute
+//           is a separate, 64 byte aligned array; the interleaved Vector4
+//           layout of the GL buffers is only used at upload / download.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef SPH_PARTICLES_HPP
+#define SPH_PARTICLES_HPP
+
+#include "Algebra.hpp"
+
+#include <vector>
+
+namespace sph
+{
+	// Particle attributes (GL layout: pos + density, velocity + |acceleration|)
+	enum ParticleAttribute
+	{
+		PARTICLE_X = 0,
+		PARTICLE_Y,
+		PARTICLE_Z,
+		PARTICLE_DENSITY,
+		PARTICLE_VX,
+		PARTICLE_VY,
+		PARTICLE_VZ,
+		PARTICLE_ACCELERATION, // |acceleration|
+		PARTICLE_TIME_LEVEL,   // dt level of block time stepping (CPU only)
+		PARTICLE_ATTRIBUTE_COUNT
+	};
+
+
+	// Particle arrays
+	class ParticleArrays
+	{
+	public:
+		// Constructors / Destructor
+		ParticleArrays();
+		ParticleArrays(const ParticleArrays& particles);
+
+		// Operators (the alignment offset depends on the storage address,
+		// so arrays are copied one by one)
+		ParticleArrays& operator=(const ParticleArrays& particles);
+
+		// Manipulation
+			// set the number of particles (contents are undefined)
+		void Resize(unsigned size);
+			// array of an attribute
+		float* operator[](int attribute);
+			// copy from the GL layout (pos + density, velocity + reserved)
+		void Load(const Vector4 *data0, const Vector4 *data1, unsigned size);
+
+		// Queries
+		unsigned     Size() const;
+			// floats between two arrays (the components of a vector)
+		unsigned     Stride() const;
+		const float* operator[](int attribute) const;
+			// copy to the GL layout (buffers may be mapped, either may be NULL)
+		void Store(Vector4 *data0, Vector4 *data1) const;
+
+	private:
+		// Internal queries
+		float* _Array(int attribute) const;
+
+		// Members
+		std::vector<float> mStorage;
+		unsigned           mSize;
+		unsigned           mStride; // floats between two arrays
+	};
+
+} // namespace sph
+
+#endif
+
@@ -0,0 +1,246 @@
+#include "SphScheduler.hpp"
+
+#include <ctime>     // std::clock
+
+#ifdef _OPENMP
+#	include <omp.h>
+#endif // _OPENMP
+
+namespace sph
+{
+////////////////////////////////////////////////////////////////////////////////
+// Functions implementation
+//
+////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////
+// Wall clock time
+double get_wall_time()
+{
+#ifdef _OPENMP
+	return omp_get_wtime();
+#else
+	return static_cast<double>(std::clock()) / CLOCKS_PER_SEC;
+#endif
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// BlockScheduler implementation
+//
+////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////
+// Worker: blocks [begin, end) are left, the owner pops at the front and the
+// thieves take the back half
+struct BlockScheduler::_Worker
+{
+	_Worker() : begin(0), end(0)
+	{
+#ifdef _OPENMP
+		omp_init_lock(&lock);
+#endif
+		ResetCounters();
+	}
+
+	~_Worker()
+	{
+#ifdef _OPENMP
+		omp_destroy_lock(&lock);
+#endif
+	}
+
+	void Lock()
+	{
+#ifdef _OPENMP
+		omp_set_lock(&lock);
+#endif
+	}
+
+	void Unlock()
+	{
+#ifdef _OPENMP
+		omp_unset_lock(&lock);
+#endif
+	}
+
+	void ResetCounters()
+	{
+		counters.busyTime   = 0.0;
+		counters.idleTime   = 0.0;
+		counters.blockCount = 0;
+		counters.stealCount = 0;
+	}
+
+	int begin;
+	int end;
+#ifdef _OPENMP
+	omp_lock_t lock;
+#endif
+	WorkerCounters counters;
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Constructor
+BlockScheduler::BlockScheduler() :
+	mWorkers()
+{
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Destructor
+BlockScheduler::~BlockScheduler()
+{
+	_SetWorkerCount(0);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Run
+void BlockScheduler::Run(int blockCount, BlockTask& task)
+{
+#ifdef _OPENMP
+	_SetWorkerCount(omp_get_max_threads());
+#else
+	_SetWorkerCount(1);
+#endif
+	const int WORKERS = WorkerCount();
+
+	// even split
+	for(int w=0; w<WORKERS; ++w)
+	{
+		mWorkers[w]->begin = static_cast<int>(
+		                     static_cast<long long>(blockCount) * w / WORKERS);
+		mWorkers[w]->end   = static_cast<int>(
+		                     static_cast<long long>(blockCount) * (w+1) / WORKERS);
+	}
+
+	// run (the blocks of missing threads are stolen)
+	const double START = get_wall_time();
+	std::vector<double> busyTimes(WORKERS, 0.0);
+#pragma omp parallel num_threads(WORKERS)
+	{
+#ifdef _OPENMP
+		const int WORKER = omp_get_thread_num();
+#else
+		const int WORKER = 0;
+#endif
+		WorkerCounters& counters = mWorkers[WORKER]->counters;
+
+		for(;;)
+		{
+			int block = _Pop(WORKER);
+			if(-1 == block)
+			{
+				if(!_Steal(WORKER))
+					break;
+				++counters.stealCount;
+				continue;
+			}
+
+			double start = get_wall_time();
+			task.Run(block, WORKER);
+			busyTimes[WORKER]+= get_wall_time() - start;
+			++counters.blockCount;
+		}
+	}
+
+	// workers are idle when they are not running tasks
+	const double TIME = get_wall_time() - START;
+	for(int w=0; w<WORKERS; ++w)
+	{
+		mWorkers[w]->counters.busyTime+= busyTimes[w];
+		mWorkers[w]->counters.idleTime+= TIME - busyTimes[w];
+	}
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Reset counters
+void BlockScheduler::ResetCounters()
+{
+	for(size_t w=0; w<mWorkers.size(); ++w)
+		mWorkers[w]->ResetCounters();
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Queries
+int BlockScheduler::WorkerCount() const
+{
+	return static_cast<int>(mWorkers.size());
+}
+
+const WorkerCounters& BlockScheduler::Counters(int worker) const
+{
+	return mWorkers[worker]->counters;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Set the number of workers (counters are kept for the remaining ones)
+void BlockScheduler::_SetWorkerCount(int workerCount)
+{
+	const int WORKERS = static_cast<int>(mWorkers.size());
+	for(int w=workerCount; w<WORKERS; ++w)
+		delete mWorkers[w];
+	mWorkers.resize(workerCount, NULL);
+	for(int w=WORKERS; w<workerCount; ++w)
+		mWorkers[w] = new _Worker();
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Pop the next block of a worker (-1 if there is none)
+int BlockScheduler::_Pop(int worker)
+{
+	_Worker& self = *mWorkers[worker];
+	int block     = -1;
+
+	self.Lock();
+	if(self.begin < self.end)
+		block = self.begin++;
+	self.Unlock();
+	return block;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Steal the back half of the blocks of the first worker which has some
+// (returns false if all the workers are out of blocks)
+bool BlockScheduler::_Steal(int worker)
+{
+	const int WORKERS = WorkerCount();
+
+	for(int n=1; n<WORKERS; ++n)
+	{
+		_Worker& victim = *mWorkers[(worker + n) % WORKERS];
+		int begin = 0, end = 0;
+
+		victim.Lock();
+		if(victim.begin < victim.end)
+		{
+			end          = victim.end;
+			begin        = end - (end - victim.begin + 1) / 2;
+			victim.end   = begin;
+		}
+		victim.Unlock();
+
+		if(begin < end)
+		{
+			_Worker& self = *mWorkers[worker];
+			self.Lock();
+			self.begin = begin;
+			self.end   = end;
+			self.Unlock();
+			return true;
+		}
+	}
+	return false;
+}
+
+
+} // namespace sph
+
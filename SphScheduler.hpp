@@ -0,0 +1,78 @@
+////////////////////////////////////////////////////////////////////////////////
+// \author   Jonathan Dupuy
+// \brief    Work stealing scheduler of the CPU solver. Blocks of work are
+//           split evenly among the workers (the OpenMP threads); a worker
+//           that runs out of blocks steals half of the blocks left to
+//           another one. Busy and idle times are recorded per worker.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef SPH_SCHEDULER_HPP
+#define SPH_SCHEDULER_HPP
+
+#include <vector>
+
+namespace sph
+{
+	// Wall clock time, in seconds (OpenMP timer, process time without it)
+	double get_wall_time();
+
+
+	// Task run on each block
+	class BlockTask
+	{
+	public:
+		virtual ~BlockTask() {}
+		virtual void Run(int block, int worker) = 0;
+	};
+
+
+	// Counters of a worker (accumulated over the runs)
+	struct WorkerCounters
+	{
+		double   busyTime;   // seconds spent in tasks
+		double   idleTime;   // seconds spent looking for / waiting for work
+		unsigned blockCount; // blocks run
+		unsigned stealCount; // successful steals
+	};
+
+
+	// Block scheduler
+	class BlockScheduler
+	{
+	public:
+		// Constructors / Destructor
+		BlockScheduler();
+		~BlockScheduler();
+
+		// Manipulation
+			// run the task on blocks [0, blockCount) (returns once all are done)
+		void Run(int blockCount, BlockTask& task);
+			// reset the counters of all the workers
+		void ResetCounters();
+
+		// Queries
+		int                   WorkerCount() const;
+		const WorkerCounters& Counters(int worker) const;
+
+	private:
+		// Non copyable
+		BlockScheduler(const BlockScheduler& scheduler);
+		BlockScheduler& operator=(const BlockScheduler& scheduler);
+
+		// Internal types
+		struct _Worker; // blocks left (locked range) and counters
+
+		// Internal manipulation
+		void _SetWorkerCount(int workerCount);
+		int  _Pop(int worker);
+		bool _Steal(int worker);
+
+		// Members
+		std::vector<_Worker*> mWorkers;
+	};
+
+} // namespace sph
+
+#endif
+
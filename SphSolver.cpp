@@ -0,0 +1,3177 @@
+#include "SphSolver.hpp"
+
+#include <cmath>     // std::sqrt std::floor std::fabs std::exp
+#include <cfloat>    // FLT_MAX
+#include <limits>    // std::numeric_limits
+#include <cstring>   // strcmp
+#include <algorithm> // std::min std::max std::fill std::copy std::sort
+#include <utility>   // std::pair
+
+#ifdef _OPENMP
+#	include <omp.h>
+#endif // _OPENMP
+
+namespace sph
+{
+////////////////////////////////////////////////////////////////////////////////
+// Local functions / constants
+//
+////////////////////////////////////////////////////////////////////////////////
+
+// boundary layer width (see EPSILON in sph_force.glsl)
+static const float _BOUNDARY_EPSILON = 0.5f;
+
+// distance to the walls at which particles get clamped
+static const float _BOUNDARY_CLAMP = 0.05f;
+
+// gravity acceleration (cm/s^2 scaled as in gravity_force())
+static const float _GRAVITY = 9.81f;
+
+// safety factors of the CFL, force and viscosity conditions on dt
+static const float _CFL_FACTOR       = 0.4f;
+static const float _FORCE_FACTOR     = 0.25f;
+static const float _VISCOSITY_FACTOR = 0.125f;
+
+// bounds of the iterations of the pressure solvers
+static const unsigned _MIN_PRESSURE_ITERATIONS = 3;
+static const unsigned _MAX_PRESSURE_ITERATIONS = 100;
+
+// relaxation of the IISPH and DFSPH iterations (0.5 and 1 in the papers
+// diverge with the ~80 neighbours of the default smoothing length)
+static const float _JACOBI_RELAXATION = 0.25f;
+
+// neighbours below which the DFSPH divergence solve leaves particles alone
+// (free surface, splashes)
+static const int _DFSPH_MIN_NEIGHBOURS = 20;
+
+// under relaxation of the PBF constraint projection (the epsilon of Macklin
+// and Mueller 2013, relative to the constraint gradient)
+static const float _PBF_RELAXATION = 1.0f;
+
+// maximum number of dt levels (block time stepping)
+static const unsigned _MAX_TIME_LEVELS = 8;
+
+// cells per block of the work stealing scheduler
+static const int _BLOCK_CELLS = 64;
+
+// forward half of the 26 neighbour cells (the other half sees the cell in
+// its own forward half)
+static const int _HALF_SHELL_SIZE = 13;
+static const int _HALF_SHELL[_HALF_SHELL_SIZE][3] = {
+	{ 1, 0, 0},
+	{-1, 1, 0}, { 0, 1, 0}, { 1, 1, 0},
+	{-1,-1, 1}, { 0,-1, 1}, { 1,-1, 1},
+	{-1, 0, 1}, { 0, 0, 1}, { 1, 0, 1},
+	{-1, 1, 1}, { 0, 1, 1}, { 1, 1, 1}
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+// a density error is not finite once a solve has diverged (NaN compares
+// false, so it would pass for converged)
+static inline bool _is_diverged(float error)
+{
+	return !(std::fabs(error) <= FLT_MAX);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// compute the pressure for a given density
+static inline float _pressure(float k, float d, float d0)
+{
+	return k * (d - d0);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// integrate the continuity equation: d(ln d)/dt is the velocity divergence,
+// so the density is scaled rather than offset and never reaches 0 (the force
+// kernels divide by it); a particle without neighbours has no density to scale
+static inline float _integrate_density(float d, float increment)
+{
+	return d > 0.0f ? d * std::exp(increment / d)
+	                : std::max(increment, 0.0f);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// get the position of a particle
+static inline void _get_position(const ParticleArrays& particles,
+                                 int i,
+                                 float *position)
+{
+	position[0] = particles[PARTICLE_X][i];
+	position[1] = particles[PARTICLE_Y][i];
+	position[2] = particles[PARTICLE_Z][i];
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// compute the boundary force for one axis (see boundary_force())
+static inline float _boundary_force(float ri,
+                                    float vi,
+                                    float boundsMin,
+                                    float boundsMax,
+                                    float stiffness,
+                                    float dampening)
+{
+	float force = 0.0f;
+	float d     = _BOUNDARY_EPSILON - ri + boundsMin;
+	force += std::max(d, 0.0f) * (stiffness*d - dampening*vi);
+	d      = _BOUNDARY_EPSILON + ri - boundsMax;
+	force -= std::max(d, 0.0f) * (stiffness*d + dampening*vi);
+	return force;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// collect neighbour candidates in packets for the SIMD kernels
+// (Derived::Flush() consumes a full packet)
+static const int _PACKET_SIZE = 64;
+
+template<typename Derived>
+struct _PacketVisitor
+{
+	_PacketVisitor() : size(0) {}
+
+	void operator()(int j)
+	{
+		packet[size++] = j;
+		if(_PACKET_SIZE == size)
+			static_cast<Derived*>(this)->Flush();
+	}
+
+	void operator()(const int *neighbours, int count)
+	{
+		while(count > 0)
+		{
+			int n = std::min(count, _PACKET_SIZE - size);
+			std::copy(neighbours, neighbours+n, packet+size);
+			size      += n;
+			neighbours+= n;
+			count     -= n;
+			if(_PACKET_SIZE == size)
+				static_cast<Derived*>(this)->Flush();
+		}
+	}
+
+	int size;
+	int packet[_PACKET_SIZE];
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+// accumulate the density of a particle (see eval_density()), and record its
+// neighbours within h if requested
+struct _DensityVisitor : public _PacketVisitor<_DensityVisitor>
+{
+	_DensityVisitor(const ParticleArrays& particles,
+	                int i,
+	                float h2,
+	                DensityKernel kernel) :
+		particles(particles), i(i), h2(h2), kernel(kernel), density(0.0f),
+		pairs(NULL), capacity(0), pairCount(0), candidateCount(0)
+	{}
+
+	// record the neighbours within h in pairs (capacity entries, pairCount
+	// is the number of neighbours even if they do not fit)
+	void Record(int *pairs, int capacity)
+	{
+		this->pairs    = pairs;
+		this->capacity = capacity;
+	}
+
+	void Flush()
+	{
+		if(!pairs)
+		{
+			density+= kernel(particles, i, packet, size, h2, NULL, NULL);
+			size     = 0;
+			return;
+		}
+
+		// the kernel writes in place if the whole packet fits
+		int found = 0;
+		int *out  = capacity - pairCount >= size ? pairs + pairCount : spill;
+		density+= kernel(particles, i, packet, size, h2, out, &found);
+		if(spill == out && pairCount < capacity)
+			std::copy(spill,
+			          spill + std::min(found, capacity - pairCount),
+			          pairs + pairCount);
+		pairCount     += found;
+		candidateCount+= size;
+		size           = 0;
+	}
+
+	const ParticleArrays& particles;
+	int           i;
+	float         h2;
+	DensityKernel kernel;
+	float         density;
+	int *pairs;
+	int capacity;
+	int pairCount;
+	int candidateCount;
+	int spill[_PACKET_SIZE];
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+// accumulate the pressure and viscosity forces of a particle (see
+// sph_forces()), and the density rate sum of the continuity equation if
+// requested
+struct _ForceVisitor : public _PacketVisitor<_ForceVisitor>
+{
+	_ForceVisitor(const ParticleArrays& particles,
+	              int i,
+	              const Constants& constants,
+	              ForceKernel kernel,
+	              bool continuity) :
+		particles(particles), i(i), kernel(kernel), continuity(continuity),
+		densityRate(0.0f)
+	{
+		args.smoothingLength        = constants.smoothingLength;
+		args.smoothingLengthSquared = constants.smoothingLengthSquared;
+		args.k                      = constants.k;
+		args.restDensity            = constants.restDensity;
+		args.pressure               = _pressure(constants.k,
+		                                        particles[PARTICLE_DENSITY][i],
+		                                        constants.restDensity);
+		for(int c=0; c<3; ++c)
+			fPressure[c] = fViscosity[c] = 0.0f;
+	}
+
+	void Flush()
+	{
+		kernel(particles, i, packet, size, args, fPressure, fViscosity,
+		       continuity ? &densityRate : NULL);
+		size = 0;
+	}
+
+	const ParticleArrays& particles;
+	int             i;
+	ForceKernel     kernel;
+	ForceKernelArgs args;
+	bool  continuity;
+	float fPressure[3];
+	float fViscosity[3];
+	float densityRate;
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+// accumulate the viscosity force of a particle (see sph_forces()) and the
+// sum of its weights (h - r) / dj, the rate at which the force pulls the
+// velocity towards the weighted mean of the neighbours
+struct _ViscosityVisitor
+{
+	_ViscosityVisitor(const ParticleArrays& particles,
+	                  int i,
+	                  const Constants& constants) :
+		d(particles[PARTICLE_DENSITY]), i(i), constants(constants),
+		weight(0.0f)
+	{
+		for(int c=0; c<3; ++c)
+		{
+			r[c] = particles[PARTICLE_X+c];
+			v[c] = particles[PARTICLE_VX+c];
+			fViscosity[c] = 0.0f;
+		}
+	}
+
+	void operator()(int j)
+	{
+		float rij[3] = {r[0][i]-r[0][j], r[1][i]-r[1][j], r[2][i]-r[2][j]};
+		float r2     = rij[0]*rij[0] + rij[1]*rij[1] + rij[2]*rij[2];
+
+		if(r2 >= constants.smoothingLengthSquared || r2 == 0.0f
+		|| d[j] <= 0.0f)
+			return;
+
+		float w = (constants.smoothingLength - std::sqrt(r2)) / d[j];
+		for(int c=0; c<3; ++c)
+			fViscosity[c]+= w * (v[c][j] - v[c][i]);
+		weight+= w;
+	}
+
+	void operator()(const int *candidates, int size)
+	{
+		for(int n=0; n<size; ++n)
+			(*this)(candidates[n]);
+	}
+
+	const float *r[3];
+	const float *v[3];
+	const float *d;
+	int   i;
+	const Constants& constants;
+	float fViscosity[3];
+	float weight;
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+// accumulate the density sums of both particles of a pair (half shell)
+struct _DensityPairVisitor
+{
+	_DensityPairVisitor(const ParticleArrays& particles, float h2) :
+		x(particles[PARTICLE_X]), y(particles[PARTICLE_Y]),
+		z(particles[PARTICLE_Z]), h2(h2)
+	{}
+
+	void operator()(int i, int j, float *sums) const
+	{
+		float rij[3] = {x[i]-x[j], y[i]-y[j], z[i]-z[j]};
+		float dist2  = h2 - (rij[0]*rij[0] + rij[1]*rij[1] + rij[2]*rij[2]);
+		if(dist2 > 0.0f)
+		{
+			float w  = dist2*dist2*dist2;
+			sums[i] += w;
+			sums[j] += w;
+		}
+	}
+
+	const float *x;
+	const float *y;
+	const float *z;
+	float h2;
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+// accumulate the pressure and viscosity sums of both particles of a pair
+// (half shell, sums hold the pressure then the viscosity components, then
+// the density rate sums if requested)
+struct _ForcePairVisitor
+{
+	_ForcePairVisitor(const ParticleArrays& particles,
+	                  const Constants& constants,
+	                  bool continuity) :
+		d(particles[PARTICLE_DENSITY]), constants(constants),
+		count(static_cast<int>(particles.Size())), continuity(continuity)
+	{
+		for(int c=0; c<3; ++c)
+		{
+			r[c] = particles[PARTICLE_X+c];
+			v[c] = particles[PARTICLE_VX+c];
+		}
+	}
+
+	void operator()(int i, int j, float *sums) const
+	{
+		float rij[3] = {r[0][i]-r[0][j], r[1][i]-r[1][j], r[2][i]-r[2][j]};
+		float r2     = rij[0]*rij[0] + rij[1]*rij[1] + rij[2]*rij[2];
+
+		// kernels vanish beyond h (and are undefined at r=0)
+		if(r2 >= constants.smoothingLengthSquared || r2 == 0.0f)
+			return;
+
+		// same terms as the force kernels, 1/d of the other particle apart
+		float rn    = std::sqrt(r2);
+		float hr    = constants.smoothingLength - rn;
+		float invDi = 1.0f/d[i];
+		float invDj = 1.0f/d[j];
+		float spiky = ( _pressure(constants.k, d[i], constants.restDensity)
+		              + _pressure(constants.k, d[j], constants.restDensity))
+		            * hr * hr / rn;
+		float rate  = 0.0f;
+		for(int c=0; c<3; ++c)
+		{
+			float *fPressure  = &sums[c*count];
+			float *fViscosity = &sums[(3+c)*count];
+			float vij = v[c][j] - v[c][i];
+			fPressure[i]  += spiky * invDj * rij[c];
+			fPressure[j]  -= spiky * invDi * rij[c];
+			fViscosity[i] += hr * invDj * vij;
+			fViscosity[j] -= hr * invDi * vij;
+			rate          += vij * rij[c];
+		}
+
+		// (h2-r2)^2 vij.rij is symmetric
+		if(continuity)
+		{
+			float w = constants.smoothingLengthSquared - r2;
+			sums[6*count + i] += w * w * rate;
+			sums[6*count + j] += w * w * rate;
+		}
+	}
+
+	const float *r[3];
+	const float *v[3];
+	const float *d;
+	const Constants& constants;
+	int count;
+	bool continuity;
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+// accumulate the pressure acceleration of a particle from given pressures
+// (-m * sum (pi / di^2 + pj / dj^2) * gradSpiky; densities may be NULL to
+// use the rest density, the form PCISPH is derived from)
+struct _PressureVisitor
+{
+	_PressureVisitor(const ParticleArrays& particles,
+	                 const float *pressures,
+	                 const float *densities,
+	                 int i,
+	                 const Constants& constants) :
+		x(particles[PARTICLE_X]), y(particles[PARTICLE_Y]),
+		z(particles[PARTICLE_Z]), pressures(pressures),
+		densities(densities), i(i), constants(constants),
+		scale(2.0f * constants.pressureConstants), ratio(Ratio(i))
+	{
+		acceleration[0] = acceleration[1] = acceleration[2] = 0.0f;
+	}
+
+	float Ratio(int j) const
+	{
+		float d = densities ? densities[j] : constants.restDensity;
+		return d > 0.0f ? pressures[j] / (d * d) : 0.0f;
+	}
+
+	void operator()(int j)
+	{
+		float rij[3] = {x[i]-x[j], y[i]-y[j], z[i]-z[j]};
+		float r2     = rij[0]*rij[0] + rij[1]*rij[1] + rij[2]*rij[2];
+
+		// kernels vanish beyond h (and are undefined at r=0)
+		if(r2 >= constants.smoothingLengthSquared || r2 == 0.0f)
+			return;
+
+		float rn = std::sqrt(r2);
+		float hr = constants.smoothingLength - rn;
+		float w  = scale * (ratio + Ratio(j)) * hr * hr / rn;
+		for(int c=0; c<3; ++c)
+			acceleration[c]+= w * rij[c];
+	}
+
+	void operator()(const int *candidates, int size)
+	{
+		for(int n=0; n<size; ++n)
+			(*this)(candidates[n]);
+	}
+
+	const float *x;
+	const float *y;
+	const float *z;
+	const float *pressures;
+	const float *densities;
+	int   i;
+	const Constants& constants;
+	float scale;
+	float ratio; // pi / di^2
+	float acceleration[3];
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+// accumulate the mass weighted spiky gradients Gij = m gradWij of a particle
+// and the divergence sum (ui - uj).Gij of a vector field (components are
+// stride floats apart)
+struct _GradientVisitor
+{
+	_GradientVisitor(const ParticleArrays& particles,
+	                 const float *field,
+	                 int stride,
+	                 int i,
+	                 const Constants& constants) :
+		x(particles[PARTICLE_X]), y(particles[PARTICLE_Y]),
+		z(particles[PARTICLE_Z]), field(field),
+		stride(stride), i(i), constants(constants),
+		scale(-2.0f * constants.pressureConstants),
+		gradientNorm2(0.0f), divergence(0.0f), count(0)
+	{
+		gradient[0] = gradient[1] = gradient[2] = 0.0f;
+	}
+
+	void operator()(int j)
+	{
+		float rij[3] = {x[i]-x[j], y[i]-y[j], z[i]-z[j]};
+		float r2     = rij[0]*rij[0] + rij[1]*rij[1] + rij[2]*rij[2];
+
+		if(r2 >= constants.smoothingLengthSquared || r2 == 0.0f)
+			return;
+
+		float rn = std::sqrt(r2);
+		float hr = constants.smoothingLength - rn;
+		float w  = scale * hr * hr / rn;
+		for(int c=0; c<3; ++c)
+		{
+			gradient[c]+= w * rij[c];
+			divergence += ( field[c*stride + i] - field[c*stride + j] )
+			            * w * rij[c];
+		}
+		gradientNorm2+= w * w * r2;
+		++count;
+	}
+
+	void operator()(const int *candidates, int size)
+	{
+		for(int n=0; n<size; ++n)
+			(*this)(candidates[n]);
+	}
+
+	const float *x;
+	const float *y;
+	const float *z;
+	const float *field;
+	int   stride;
+	int   i;
+	const Constants& constants;
+	float scale;
+	float gradient[3];   // sum Gij
+	float gradientNorm2; // sum |Gij|^2
+	float divergence;
+	int   count;         // neighbours within h
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+// accumulate the PCISPH factor of a particle: the density change of a unit
+// pressure is -2 (dt m / d0)^2 * factor (grad of the density kernel dot grad
+// of the pressure kernel, see _PressureVisitor)
+struct _PcisphFactorVisitor
+{
+	_PcisphFactorVisitor(const ParticleArrays& particles,
+	                     int i,
+	                     const Constants& constants) :
+		x(particles[PARTICLE_X]), y(particles[PARTICLE_Y]),
+		z(particles[PARTICLE_Z]), i(i), constants(constants),
+		gradDensity(constants.gradDensityConstants / constants.particleMass),
+		gradPressure(-2.0f * constants.pressureConstants
+		             / constants.particleMass),
+		dots(0.0f)
+	{
+		for(int c=0; c<3; ++c)
+			densitySum[c] = pressureSum[c] = 0.0f;
+	}
+
+	void operator()(int j)
+	{
+		float rij[3] = {x[i]-x[j], y[i]-y[j], z[i]-z[j]};
+		float r2     = rij[0]*rij[0] + rij[1]*rij[1] + rij[2]*rij[2];
+
+		if(r2 >= constants.smoothingLengthSquared || r2 == 0.0f)
+			return;
+
+		float rn = std::sqrt(r2);
+		float hr = constants.smoothingLength - rn;
+		float h2 = constants.smoothingLengthSquared - r2;
+		float wd = gradDensity * h2 * h2;
+		float wp = gradPressure * hr * hr / rn;
+		for(int c=0; c<3; ++c)
+		{
+			densitySum[c] += wd * rij[c];
+			pressureSum[c]+= wp * rij[c];
+		}
+		dots+= wd * wp * r2;
+	}
+
+	void operator()(const int *candidates, int size)
+	{
+		for(int n=0; n<size; ++n)
+			(*this)(candidates[n]);
+	}
+
+	float Factor() const
+	{
+		return dots + densitySum[0]*pressureSum[0]
+		            + densitySum[1]*pressureSum[1]
+		            + densitySum[2]*pressureSum[2];
+	}
+
+	const float *x;
+	const float *y;
+	const float *z;
+	int   i;
+	const Constants& constants;
+	float gradDensity;  // gradPoly6
+	float gradPressure; // gradSpiky
+	float densitySum[3];
+	float pressureSum[3];
+	float dots;
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+// compress neighbour j of particle i (see NEIGHBOUR_ESCAPE; particles are
+// sorted along the Z-order curve, so most neighbours are close in memory)
+static inline int _packed_size(int i, int j)
+{
+	const int DELTA = j - i;
+	return DELTA > NEIGHBOUR_ESCAPE && DELTA <= 32767 ? 1 : 3;
+}
+
+static inline int _pack_neighbour(int i, int j, short *packed)
+{
+	if(1 == _packed_size(i, j))
+	{
+		packed[0] = static_cast<short>(j - i);
+		return 1;
+	}
+	packed[0] = NEIGHBOUR_ESCAPE;
+	packed[1] = static_cast<short>(j & 0xFFFF);
+	packed[2] = static_cast<short>(j >> 16);
+	return 3;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// collect the neighbours of a particle within a radius (counts only if the
+// output array is NULL, upper half only keeps the neighbours j > i). If
+// packed is true, the neighbours are compressed and the count is in words.
+struct _NeighbourVisitor
+{
+	_NeighbourVisitor(const ParticleArrays& particles,
+	                  int i,
+	                  float radius2,
+	                  bool upperHalf,
+	                  bool packed,
+	                  void *neighbours) :
+		x(particles[PARTICLE_X]), y(particles[PARTICLE_Y]),
+		z(particles[PARTICLE_Z]), i(i), radius2(radius2),
+		upperHalf(upperHalf), packed(packed), neighbours(neighbours),
+		count(0)
+	{}
+
+	void operator()(int j)
+	{
+		if(j == i || (upperHalf && j < i))
+			return;
+
+		float rij[3] = {x[i]-x[j], y[i]-y[j], z[i]-z[j]};
+		if(rij[0]*rij[0] + rij[1]*rij[1] + rij[2]*rij[2] < radius2)
+		{
+			if(packed)
+				count+= neighbours
+				        ? _pack_neighbour(i, j,
+				                          static_cast<short*>(neighbours)
+				                          + count)
+				        : _packed_size(i, j);
+			else if(neighbours)
+				static_cast<int*>(neighbours)[count++] = j;
+			else
+				++count;
+		}
+	}
+
+	void operator()(const int *candidates, int size)
+	{
+		for(int n=0; n<size; ++n)
+			(*this)(candidates[n]);
+	}
+
+	const float *x;
+	const float *y;
+	const float *z;
+	int   i;
+	float radius2;
+	bool  upperHalf;
+	bool  packed;
+	void  *neighbours;
+	int   count;
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+// order of the particles in the sorted grid: by cell, then by index
+struct _CellOrder
+{
+	bool operator()(int i, int j) const
+	{
+		return cells[i] < cells[j] || (cells[i] == cells[j] && i < j);
+	}
+
+	const int *cells;
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Functions implementation
+//
+////////////////////////////////////////////////////////////////////////////////
+
+// names of the grid modes
+static const char* _GRID_MODE_NAMES[] = {"list", "sorted"};
+
+// names of the cell index modes
+static const char* _CELL_INDEX_NAMES[] = {"dense", "hash"};
+
+// names of the search modes
+static const char* _SEARCH_MODE_NAMES[] = {"27", "8"};
+
+// names of the pair modes
+static const char* _PAIR_MODE_NAMES[] = {"full", "half"};
+
+// names of the schedule modes
+static const char* _SCHEDULE_MODE_NAMES[] = {"static", "steal"};
+
+// names of the solver modes
+static const char* _SOLVER_MODE_NAMES[] = {"wcsph", "pcisph", "iisph",
+                                           "dfsph", "pbf"};
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Grid mode names
+const char* grid_mode_name(GridMode gridMode)
+{
+	return _GRID_MODE_NAMES[gridMode];
+}
+
+GridMode grid_mode_from_name(const char* name)
+{
+	for(int i=0; i<GRID_MODE_COUNT; ++i)
+		if(0 == strcmp(name, _GRID_MODE_NAMES[i]))
+			return GridMode(i);
+	return GRID_MODE_SORTED;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Cell index names
+const char* cell_index_name(CellIndexMode cellIndexMode)
+{
+	return _CELL_INDEX_NAMES[cellIndexMode];
+}
+
+CellIndexMode cell_index_from_name(const char* name)
+{
+	for(int i=0; i<CELL_INDEX_COUNT; ++i)
+		if(0 == strcmp(name, _CELL_INDEX_NAMES[i]))
+			return CellIndexMode(i);
+	return CELL_INDEX_DENSE;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Search mode names
+const char* search_mode_name(SearchMode searchMode)
+{
+	return _SEARCH_MODE_NAMES[searchMode];
+}
+
+SearchMode search_mode_from_name(const char* name)
+{
+	for(int i=0; i<SEARCH_MODE_COUNT; ++i)
+		if(0 == strcmp(name, _SEARCH_MODE_NAMES[i]))
+			return SearchMode(i);
+	return SEARCH_MODE_27;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Search cell size (a 2h cell holds the neighbours of the particles of its
+// octant in itself and in the 7 cells that share that corner)
+float get_search_cell_size(SearchMode searchMode, float smoothingLength)
+{
+	return SEARCH_MODE_8 == searchMode ? 2.0f * smoothingLength
+	                                   : smoothingLength;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Cell stencil
+void get_cell_stencil(SearchMode searchMode,
+                      const Vector3& bucket3dSize,
+                      std::vector<int>& offsets)
+{
+	const int STRIDES[3] = {1,
+	                        static_cast<int>(bucket3dSize[0]),
+	                        static_cast<int>(bucket3dSize[0]*bucket3dSize[1])};
+
+	offsets.clear();
+	if(SEARCH_MODE_8 == searchMode)
+	{
+		for(int octant=0; octant<8; ++octant)
+		for(int n=0; n<8; ++n)
+		{
+			int offset = 0;
+			for(int i=0; i<3; ++i)
+				if(n & (1 << i))
+					offset+= (octant & (1 << i)) ? STRIDES[i] : -STRIDES[i];
+			offsets.push_back(offset);
+		}
+		return;
+	}
+
+	for(int z=-1; z<2; ++z)
+	for(int y=-1; y<2; ++y)
+	for(int x=-1; x<2; ++x)
+		offsets.push_back(x*STRIDES[0] + y*STRIDES[1] + z*STRIDES[2]);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Hashed grid size (dimensions are doubled in turn)
+Vector3 get_hashed_grid_size(unsigned particleCount)
+{
+	unsigned size[3] = {8, 8, 8};
+
+	for(int i=0; size[0]*size[1]*size[2]*8 < particleCount; i=(i+1)%3)
+		size[i]*= 2;
+	return Vector3(size[0], size[1], size[2]);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Pair mode names
+const char* pair_mode_name(PairMode pairMode)
+{
+	return _PAIR_MODE_NAMES[pairMode];
+}
+
+PairMode pair_mode_from_name(const char* name)
+{
+	for(int i=0; i<PAIR_MODE_COUNT; ++i)
+		if(0 == strcmp(name, _PAIR_MODE_NAMES[i]))
+			return PairMode(i);
+	return PAIR_MODE_FULL;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Schedule mode names
+const char* schedule_mode_name(ScheduleMode scheduleMode)
+{
+	return _SCHEDULE_MODE_NAMES[scheduleMode];
+}
+
+ScheduleMode schedule_mode_from_name(const char* name)
+{
+	for(int i=0; i<SCHEDULE_MODE_COUNT; ++i)
+		if(0 == strcmp(name, _SCHEDULE_MODE_NAMES[i]))
+			return ScheduleMode(i);
+	return SCHEDULE_MODE_STATIC;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Solver mode names
+const char* solver_mode_name(SolverMode solverMode)
+{
+	return _SOLVER_MODE_NAMES[solverMode];
+}
+
+SolverMode solver_mode_from_name(const char* name)
+{
+	for(int i=0; i<SOLVER_MODE_COUNT; ++i)
+		if(0 == strcmp(name, _SOLVER_MODE_NAMES[i]))
+			return SolverMode(i);
+	return SOLVER_MODE_WCSPH;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Particle dt (the speed of sound of pressure() = k*(d - d0) is sqrt(k))
+float get_particle_ticks(const Constants& constants,
+                         float speed,
+                         float acceleration,
+                         float maxTicks)
+{
+	const float H = constants.smoothingLength;
+	float ticks = std::min(maxTicks, _CFL_FACTOR * H
+	                                 / (std::sqrt(constants.k) + speed));
+
+	if(acceleration > 0.0f)
+		ticks = std::min(ticks, _FORCE_FACTOR * std::sqrt(H / acceleration));
+	return ticks;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Adaptive dt
+float get_adaptive_ticks(const Constants& constants,
+                         float maxSpeed,
+                         float maxAcceleration,
+                         float maxTicks)
+{
+	float ticks = get_particle_ticks(constants,
+	                                 maxSpeed,
+	                                 maxAcceleration,
+	                                 maxTicks);
+	const float H = constants.smoothingLength;
+
+	if(constants.viscosity > 0.0f)
+		ticks = std::min(ticks, _VISCOSITY_FACTOR * H * H
+		                        * constants.particleMass
+		                        / constants.viscosity);
+	return ticks;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Morton code
+static unsigned _part_1_by_2(unsigned x)
+{
+	x&= 0x000003FF;
+	x = (x | (x << 16)) & 0x030000FF;
+	x = (x | (x <<  8)) & 0x0300F00F;
+	x = (x | (x <<  4)) & 0x030C30C3;
+	x = (x | (x <<  2)) & 0x09249249;
+	return x;
+}
+
+unsigned morton_code(unsigned x, unsigned y, unsigned z)
+{
+	return _part_1_by_2(x) | (_part_1_by_2(y) << 1) | (_part_1_by_2(z) << 2);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Morton ranks of the cells
+void get_cell_morton_ranks(const Vector3& bucket3dSize,
+                           std::vector<int>& ranks)
+{
+	const unsigned SIZE_X = static_cast<unsigned>(bucket3dSize[0]);
+	const unsigned SIZE_Y = static_cast<unsigned>(bucket3dSize[1]);
+	const unsigned SIZE_Z = static_cast<unsigned>(bucket3dSize[2]);
+	std::vector< std::pair<unsigned, int> > codes;
+
+	codes.reserve(SIZE_X*SIZE_Y*SIZE_Z);
+	for(unsigned z=0; z<SIZE_Z; ++z)
+	for(unsigned y=0; y<SIZE_Y; ++y)
+	for(unsigned x=0; x<SIZE_X; ++x)
+		codes.push_back(std::make_pair(morton_code(x,y,z),
+		                               static_cast<int>(codes.size())));
+	std::sort(codes.begin(), codes.end());
+
+	ranks.resize(codes.size());
+	for(size_t i=0; i<codes.size(); ++i)
+		ranks[codes[i].second] = static_cast<int>(i);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// CpuSolver implementation
+//
+////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////
+// Run a per particle method on the particles of blocks of cells
+struct CpuSolver::_CellBlockTask : public BlockTask
+{
+	_CellBlockTask(CpuSolver& solver, void (CpuSolver::*method)(int)) :
+		solver(solver), method(method)
+	{}
+
+	void Run(int block, int)
+	{
+		const int CELLS = solver._ScannedCellCount();
+		const int END   = std::min((block+1) * _BLOCK_CELLS, CELLS);
+
+		for(int c=block*_BLOCK_CELLS; c<END; ++c)
+		{
+			const int cell = solver._ScannedCell(c);
+			if(GRID_MODE_SORTED == solver.mGridMode)
+			{
+				for(int n=solver.mCellStarts[cell];
+				    n<solver.mCellStarts[cell+1];
+				    ++n)
+					(solver.*method)(solver.mSortedIndices[n]);
+			}
+			else
+			{
+				for(int j=solver.mHead[cell]; j!=-1; j=solver.mList[j])
+					(solver.*method)(j);
+			}
+		}
+	}
+
+	CpuSolver& solver;
+	void (CpuSolver::*method)(int);
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Constructor
+CpuSolver::CpuSolver() :
+	mConstants(), mGravityDir(0,-1,0), mTicks(0.0f), mMaxTicks(0.0f),
+	mAdaptiveTicks(false), mSolverMode(SOLVER_MODE_WCSPH),
+	mPressureTolerance(0.01f), mPressureIterationCount(0),
+	mPressureError(0.0f), mPcisphDelta(0.0f), mPbfIterationCount(4),
+	mDivergenceIterationCount(0),
+	mDivergenceError(0.0f), mDivergedSolveCount(0),
+	mDensitySolveTime(0.0), mDivergenceSolveTime(0.0),
+	mTimeLevelCount(1), mDensityFrequency(0), mDensityPassCount(0),
+	mDensityDrift(0.0f), mMaxDensityDrift(0.0f), mSubstep(0),
+	mForceEvaluationCount(0.0), mParticleCount(0),
+	mGridMode(GRID_MODE_SORTED), mCellIndexMode(CELL_INDEX_DENSE),
+	mSearchMode(SEARCH_MODE_27),
+	mBucket3dSize(0,0,0), mPairMode(PAIR_MODE_FULL),
+	mScheduleMode(SCHEDULE_MODE_STATIC), mScheduler(),
+	mReorderFrequency(0), mStepCount(0), mMaxMovedFraction(0.0f),
+	mSortedGridValid(false), mMovedFraction(0.0f), mGridRepairCount(0),
+	mOccupancy(false),
+	mNeighbourLists(false), mNeighbourListsValid(false), mNeighbourSkin(0.0f),
+	mNeighbourListBuildCount(0), mCompressedLists(false),
+	mPairCapacity(0), mPairCount(0.0),
+	mCandidateCount(0.0), mPairOverflowCount(0), mPingPong(0)
+{
+	SetSimdIsa(get_simd_isa_support());
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Set constants
+void CpuSolver::SetConstants(const Constants& constants)
+{
+	mConstants = constants;
+	_ResizeCells();
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Set grid mode
+void CpuSolver::SetGridMode(GridMode gridMode)
+{
+	mGridMode        = gridMode;
+	mSortedGridValid = false;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Set incremental grid
+void CpuSolver::SetIncrementalGrid(float maxMovedFraction)
+{
+	mMaxMovedFraction = std::max(maxMovedFraction, 0.0f);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Set cell index mode
+void CpuSolver::SetCellIndexMode(CellIndexMode cellIndexMode)
+{
+	mCellIndexMode = cellIndexMode;
+	_ResizeCells();
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Set search mode
+void CpuSolver::SetSearchMode(SearchMode searchMode)
+{
+	mSearchMode = searchMode;
+	get_cell_stencil(mSearchMode, mBucket3dSize, mCellStencil);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Set occupancy (the bits are found with the next grid)
+void CpuSolver::SetOccupancy(bool enable)
+{
+	mOccupancy           = enable;
+	mNeighbourListsValid = false;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Set pair mode (half neighbour lists only hold the neighbours j > i)
+void CpuSolver::SetPairMode(PairMode pairMode)
+{
+	mPairMode            = pairMode;
+	mNeighbourListsValid = false;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Set schedule mode
+void CpuSolver::SetScheduleMode(ScheduleMode scheduleMode)
+{
+	mScheduleMode = scheduleMode;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Set ticks
+void CpuSolver::SetTicks(float ticks)
+{
+	mTicks = mMaxTicks = ticks;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Set adaptive dt
+void CpuSolver::SetAdaptiveTicks(bool enable)
+{
+	mAdaptiveTicks = enable;
+	mTicks         = mMaxTicks;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Set solver mode
+void CpuSolver::SetSolverMode(SolverMode solverMode)
+{
+	mSolverMode = solverMode;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Set pressure tolerance
+void CpuSolver::SetPressureTolerance(float tolerance)
+{
+	mPressureTolerance = tolerance;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Set PBF iterations
+void CpuSolver::SetPbfIterations(unsigned iterationCount)
+{
+	mPbfIterationCount = std::max(iterationCount, 1u);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Set time levels
+void CpuSolver::SetTimeLevels(unsigned levelCount)
+{
+	mTimeLevelCount = std::min(std::max(levelCount, 1u), _MAX_TIME_LEVELS);
+	if(mParticleCount > 0)
+		std::fill(mParticles[mPingPong][PARTICLE_TIME_LEVEL],
+		          mParticles[mPingPong][PARTICLE_TIME_LEVEL] + mParticleCount,
+		          0.0f);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Set fused density
+void CpuSolver::SetFusedDensity(unsigned densityFrequency)
+{
+	mDensityFrequency = densityFrequency;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Set reorder frequency
+void CpuSolver::SetReorderFrequency(unsigned reorderFrequency)
+{
+	mReorderFrequency = reorderFrequency;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Set neighbour lists
+void CpuSolver::SetNeighbourLists(bool enable, float skin)
+{
+	mNeighbourLists      = enable;
+	mNeighbourSkin       = std::max(skin, 0.0f);
+	mNeighbourListsValid = false;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Set compressed neighbour lists
+void CpuSolver::SetCompressedNeighbourLists(bool enable)
+{
+	mNeighbourListsValid = mNeighbourListsValid && enable == mCompressedLists;
+	mCompressedLists     = enable;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Set pair reuse
+void CpuSolver::SetPairReuse(int capacity)
+{
+	mPairCapacity = std::max(capacity, 0);
+	mPairs.resize(static_cast<size_t>(mParticleCount) * mPairCapacity);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Set instruction set (falls back to the widest supported one)
+void CpuSolver::SetSimdIsa(SimdIsa simdIsa)
+{
+	mSimdIsa          = std::min(simdIsa, get_simd_isa_support());
+	mDensityKernel    = get_density_kernel(mSimdIsa);
+	mForceKernel      = get_force_kernel(mSimdIsa);
+	mNeighbourDecoder = get_neighbour_decoder(mSimdIsa);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Set gravity direction
+void CpuSolver::SetGravityDir(const Vector3& gravityDir)
+{
+	mGravityDir = gravityDir;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Set particles
+void CpuSolver::SetParticles(const ParticleArrays& particles)
+{
+	mParticleCount = particles.Size();
+	mStepCount     = 0;
+	mPingPong      = 0;
+	mParticles[0]  = particles;
+	mParticles[1].Resize(mParticleCount);
+	mList.resize(mParticleCount);
+	mParticleCells.resize(mParticleCount);
+	mPreviousCells.resize(mParticleCount);
+	mSortedIndices.resize(mParticleCount);
+	mMovedParticles.reserve(mParticleCount);
+	mNeighbourStarts.resize(mParticleCount+1);
+	mPairs.resize(static_cast<size_t>(mParticleCount) * mPairCapacity);
+	mPairCounts.resize(mParticleCount);
+	mCandidateCounts.resize(mParticleCount);
+	if(CELL_INDEX_HASHED == mCellIndexMode)
+		_ResizeCells();
+	mNeighbourRefs.resize(3*mParticleCount);
+	mPressures.resize(mParticleCount);
+	mAccelerations.resize(3*mParticleCount);
+	mPressureAccelerations.resize(3*mParticleCount);
+	mAdvectedDensities.resize(mParticleCount);
+	mDiagonals.resize(mParticleCount);
+	mDivergencePressures.resize(mParticleCount);
+	mPressureIncrements.resize(mParticleCount);
+	mNeighbourListsValid     = false;
+	mNeighbourListBuildCount = 0;
+	mSortedGridValid         = false;
+	mMovedFraction           = 0.0f;
+	mGridRepairCount         = 0;
+	mForceEvaluationCount    = 0.0;
+	mPairCount               = 0.0;
+	mCandidateCount          = 0.0;
+	mPairOverflowCount       = 0;
+	mDensityPassCount        = 0;
+	mDivergedSolveCount      = 0;
+	mDensityDrift            = 0.0f;
+	mMaxDensityDrift         = 0.0f;
+	std::fill(mParticles[0][PARTICLE_TIME_LEVEL],
+	          mParticles[0][PARTICLE_TIME_LEVEL] + mParticleCount,
+	          0.0f);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Step
+void CpuSolver::Step()
+{
+	if(0 == mParticleCount || mHead.empty())
+		return;
+
+	if(mAdaptiveTicks)
+	{
+		float maxSpeed, maxAcceleration;
+		_GetStepMaxima(&maxSpeed, &maxAcceleration);
+		mTicks = get_adaptive_ticks(mConstants,
+		                            maxSpeed,
+		                            maxAcceleration,
+		                            mMaxTicks);
+	}
+	if(mReorderFrequency > 0 && 0 == mStepCount % mReorderFrequency)
+		_ReorderParticles();
+
+	// position based (the grid is built on the predicted positions)
+	if(SOLVER_MODE_PBF == mSolverMode)
+	{
+		mSubstep = 0;
+		mForceEvaluationCount+= mParticleCount;
+		_SolvePbf();
+		++mStepCount;
+		return;
+	}
+
+	// incompressible solvers (every particle is active)
+	if(SOLVER_MODE_WCSPH != mSolverMode)
+	{
+		mSubstep = 0;
+		_UpdateCells();
+		mForceEvaluationCount+= mParticleCount;
+		_ComputeDensities();
+		if(SOLVER_MODE_PCISPH == mSolverMode)
+			_SolvePcisph();
+		else if(SOLVER_MODE_IISPH == mSolverMode)
+			_SolveIisph();
+		else
+			_SolveDfsph();
+		++mStepCount;
+		return;
+	}
+
+	const int SUBSTEPS = 1 << (mTimeLevelCount-1);
+	int stride = 0;
+	for(mSubstep=0; mSubstep<SUBSTEPS; mSubstep+= stride)
+	{
+		_UpdateCells();
+		mForceEvaluationCount+= _ActiveParticleCount();
+		_UpdateDensities();
+		_ComputeForces();
+
+		// drift to the next kick of the finest level
+		stride = SUBSTEPS >> _FinestTimeLevel();
+		_Drift(mTicks * stride / SUBSTEPS);
+	}
+	++mStepCount;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Queries
+unsigned CpuSolver::DensityPassCount() const
+{
+	return mDensityPassCount;
+}
+
+float CpuSolver::DensityDrift() const
+{
+	return mDensityDrift;
+}
+
+float CpuSolver::MaxDensityDrift() const
+{
+	return mMaxDensityDrift;
+}
+
+float CpuSolver::Ticks() const
+{
+	return mTicks;
+}
+
+GridMode CpuSolver::GetGridMode() const
+{
+	return mGridMode;
+}
+
+CellIndexMode CpuSolver::GetCellIndexMode() const
+{
+	return mCellIndexMode;
+}
+
+SearchMode CpuSolver::GetSearchMode() const
+{
+	return mSearchMode;
+}
+
+float CpuSolver::MovedFraction() const
+{
+	return mMovedFraction;
+}
+
+unsigned CpuSolver::GridRepairCount() const
+{
+	return mGridRepairCount;
+}
+
+unsigned CpuSolver::ActiveCellCount() const
+{
+	return static_cast<unsigned>(mActiveCells.size());
+}
+
+SimdIsa CpuSolver::GetSimdIsa() const
+{
+	return mSimdIsa;
+}
+
+PairMode CpuSolver::GetPairMode() const
+{
+	return mPairMode;
+}
+
+ScheduleMode CpuSolver::GetScheduleMode() const
+{
+	return mScheduleMode;
+}
+
+SolverMode CpuSolver::GetSolverMode() const
+{
+	return mSolverMode;
+}
+
+unsigned CpuSolver::PressureIterationCount() const
+{
+	return mPressureIterationCount;
+}
+
+float CpuSolver::PressureError() const
+{
+	return mPressureError;
+}
+
+unsigned CpuSolver::DivergenceIterationCount() const
+{
+	return mDivergenceIterationCount;
+}
+
+float CpuSolver::DivergenceError() const
+{
+	return mDivergenceError;
+}
+
+unsigned CpuSolver::DivergedSolveCount() const
+{
+	return mDivergedSolveCount;
+}
+
+double CpuSolver::DensitySolveTime() const
+{
+	return mDensitySolveTime;
+}
+
+double CpuSolver::DivergenceSolveTime() const
+{
+	return mDivergenceSolveTime;
+}
+
+unsigned CpuSolver::ParticleCount() const
+{
+	return mParticleCount;
+}
+
+const ParticleArrays& CpuSolver::Particles() const
+{
+	return mParticles[mPingPong];
+}
+
+int CpuSolver::ThreadCount() const
+{
+#ifdef _OPENMP
+	return omp_get_max_threads();
+#else
+	return 1;
+#endif
+}
+
+double CpuSolver::ForceEvaluationCount() const
+{
+	return mForceEvaluationCount;
+}
+
+double CpuSolver::PairCount() const
+{
+	return mPairCount;
+}
+
+double CpuSolver::CandidateCount() const
+{
+	return mCandidateCount;
+}
+
+unsigned CpuSolver::PairOverflowCount() const
+{
+	return mPairOverflowCount;
+}
+
+unsigned CpuSolver::NeighbourListBuildCount() const
+{
+	return mNeighbourListBuildCount;
+}
+
+size_t CpuSolver::NeighbourListBytes() const
+{
+	return sizeof(int)   * mNeighbourStarts.size()
+	     + sizeof(int)   * mNeighbours.size()
+	     + sizeof(short) * mPackedNeighbours.size();
+}
+
+const BlockScheduler& CpuSolver::Scheduler() const
+{
+	return mScheduler;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Get the 3d bucket of a position (clamped to the dense grid)
+void CpuSolver::_GetBucket3d(const float *position, int *bucket3d) const
+{
+	for(int i=0; i<3; ++i)
+	{
+		float relPos = position[i] - mConstants.bucketBoundsMin[i];
+		bucket3d[i]  = static_cast<int>(std::floor(relPos
+		                                           / mConstants.bucketCellSize));
+		if(CELL_INDEX_DENSE == mCellIndexMode)
+			bucket3d[i] = std::min(std::max(bucket3d[i], 0),
+			                       static_cast<int>(mBucket3dSize[i])-1);
+	}
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Get the 1d bucket of a cell (-1 if out of the dense grid, hashed grid
+// coordinates wrap around)
+int CpuSolver::_GetBucket1d(int x, int y, int z) const
+{
+	const int SIZE_X = static_cast<int>(mBucket3dSize[0]);
+	const int SIZE_Y = static_cast<int>(mBucket3dSize[1]);
+	const int SIZE_Z = static_cast<int>(mBucket3dSize[2]);
+
+	if(CELL_INDEX_HASHED == mCellIndexMode)
+		return (x & (SIZE_X-1)) + SIZE_X*((y & (SIZE_Y-1))
+		                                 + SIZE_Y*(z & (SIZE_Z-1)));
+	if(x<0 || y<0 || z<0 || x>=SIZE_X || y>=SIZE_Y || z>=SIZE_Z)
+		return -1;
+	return x + SIZE_X*(y + SIZE_Y*z);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Check if the cells searched around a cell are given by the stencil (dense
+// grid, the cell is not on the border)
+inline bool CpuSolver::_HasStencil(const int *bucket3d) const
+{
+	if(CELL_INDEX_HASHED == mCellIndexMode)
+		return false;
+	for(int i=0; i<3; ++i)
+		if(bucket3d[i] < 1 || bucket3d[i] > static_cast<int>(mBucket3dSize[i])-2)
+			return false;
+	return true;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Get the particles of a cell (linked lists are copied to scratch)
+int CpuSolver::_GetCellParticles(int bucket1d,
+                                 std::vector<int>& scratch,
+                                 const int **particles) const
+{
+	if(GRID_MODE_SORTED == mGridMode)
+	{
+		const int START = mCellStarts[bucket1d];
+		*particles = &mSortedIndices[0] + START;
+		return mCellStarts[bucket1d+1] - START;
+	}
+
+	scratch.clear();
+	for(int j=mHead[bucket1d]; j!=-1; j=mList[j])
+		scratch.push_back(j);
+	*particles = scratch.empty() ? NULL : &scratch[0];
+	return static_cast<int>(scratch.size());
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Visit the particles of a cell (-1: out of the dense grid)
+template<typename Visitor>
+void CpuSolver::_VisitCell(int bucket1d, Visitor& visitor) const
+{
+	if(-1 == bucket1d || !_IsOccupied(bucket1d))
+		return;
+
+	if(GRID_MODE_SORTED == mGridMode)
+	{
+		const int START = mCellStarts[bucket1d];
+		visitor(&mSortedIndices[0] + START, mCellStarts[bucket1d+1] - START);
+	}
+	else
+	{
+		for(int j=mHead[bucket1d]; j!=-1; j=mList[j])
+			visitor(j);
+	}
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Visit the particles of the cells surrounding a position (range is the
+// number of cell layers around the cell of the position)
+template<typename Visitor>
+void CpuSolver::_VisitCells(const float *position,
+                            int range,
+                            Visitor& visitor) const
+{
+	int bucket3d[3];
+
+	_GetBucket3d(position, bucket3d);
+	if(1 == range && SEARCH_MODE_27 == mSearchMode && _HasStencil(bucket3d))
+	{
+		const int BUCKET1D = _GetBucket1d(bucket3d[0], bucket3d[1], bucket3d[2]);
+		for(int n=0; n<27; ++n)
+			_VisitCell(BUCKET1D + mCellStencil[n], visitor);
+		return;
+	}
+	for(int z=-range; z<=range; ++z)
+	for(int y=-range; y<=range; ++y)
+	for(int x=-range; x<=range; ++x)
+		_VisitCell(_GetBucket1d(bucket3d[0]+x,
+		                        bucket3d[1]+y,
+		                        bucket3d[2]+z),
+		           visitor);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Visit the particles of the 8 cells of 2h closest to a position: its own
+// cell and the neighbours on the side of the half it lies in, along each
+// axis (see sph_density.glsl)
+template<typename Visitor>
+void CpuSolver::_VisitOctant(const float *position, Visitor& visitor) const
+{
+	int bucket3d[3], side[3], octant = 0;
+
+	_GetBucket3d(position, bucket3d);
+	for(int i=0; i<3; ++i)
+	{
+		float relPos = position[i] - mConstants.bucketBoundsMin[i];
+		int half     = static_cast<int>(std::floor(2.0f * relPos
+		                                           / mConstants.bucketCellSize));
+		side[i]      = (half & 1) ? 1 : -1;
+		octant      |= (half & 1) << i;
+	}
+	if(_HasStencil(bucket3d))
+	{
+		const int BUCKET1D = _GetBucket1d(bucket3d[0], bucket3d[1], bucket3d[2]);
+		const int *offsets = &mCellStencil[8*octant];
+		for(int n=0; n<8; ++n)
+			_VisitCell(BUCKET1D + offsets[n], visitor);
+		return;
+	}
+	for(int z=0; z<2; ++z)
+	for(int y=0; y<2; ++y)
+	for(int x=0; x<2; ++x)
+		_VisitCell(_GetBucket1d(bucket3d[0] + x*side[0],
+		                        bucket3d[1] + y*side[1],
+		                        bucket3d[2] + z*side[2]),
+		           visitor);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Visit the neighbour candidates of a particle (its neighbour list if
+// enabled, the particles of the 27 or 8 surrounding cells otherwise)
+template<typename Visitor>
+void CpuSolver::_VisitNeighbours(int i,
+                                 const float *position,
+                                 Visitor& visitor) const
+{
+	if(mNeighbourLists && mCompressedLists)
+	{
+		// decode the list by packets
+		const int END = mNeighbourStarts[i+1];
+		int neighbours[_PACKET_SIZE], words;
+		for(int n=mNeighbourStarts[i]; n<END; n+=words)
+			visitor(neighbours,
+			        mNeighbourDecoder(i,
+			                          &mPackedNeighbours[n],
+			                          std::min(END - n, _PACKET_SIZE),
+			                          neighbours,
+			                          &words));
+	}
+	else if(mNeighbourLists)
+	{
+		const int START = mNeighbourStarts[i];
+		visitor(&mNeighbours[0] + START, mNeighbourStarts[i+1] - START);
+	}
+	else if(SEARCH_MODE_8 == mSearchMode)
+		_VisitOctant(position, visitor);
+	else
+		_VisitCells(position, 1, visitor);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Visit each pair of neighbour candidates once (upper triangle of each cell
+// and its forward half shell, or the half neighbour lists). The visitor adds
+// to per thread sums (components arrays of mParticleCount floats), which are
+// then reduced into the first ones of mPairSums.
+template<typename PairVisitor>
+void CpuSolver::_VisitPairs(int components, const PairVisitor& visitor)
+{
+	const int COUNT   = static_cast<int>(mParticleCount);
+	const int CELLS   = _ScannedCellCount();
+	const int SIZE    = components * COUNT;
+	const int THREADS = ThreadCount();
+	const int SIZE_X  = static_cast<int>(mBucket3dSize[0]);
+	const int SIZE_Y  = static_cast<int>(mBucket3dSize[1]);
+
+	mPairSums.assign(static_cast<size_t>(THREADS) * SIZE, 0.0f);
+
+#pragma omp parallel
+	{
+#ifdef _OPENMP
+		float *sums = &mPairSums[static_cast<size_t>(omp_get_thread_num())*SIZE];
+#else
+		float *sums = &mPairSums[0];
+#endif
+		std::vector<int> scratch[2];
+
+		if(mNeighbourLists)
+		{
+#pragma omp for schedule(static)
+			for(int i=0; i<COUNT; ++i)
+				if(mCompressedLists)
+				{
+					const int END = mNeighbourStarts[i+1];
+					int neighbours[_PACKET_SIZE], words;
+					for(int n=mNeighbourStarts[i]; n<END; n+=words)
+					{
+						const int DECODED = mNeighbourDecoder(
+						                    i,
+						                    &mPackedNeighbours[n],
+						                    std::min(END - n, _PACKET_SIZE),
+						                    neighbours,
+						                    &words);
+						for(int m=0; m<DECODED; ++m)
+							visitor(i, neighbours[m], sums);
+					}
+				}
+				else
+					for(int n=mNeighbourStarts[i]; n<mNeighbourStarts[i+1]; ++n)
+						visitor(i, mNeighbours[n], sums);
+		}
+		else
+		{
+#pragma omp for schedule(dynamic, 64)
+			for(int c=0; c<CELLS; ++c)
+			{
+				const int cell = _ScannedCell(c);
+				const int *iParticles, *jParticles;
+				const int iCount = _GetCellParticles(cell,
+				                                     scratch[0],
+				                                     &iParticles);
+				if(0 == iCount)
+					continue;
+
+				// upper triangle of the cell
+				for(int n=0; n<iCount; ++n)
+					for(int m=n+1; m<iCount; ++m)
+						visitor(iParticles[n], iParticles[m], sums);
+
+				// forward half shell
+				const int X = cell % SIZE_X;
+				const int Y = cell / SIZE_X % SIZE_Y;
+				const int Z = cell / (SIZE_X*SIZE_Y);
+				for(int o=0; o<_HALF_SHELL_SIZE; ++o)
+				{
+					int bucket1d = _GetBucket1d(X + _HALF_SHELL[o][0],
+					                            Y + _HALF_SHELL[o][1],
+					                            Z + _HALF_SHELL[o][2]);
+					if(-1 == bucket1d || !_IsOccupied(bucket1d))
+						continue;
+
+					const int jCount = _GetCellParticles(bucket1d,
+					                                     scratch[1],
+					                                     &jParticles);
+					for(int n=0; n<iCount; ++n)
+						for(int m=0; m<jCount; ++m)
+							visitor(iParticles[n], jParticles[m], sums);
+				}
+			}
+		}
+	}
+
+	// reduce
+	float *sums = &mPairSums[0];
+#pragma omp parallel for schedule(static)
+	for(int n=0; n<SIZE; ++n)
+		for(int t=1; t<THREADS; ++t)
+			sums[n]+= mPairSums[static_cast<size_t>(t)*SIZE + n];
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Size the cells for the cell index mode
+void CpuSolver::_ResizeCells()
+{
+	mBucket3dSize = CELL_INDEX_HASHED == mCellIndexMode
+	              ? get_hashed_grid_size(mParticleCount)
+	              : mConstants.bucket3dSize;
+	mHead.resize(static_cast<size_t>(mBucket3dSize[0])
+	           * static_cast<size_t>(mBucket3dSize[1])
+	           * static_cast<size_t>(mBucket3dSize[2]));
+	mCellStarts.resize(mHead.size()+1);
+	mCellBits.resize((mHead.size()+31)/32);
+	get_cell_morton_ranks(mBucket3dSize, mCellMortonRanks);
+	get_cell_stencil(mSearchMode, mBucket3dSize, mCellStencil);
+	mNeighbourListsValid = false;
+	mSortedGridValid     = false;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Maximum speed and acceleration of the particles (per thread maxima)
+void CpuSolver::_GetStepMaxima(float *maxSpeed, float *maxAcceleration) const
+{
+	const ParticleArrays& particles = mParticles[mPingPong];
+	const float *vx           = particles[PARTICLE_VX];
+	const float *vy           = particles[PARTICLE_VY];
+	const float *vz           = particles[PARTICLE_VZ];
+	const float *acceleration = particles[PARTICLE_ACCELERATION];
+	const int COUNT           = static_cast<int>(mParticleCount);
+	float maxSpeed2 = 0.0f;
+
+	*maxAcceleration = 0.0f;
+#pragma omp parallel
+	{
+		float threadSpeed2       = 0.0f;
+		float threadAcceleration = 0.0f;
+
+#pragma omp for schedule(static)
+		for(int i=0; i<COUNT; ++i)
+		{
+			threadSpeed2       = std::max(threadSpeed2, vx[i]*vx[i]
+			                                          + vy[i]*vy[i]
+			                                          + vz[i]*vz[i]);
+			threadAcceleration = std::max(threadAcceleration, acceleration[i]);
+		}
+#pragma omp critical
+		{
+			maxSpeed2        = std::max(maxSpeed2, threadSpeed2);
+			*maxAcceleration = std::max(*maxAcceleration, threadAcceleration);
+		}
+	}
+	*maxSpeed = std::sqrt(maxSpeed2);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Build the grid (and the neighbour lists once they have expired)
+void CpuSolver::_UpdateCells()
+{
+	if(mNeighbourLists && !_NeighbourListsExpired())
+		return;
+
+	if(GRID_MODE_SORTED == mGridMode)
+		_BuildSortedGrid();
+	else
+		_BuildGrid();
+	if(mOccupancy)
+		_FindActiveCells();
+	if(mNeighbourLists)
+		_BuildNeighbourLists();
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Build the grid (see sph_cell_init.glsl and sph_grid.glsl)
+void CpuSolver::_BuildGrid()
+{
+	const ParticleArrays& particles = mParticles[mPingPong];
+	float position[3];
+	int bucket3d[3];
+
+	std::fill(mHead.begin(), mHead.end(), -1);
+	std::fill(mCellBits.begin(), mCellBits.end(), 0u);
+	for(unsigned i=0; i<mParticleCount; ++i)
+	{
+		_get_position(particles, i, position);
+		_GetBucket3d(position, bucket3d);
+		int bucket1d = _GetBucket1d(bucket3d[0], bucket3d[1], bucket3d[2]);
+		mList[i]        = mHead[bucket1d];
+		mHead[bucket1d] = static_cast<int>(i);
+		if(-1 == mList[i])
+			mCellBits[bucket1d >> 5]|= 1u << (bucket1d & 31);
+	}
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Build the grid with a counting sort (see GRID_MODE_SORTED)
+void CpuSolver::_BuildSortedGrid()
+{
+	const ParticleArrays& particles = mParticles[mPingPong];
+	const int COUNT = static_cast<int>(mParticleCount);
+	int moved = 0;
+
+	// find cells, and count the particles which changed cell
+	mPreviousCells.swap(mParticleCells);
+#pragma omp parallel for schedule(static) reduction(+:moved)
+	for(int i=0; i<COUNT; ++i)
+	{
+		float position[3];
+		int bucket3d[3];
+		_get_position(particles, i, position);
+		_GetBucket3d(position, bucket3d);
+		mParticleCells[i] = _GetBucket1d(bucket3d[0], bucket3d[1], bucket3d[2]);
+		moved+= mParticleCells[i] != mPreviousCells[i];
+	}
+
+	if(!_RepairSortedGrid(moved))
+		_SortParticles();
+	mSortedGridValid = true;
+
+	// bits of the non-empty cells (the keys are cells, not Z-order ranks)
+	std::fill(mCellBits.begin(), mCellBits.end(), 0u);
+	if(mOccupancy)
+		for(int i=0; i<COUNT; ++i)
+			mCellBits[mParticleCells[i] >> 5]|= 1u << (mParticleCells[i] & 31);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Repair the sorted grid of the previous build from the new cells of the
+// particles (false if the grid must be sorted again; movedCount particles
+// changed cell). Slots are ordered by cell, then by particle, like the
+// counting sort, so the particles which stayed in their cell are still in
+// order: they are packed to the front, and the few others are sorted and
+// merged with them from the back.
+bool CpuSolver::_RepairSortedGrid(int movedCount)
+{
+	const int COUNT = static_cast<int>(mParticleCount);
+	const int CELLS = static_cast<int>(mHead.size());
+	const _CellOrder ORDER = {&mParticleCells[0]};
+
+	if(!mSortedGridValid || 0.0f == mMaxMovedFraction)
+		return false;
+	mMovedFraction = static_cast<float>(movedCount) / COUNT;
+	if(mMovedFraction > mMaxMovedFraction)
+		return false;
+
+	// pack the particles which stayed, list the others
+	int stayed = 0;
+	mMovedParticles.clear();
+	for(int n=0; n<COUNT; ++n)
+	{
+		const int i = mSortedIndices[n];
+		if(mParticleCells[i] == mPreviousCells[i])
+			mSortedIndices[stayed++] = i;
+		else
+			mMovedParticles.push_back(i);
+	}
+	const int MOVED = static_cast<int>(mMovedParticles.size());
+
+	// merge (the free slots are at the back)
+	std::sort(mMovedParticles.begin(), mMovedParticles.end(), ORDER);
+	for(int slot=COUNT-1, m=MOVED-1; m>=0; --slot)
+		if(stayed > 0 && ORDER(mMovedParticles[m], mSortedIndices[stayed-1]))
+			mSortedIndices[slot] = mSortedIndices[--stayed];
+		else
+			mSortedIndices[slot] = mMovedParticles[m--];
+
+	// cell ranges (a slot starts the cells after the cell of the previous
+	// slot, up to its own)
+#pragma omp parallel for schedule(static)
+	for(int slot=0; slot<=COUNT; ++slot)
+	{
+		const int FIRST = slot > 0
+		                ? mParticleCells[mSortedIndices[slot-1]] + 1
+		                : 0;
+		const int LAST  = slot < COUNT
+		                ? mParticleCells[mSortedIndices[slot]]
+		                : CELLS;
+		for(int cell=FIRST; cell<=LAST; ++cell)
+			mCellStarts[cell] = slot;
+	}
+
+	++mGridRepairCount;
+	return true;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// List the non-empty cells from their bits (empty words are skipped)
+void CpuSolver::_FindActiveCells()
+{
+	const int WORDS = static_cast<int>(mCellBits.size());
+
+	mActiveCells.clear();
+	for(int w=0; w<WORDS; ++w)
+		for(unsigned bits=mCellBits[w]; bits; bits&= bits-1)
+		{
+			int bit = 0;
+			while(0 == (bits & (1u << bit)))
+				++bit;
+			mActiveCells.push_back(32*w + bit);
+		}
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Check if a cell holds particles (always true without occupancy)
+inline bool CpuSolver::_IsOccupied(int bucket1d) const
+{
+	return !mOccupancy || 0 != (mCellBits[bucket1d >> 5]
+	                            & (1u << (bucket1d & 31)));
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Cells of the passes over the grid (the non-empty ones with occupancy)
+inline int CpuSolver::_ScannedCellCount() const
+{
+	return static_cast<int>(mOccupancy ? mActiveCells.size() : mHead.size());
+}
+
+inline int CpuSolver::_ScannedCell(int n) const
+{
+	return mOccupancy ? mActiveCells[n] : n;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Sort the particles by key (counting sort, the keys are in mParticleCells)
+void CpuSolver::_SortParticles()
+{
+	const int COUNT = static_cast<int>(mParticleCount);
+	const int CELLS = static_cast<int>(mHead.size());
+
+	// count particles per cell
+	std::fill(mCellStarts.begin(), mCellStarts.end(), 0);
+	for(int i=0; i<COUNT; ++i)
+		++mCellStarts[mParticleCells[i]+1];
+
+	// prefix sum
+	for(int cell=0; cell<CELLS; ++cell)
+		mCellStarts[cell+1]+= mCellStarts[cell];
+
+	// scatter (mHead is used as the insertion cursor of each cell)
+	std::copy(mCellStarts.begin(), mCellStarts.end()-1, mHead.begin());
+	for(int i=0; i<COUNT; ++i)
+		mSortedIndices[mHead[mParticleCells[i]]++] = i;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Permute the particles along the Z-order curve of their cells
+// (the grid must be rebuilt afterwards)
+void CpuSolver::_ReorderParticles()
+{
+	const ParticleArrays& iParticles = mParticles[mPingPong];
+	ParticleArrays& oParticles       = mParticles[1-mPingPong];
+	const int COUNT = static_cast<int>(mParticleCount);
+
+	// find keys
+#pragma omp parallel for schedule(static)
+	for(int i=0; i<COUNT; ++i)
+	{
+		float position[3];
+		int bucket3d[3];
+		_get_position(iParticles, i, position);
+		_GetBucket3d(position, bucket3d);
+		mParticleCells[i] = mCellMortonRanks[_GetBucket1d(bucket3d[0],
+		                                                  bucket3d[1],
+		                                                  bucket3d[2])];
+	}
+
+	// sort
+	_SortParticles();
+
+	// permute (one attribute at a time, the writes are sequential)
+	for(int a=0; a<PARTICLE_ATTRIBUTE_COUNT; ++a)
+	{
+		const float *iAttribute = iParticles[a];
+		float *oAttribute       = oParticles[a];
+#pragma omp parallel for schedule(static)
+		for(int slot=0; slot<COUNT; ++slot)
+			oAttribute[slot] = iAttribute[mSortedIndices[slot]];
+	}
+
+	// ping pong
+	mPingPong = 1 - mPingPong;
+
+	// particle indices have changed
+	mNeighbourListsValid = false;
+	mSortedGridValid     = false;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Check if a particle has moved by more than skin/2 since the last list build
+bool CpuSolver::_NeighbourListsExpired() const
+{
+	if(!mNeighbourListsValid)
+		return true;
+
+	const ParticleArrays& particles = mParticles[mPingPong];
+	const float *x        = particles[PARTICLE_X];
+	const float *y        = particles[PARTICLE_Y];
+	const float *z        = particles[PARTICLE_Z];
+	const int COUNT       = static_cast<int>(mParticleCount);
+	const float *refs[3]  = {&mNeighbourRefs[0],
+	                         &mNeighbourRefs[COUNT],
+	                         &mNeighbourRefs[2*COUNT]};
+	const float MAX_DIST  = 0.5f * mNeighbourSkin;
+	const float MAX_DIST2 = MAX_DIST * MAX_DIST;
+	int expired = 0;
+
+#pragma omp parallel for schedule(static) reduction(|:expired)
+	for(int i=0; i<COUNT; ++i)
+	{
+		float d[3] = {x[i] - refs[0][i],
+		              y[i] - refs[1][i],
+		              z[i] - refs[2][i]};
+		expired|= d[0]*d[0] + d[1]*d[1] + d[2]*d[2] > MAX_DIST2;
+	}
+
+	return 0 != expired;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Build the neighbour lists from the grid (count, prefix sum, fill)
+void CpuSolver::_BuildNeighbourLists()
+{
+	const ParticleArrays& particles = mParticles[mPingPong];
+	const int COUNT     = static_cast<int>(mParticleCount);
+	const float RADIUS  = mConstants.smoothingLength + mNeighbourSkin;
+	const float RADIUS2 = RADIUS * RADIUS;
+	const bool HALF     = PAIR_MODE_HALF == mPairMode;
+	const int RANGE     = static_cast<int>(std::ceil(RADIUS
+	                                       / mConstants.bucketCellSize));
+
+	// count neighbours
+	mNeighbourStarts[0] = 0;
+#pragma omp parallel for schedule(static)
+	for(int i=0; i<COUNT; ++i)
+	{
+		float position[3];
+		_get_position(particles, i, position);
+		_NeighbourVisitor visitor(particles,
+		                          i,
+		                          RADIUS2,
+		                          HALF,
+		                          mCompressedLists,
+		                          NULL);
+		_VisitCells(position, RANGE, visitor);
+		mNeighbourStarts[i+1] = visitor.count;
+	}
+
+	// prefix sum
+	for(int i=0; i<COUNT; ++i)
+		mNeighbourStarts[i+1]+= mNeighbourStarts[i];
+	mNeighbours.resize(mCompressedLists ? 0 : mNeighbourStarts[COUNT]);
+	mPackedNeighbours.resize(mCompressedLists
+	                         ? mNeighbourStarts[COUNT] + NEIGHBOUR_PADDING
+	                         : 0);
+
+	// fill lists and store reference positions
+	int *neighbours = mNeighbours.empty() ? NULL : &mNeighbours[0];
+	short *packed   = mPackedNeighbours.empty() ? NULL : &mPackedNeighbours[0];
+#pragma omp parallel for schedule(static)
+	for(int i=0; i<COUNT; ++i)
+	{
+		float position[3];
+		_get_position(particles, i, position);
+		_NeighbourVisitor visitor(particles,
+		                          i,
+		                          RADIUS2,
+		                          HALF,
+		                          mCompressedLists,
+		                          mCompressedLists
+		                          ? static_cast<void*>(packed
+		                                               + mNeighbourStarts[i])
+		                          : static_cast<void*>(neighbours
+		                                               + mNeighbourStarts[i]));
+		_VisitCells(position, RANGE, visitor);
+		for(int c=0; c<3; ++c)
+			mNeighbourRefs[c*COUNT+i] = position[c];
+	}
+
+	mNeighbourListsValid = true;
+	++mNeighbourListBuildCount;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Check if the force pass integrates the densities
+bool CpuSolver::_FusesDensity() const
+{
+	return mDensityFrequency > 1 && 1 == mTimeLevelCount
+	       && SOLVER_MODE_WCSPH == mSolverMode;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Update the densities of a weakly compressible step: the density pass, or
+// the densities integrated by the previous force pass. The drift of the
+// integrated densities is measured when the density pass replaces them.
+void CpuSolver::_UpdateDensities()
+{
+	const int COUNT = static_cast<int>(mParticleCount);
+	float *density  = mParticles[mPingPong][PARTICLE_DENSITY];
+
+	if(!_FusesDensity())
+	{
+		_ComputeDensities();
+		++mDensityPassCount;
+		return;
+	}
+	if(0 != mStepCount % mDensityFrequency)
+		return;
+
+	// the first pass has nothing to compare to
+	std::vector<float> integrated(density, density + COUNT);
+	_ComputeDensities();
+	if(mDensityPassCount++ == 0)
+		return;
+
+	double drift = 0.0;
+	float maxDrift = 0.0f;
+#pragma omp parallel
+	{
+		float threadMaxDrift = 0.0f;
+#pragma omp for schedule(static) reduction(+:drift)
+		for(int i=0; i<COUNT; ++i)
+			if(density[i] > 0.0f)
+			{
+				float d = std::fabs(integrated[i] - density[i]) / density[i];
+				drift+= d;
+				threadMaxDrift = std::max(threadMaxDrift, d);
+			}
+#pragma omp critical
+		maxDrift = std::max(maxDrift, threadMaxDrift);
+	}
+	mDensityDrift    = static_cast<float>(drift / COUNT);
+	mMaxDensityDrift = maxDrift;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Compute densities (see sph_density.glsl)
+// Densities are written in place: only positions are read from neighbours.
+void CpuSolver::_ComputeDensities()
+{
+	ParticleArrays& particles = mParticles[mPingPong];
+	float *density  = particles[PARTICLE_DENSITY];
+	const int COUNT = static_cast<int>(mParticleCount);
+
+	// each pair once
+	if(PAIR_MODE_HALF == mPairMode)
+	{
+		_VisitPairs(1, _DensityPairVisitor(particles,
+		                                   mConstants.smoothingLengthSquared));
+		const float *sums = &mPairSums[0];
+#pragma omp parallel for schedule(static)
+		for(int i=0; i<COUNT; ++i)
+			density[i] = sums[i] * mConstants.densityConstants;
+		return;
+	}
+
+	_ForEachParticle(&CpuSolver::_ComputeDensity);
+	if(_ReusesPairs())
+		_CountPairs();
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Check if the force pass replays the pairs of the density pass (the density
+// pass must precede it in every step, over the same candidates)
+bool CpuSolver::_ReusesPairs() const
+{
+	return mPairCapacity > 0 && SOLVER_MODE_WCSPH == mSolverMode
+	       && PAIR_MODE_FULL == mPairMode && !mNeighbourLists
+	       && !_FusesDensity();
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Add the pairs recorded by the density pass to the counters
+void CpuSolver::_CountPairs()
+{
+	const ParticleArrays& particles = mParticles[mPingPong];
+	const int COUNT = static_cast<int>(mParticleCount);
+	double found = 0.0, tested = 0.0;
+	int overflows = 0;
+
+#pragma omp parallel for schedule(static) reduction(+:found,tested,overflows)
+	for(int i=0; i<COUNT; ++i)
+		if(_IsActive(particles, i))
+		{
+			found     += mPairCounts[i];
+			tested    += mCandidateCounts[i];
+			overflows += mPairCounts[i] > mPairCapacity;
+		}
+	mPairCount        += found;
+	mCandidateCount   += tested;
+	mPairOverflowCount+= overflows;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Compute the density of a particle
+void CpuSolver::_ComputeDensity(int i)
+{
+	ParticleArrays& particles = mParticles[mPingPong];
+	float position[3];
+
+	// inactive particles keep their density
+	if(!_IsActive(particles, i))
+		return;
+
+	_get_position(particles, i, position);
+	_DensityVisitor visitor(particles,
+	                        i,
+	                        mConstants.smoothingLengthSquared,
+	                        mDensityKernel);
+	if(_ReusesPairs())
+		visitor.Record(&mPairs[static_cast<size_t>(i) * mPairCapacity],
+		               mPairCapacity);
+	_VisitNeighbours(i, position, visitor);
+	visitor.Flush();
+	mPairCounts[i]      = visitor.pairCount;
+	mCandidateCounts[i] = visitor.candidateCount;
+
+	// multiply sum by constants
+	particles[PARTICLE_DENSITY][i] = visitor.density
+	                               * mConstants.densityConstants;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Compute forces and integrate (see sph_force.glsl)
+void CpuSolver::_ComputeForces()
+{
+	// each pair once
+	if(PAIR_MODE_HALF == mPairMode)
+		_VisitPairs(_FusesDensity() ? 7 : 6,
+		            _ForcePairVisitor(mParticles[mPingPong],
+		                              mConstants,
+		                              _FusesDensity()));
+
+	_ForEachParticle(&CpuSolver::_ComputeForce);
+
+	// ping pong
+	mPingPong = 1 - mPingPong;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Compute the forces of a particle and update its velocity (positions are
+// updated by _Drift)
+void CpuSolver::_ComputeForce(int i)
+{
+	const ParticleArrays& iParticles = mParticles[mPingPong];
+	ParticleArrays& oParticles       = mParticles[1-mPingPong];
+	const int SUBSTEPS  = 1 << (mTimeLevelCount-1);
+	const float *levels = iParticles[PARTICLE_TIME_LEVEL];
+	float ri[3], vi[3], acceleration[3] = {0.0f, 0.0f, 0.0f};
+	float accelerationNorm = iParticles[PARTICLE_ACCELERATION][i];
+	int level              = static_cast<int>(levels[i]);
+	float kick             = 0.0f;
+	float densityRate      = 0.0f; // sum of the continuity equation (fused)
+
+	for(int c=0; c<3; ++c)
+	{
+		ri[c] = iParticles[PARTICLE_X+c][i];
+		vi[c] = iParticles[PARTICLE_VX+c][i];
+	}
+
+	// kick the particles of the active levels (the others keep the velocity
+	// of their last kick)
+	if(_IsActive(iParticles, i))
+	{
+		_GetAcceleration(i, ri, vi, true, acceleration,
+		                 _FusesDensity() ? &densityRate : NULL);
+		accelerationNorm = std::sqrt(acceleration[0]*acceleration[0]
+		                           + acceleration[1]*acceleration[1]
+		                           + acceleration[2]*acceleration[2]);
+
+		// pick the level of the kick (a level starts on a multiple of its
+		// number of substeps, finer levels are always aligned)
+		float ticks = get_particle_ticks(mConstants,
+		                                 std::sqrt(vi[0]*vi[0]
+		                                         + vi[1]*vi[1]
+		                                         + vi[2]*vi[2]),
+		                                 accelerationNorm,
+		                                 mTicks);
+		level = 0;
+		while(level < static_cast<int>(mTimeLevelCount)-1
+		      && (mTicks / (1 << level) > ticks
+		          || 0 != mSubstep % (SUBSTEPS >> level)))
+			++level;
+		kick = mTicks / (1 << level);
+	}
+
+	// set attributes
+	for(int c=0; c<3; ++c)
+	{
+		oParticles[PARTICLE_VX+c][i] = vi[c] + acceleration[c] * kick;
+		oParticles[PARTICLE_X+c][i]  = ri[c];
+	}
+	oParticles[PARTICLE_DENSITY][i]      = _integrate_density(
+	                                       iParticles[PARTICLE_DENSITY][i],
+	                                       -mConstants.gradDensityConstants
+	                                       * densityRate * kick);
+	oParticles[PARTICLE_ACCELERATION][i] = accelerationNorm;
+	oParticles[PARTICLE_TIME_LEVEL][i]   = static_cast<float>(level);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Acceleration of a particle (the pressure force is left out and the
+// viscosity bounded if the pressure comes from an incompressible solver),
+// and the density rate sum of the continuity equation if densityRate is not
+// NULL
+void CpuSolver::_GetAcceleration(int i,
+                                 const float *ri,
+                                 const float *vi,
+                                 bool pressure,
+                                 float *acceleration,
+                                 float *densityRate) const
+{
+	const ParticleArrays& particles = mParticles[mPingPong];
+	const int COUNT   = static_cast<int>(mParticleCount);
+	const float MASS  = mConstants.particleMass;
+	const float di    = particles[PARTICLE_DENSITY][i];
+	const float invDi = di > 0.0f ? 1.0f/di : 0.0f; // isolated particles
+	float fPressure[3], fViscosity[3];
+
+	// sph forces (pair sums are only computed by the weakly compressible
+	// solver)
+	if(!pressure)
+	{
+		// the incompressible solvers take steps far beyond the viscosity
+		// condition of dt: the step is bounded so that the velocity reaches
+		// the weighted mean of the neighbours at most, instead of
+		// overshooting it (and low density particles by a lot)
+		_ViscosityVisitor visitor(particles, i, mConstants);
+		_VisitNeighbours(i, ri, visitor);
+		float rate  = mTicks * visitor.weight * mConstants.viscosityConstants
+		            * invDi / MASS;
+		float bound = rate > 1.0f ? 1.0f/rate : 1.0f;
+		for(int c=0; c<3; ++c)
+		{
+			fPressure[c]  = 0.0f;
+			fViscosity[c] = visitor.fViscosity[c] * bound;
+		}
+	}
+	else if(PAIR_MODE_HALF == mPairMode)
+	{
+		for(int c=0; c<3; ++c)
+		{
+			fPressure[c]  = mPairSums[c*COUNT + i];
+			fViscosity[c] = mPairSums[(3+c)*COUNT + i];
+		}
+		if(densityRate)
+			*densityRate = mPairSums[6*COUNT + i];
+	}
+	else
+	{
+		_ForceVisitor visitor(particles,
+		                      i,
+		                      mConstants,
+		                      mForceKernel,
+		                      NULL != densityRate);
+		if(_ReusesPairs() && mPairCounts[i] <= mPairCapacity)
+			visitor(&mPairs[static_cast<size_t>(i) * mPairCapacity],
+			        mPairCounts[i]);
+		else
+			_VisitNeighbours(i, ri, visitor);
+		visitor.Flush();
+		for(int c=0; c<3; ++c)
+		{
+			fPressure[c]  = visitor.fPressure[c];
+			fViscosity[c] = visitor.fViscosity[c];
+		}
+		if(densityRate)
+			*densityRate = visitor.densityRate;
+	}
+
+	// multiply results by constants
+	for(int c=0; c<3; ++c)
+		acceleration[c] = ( fPressure[c] * mConstants.pressureConstants
+		                  * invDi
+		                  + fViscosity[c] * mConstants.viscosityConstants
+		                  * invDi
+		                  + _boundary_force(ri[c],
+		                                    vi[c],
+		                                    mConstants.simBoundsMin[c],
+		                                    mConstants.simBoundsMax[c],
+		                                    mConstants.stiffness,
+		                                    mConstants.dampening)
+		                  + _GRAVITY * mGravityDir[c] * MASS ) / MASS;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Solve the pressures with PCISPH: the pressures are corrected from the
+// density error at the predicted positions until its average drops below
+// the tolerance (Solenthaler and Pajarola 2009)
+void CpuSolver::_SolvePcisph()
+{
+	const int COUNT  = static_cast<int>(mParticleCount);
+	const float DT   = mTicks;
+	const float MASS = mConstants.particleMass;
+	const float D0   = mConstants.restDensity;
+	float factor = 0.0f;
+
+	// forces other than pressure (pressures are reset)
+	_ForEachParticle(&CpuSolver::_ComputeNonPressureAcceleration);
+
+	// pressure of a unit density error, from the fullest neighbourhood (the
+	// smallest correction, per thread maxima)
+#pragma omp parallel
+	{
+		float threadFactor = 0.0f;
+#pragma omp for schedule(static)
+		for(int i=0; i<COUNT; ++i)
+			threadFactor = std::max(threadFactor, _GetPcisphFactor(i));
+#pragma omp critical
+		factor = std::max(factor, threadFactor);
+	}
+	mPcisphDelta = factor > 0.0f && DT > 0.0f
+	             ? D0 * D0 / (2.0f * DT * DT * MASS * MASS * factor)
+	             : 0.0f;
+
+	// correct the pressures
+	mPressureIterationCount = 0;
+	do
+	{
+		_ForEachParticle(&CpuSolver::_PredictPosition);
+		_ForEachParticle(&CpuSolver::_CorrectPcisphPressure);
+		_ForEachParticle(&CpuSolver::_ComputePressureAcceleration);
+		mPressureError = _GetPredictedDensityError();
+		++mPressureIterationCount;
+	}
+	while(mPressureIterationCount < _MAX_PRESSURE_ITERATIONS
+	   && !_is_diverged(mPressureError)
+	   && (mPressureIterationCount < _MIN_PRESSURE_ITERATIONS
+	       || mPressureError > mPressureTolerance));
+	if(_is_diverged(mPressureError))
+		++mDivergedSolveCount;
+
+	_IntegratePressure();
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Solve the pressures with IISPH: the pressure Poisson equation (the density
+// change of the pressure accelerations cancels the density error after
+// advection) is solved with relaxed Jacobi iterations until the average
+// compression drops below the tolerance (Ihmsen et al. 2014)
+void CpuSolver::_SolveIisph()
+{
+	// forces other than pressure (pressures are halved)
+	_ForEachParticle(&CpuSolver::_ComputeNonPressureAcceleration);
+	_ForEachParticle(&CpuSolver::_ComputeIisphDiagonal);
+
+	// relax the pressures
+	mPressureIterationCount = 0;
+	do
+	{
+		_ForEachParticle(&CpuSolver::_ComputePressureAcceleration);
+		_ForEachParticle(&CpuSolver::_RelaxIisphPressure);
+		mPressureError = _GetPredictedDensityError();
+		++mPressureIterationCount;
+	}
+	while(mPressureIterationCount < _MAX_PRESSURE_ITERATIONS
+	   && !_is_diverged(mPressureError)
+	   && (mPressureIterationCount < _MIN_PRESSURE_ITERATIONS
+	       || mPressureError > mPressureTolerance));
+	if(_is_diverged(mPressureError))
+		++mDivergedSolveCount;
+
+	_ForEachParticle(&CpuSolver::_ComputePressureAcceleration);
+	_IntegratePressure();
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Compute the density after advection and the diagonal term of a particle
+// (density change of its own pressure)
+void CpuSolver::_ComputeIisphDiagonal(int i)
+{
+	const ParticleArrays& particles = mParticles[mPingPong];
+	const int COUNT = static_cast<int>(mParticleCount);
+	const float DT  = mTicks;
+	float position[3];
+
+	_get_position(particles, i, position);
+	_GradientVisitor velocity(particles,
+	                          particles[PARTICLE_VX],
+	                          particles.Stride(),
+	                          i,
+	                          mConstants);
+	_VisitNeighbours(i, position, velocity);
+	_GradientVisitor acceleration(particles,
+	                              &mAccelerations[0],
+	                              COUNT,
+	                              i,
+	                              mConstants);
+	_VisitNeighbours(i, position, acceleration);
+
+	const float *g = velocity.gradient;
+	float density  = particles[PARTICLE_DENSITY][i];
+	mAdvectedDensities[i] = density + DT * velocity.divergence
+	                      + DT * DT * acceleration.divergence;
+	mDiagonals[i] = density > 0.0f
+	              ? -DT * DT / (density * density)
+	                * (g[0]*g[0] + g[1]*g[1] + g[2]*g[2]
+	                   + velocity.gradientNorm2)
+	              : 0.0f;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Relax the pressure of a particle (Jacobi)
+void CpuSolver::_RelaxIisphPressure(int i)
+{
+	const ParticleArrays& particles = mParticles[mPingPong];
+	const int COUNT = static_cast<int>(mParticleCount);
+	const float DT  = mTicks;
+	float position[3];
+
+	_get_position(particles, i, position);
+	_GradientVisitor visitor(particles,
+	                         &mPressureAccelerations[0],
+	                         COUNT,
+	                         i,
+	                         mConstants);
+	_VisitNeighbours(i, position, visitor);
+
+	// density with the current pressures
+	float density = mAdvectedDensities[i] + DT * DT * visitor.divergence;
+	mParticles[1-mPingPong][PARTICLE_DENSITY][i] = density;
+	mPressures[i] = mDiagonals[i] < 0.0f
+	              ? std::max(mPressures[i] + _JACOBI_RELAXATION
+	                         * (mConstants.restDensity - density)
+	                         / mDiagonals[i],
+	                         0.0f)
+	              : 0.0f;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Integrate the non pressure and the pressure accelerations
+void CpuSolver::_IntegratePressure()
+{
+	ParticleArrays& particles = mParticles[mPingPong];
+	float *acceleration = particles[PARTICLE_ACCELERATION];
+	const int COUNT     = static_cast<int>(mParticleCount);
+	const float DT      = mTicks;
+
+#pragma omp parallel for schedule(static)
+	for(int i=0; i<COUNT; ++i)
+	{
+		float accelerationNorm2 = 0.0f;
+		for(int c=0; c<3; ++c)
+		{
+			float a = mAccelerations[c*COUNT + i]
+			        + mPressureAccelerations[c*COUNT + i];
+			particles[PARTICLE_VX+c][i]+= a * DT;
+			accelerationNorm2          += a * a;
+		}
+		acceleration[i] = std::sqrt(accelerationNorm2);
+	}
+	_Drift(DT);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Solve the pressures with DFSPH: the velocities of the last step are made
+// divergence-free, then the velocities predicted from the other forces are
+// corrected until the density after the step matches the rest density
+// (Bender and Koschier 2015)
+void CpuSolver::_SolveDfsph()
+{
+	ParticleArrays& particles = mParticles[mPingPong];
+	float *acceleration = particles[PARTICLE_ACCELERATION];
+	const int COUNT     = static_cast<int>(mParticleCount);
+	const float DT      = mTicks;
+	double start        = get_wall_time();
+
+	// divergence solve (the positions of the last step are final)
+	_ForEachParticle(&CpuSolver::_ComputeDfsphFactor);
+	mDivergenceIterationCount = _IterateDfsph(
+		&CpuSolver::_CorrectDfsphDivergence,
+		mDivergencePressures,
+		mDivergenceError);
+	mDivergenceSolveTime+= get_wall_time() - start;
+
+	// predict the velocities (mAccelerations keeps the velocities before
+	// the density solve)
+	start = get_wall_time();
+	_ForEachParticle(&CpuSolver::_ComputeNonPressureAcceleration);
+#pragma omp parallel for schedule(static)
+	for(int i=0; i<COUNT; ++i)
+		for(int c=0; c<3; ++c)
+		{
+			float *velocity = &particles[PARTICLE_VX+c][i];
+			float  a        = mAccelerations[c*COUNT + i];
+			mAccelerations[c*COUNT + i] = *velocity;
+			*velocity+= a * DT;
+		}
+
+	// density solve
+	mPressureIterationCount = _IterateDfsph(&CpuSolver::_CorrectDfsphDensity,
+	                                        mPressures,
+	                                        mPressureError);
+	mDensitySolveTime+= get_wall_time() - start;
+
+	// move
+#pragma omp parallel for schedule(static)
+	for(int i=0; i<COUNT; ++i)
+	{
+		float accelerationNorm2 = 0.0f;
+		for(int c=0; c<3; ++c)
+		{
+			float a = ( particles[PARTICLE_VX+c][i]
+			          - mAccelerations[c*COUNT + i] ) / DT;
+			accelerationNorm2+= a * a;
+		}
+		acceleration[i] = std::sqrt(accelerationNorm2);
+	}
+	_Drift(DT);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Iterate a DFSPH solve, warm started with half the pressures of the last
+// step, and return the iteration count (pressures are kept as p / d^2
+// between steps, the kappa / d of the paper, as densities change)
+unsigned CpuSolver::_IterateDfsph(void (CpuSolver::*correct)(int),
+                                  std::vector<float>& pressures,
+                                  float& error)
+{
+	const float *density = mParticles[mPingPong][PARTICLE_DENSITY];
+	const int COUNT      = static_cast<int>(mParticleCount);
+	unsigned iterationCount = 0;
+
+	// warm start
+#pragma omp parallel for schedule(static)
+	for(int i=0; i<COUNT; ++i)
+		mPressureIncrements[i] = pressures[i]
+		                       = 0.5f * pressures[i] * density[i] * density[i];
+	_ForEachParticle(&CpuSolver::_ApplyPressureIncrement);
+
+	// iterate (correct methods accumulate the increments in pressures)
+	do
+	{
+		_ForEachParticle(correct);
+		_ForEachParticle(&CpuSolver::_ApplyPressureIncrement);
+		error = _GetPredictedDensityError();
+		++iterationCount;
+	}
+	while(iterationCount < _MAX_PRESSURE_ITERATIONS
+	   && !_is_diverged(error)
+	   && (iterationCount < _MIN_PRESSURE_ITERATIONS
+	       || error > mPressureTolerance));
+	if(_is_diverged(error))
+		++mDivergedSolveCount;
+
+#pragma omp parallel for schedule(static)
+	for(int i=0; i<COUNT; ++i)
+		pressures[i] = density[i] > 0.0f
+		             ? pressures[i] / (density[i] * density[i]) : 0.0f;
+	return iterationCount;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// DFSPH factor of a particle (the pressure of a unit density error is the
+// factor / dt^2, neglecting the pressures of the neighbours)
+void CpuSolver::_ComputeDfsphFactor(int i)
+{
+	const ParticleArrays& particles = mParticles[mPingPong];
+	float position[3];
+
+	_get_position(particles, i, position);
+	_GradientVisitor visitor(particles,
+	                         particles[PARTICLE_VX],
+	                         particles.Stride(),
+	                         i,
+	                         mConstants);
+	_VisitNeighbours(i, position, visitor);
+
+	const float *g = visitor.gradient;
+	float density  = particles[PARTICLE_DENSITY][i];
+	float norm2    = g[0]*g[0] + g[1]*g[1] + g[2]*g[2]
+	               + visitor.gradientNorm2;
+	mDiagonals[i]  = norm2 > 0.0f ? density * density / norm2 : 0.0f;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Pressure increment of a particle from its density after the step
+void CpuSolver::_CorrectDfsphDensity(int i)
+{
+	const ParticleArrays& particles = mParticles[mPingPong];
+	const float DT = mTicks;
+	float position[3];
+
+	_get_position(particles, i, position);
+	_GradientVisitor visitor(particles,
+	                         particles[PARTICLE_VX],
+	                         particles.Stride(),
+	                         i,
+	                         mConstants);
+	_VisitNeighbours(i, position, visitor);
+
+	float density = particles[PARTICLE_DENSITY][i] + DT * visitor.divergence;
+	mParticles[1-mPingPong][PARTICLE_DENSITY][i] = density;
+	mPressureIncrements[i] = std::max(density - mConstants.restDensity, 0.0f)
+	                       * _JACOBI_RELAXATION * mDiagonals[i] / (DT * DT);
+	mPressures[i]+= mPressureIncrements[i];
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Pressure increment of a particle from its density rate (the predicted
+// density holds d0 + dt * rate, for the error)
+void CpuSolver::_CorrectDfsphDivergence(int i)
+{
+	const ParticleArrays& particles = mParticles[mPingPong];
+	const float DT = mTicks;
+	float position[3];
+
+	_get_position(particles, i, position);
+	_GradientVisitor visitor(particles,
+	                         particles[PARTICLE_VX],
+	                         particles.Stride(),
+	                         i,
+	                         mConstants);
+	_VisitNeighbours(i, position, visitor);
+
+	float rate = visitor.count < _DFSPH_MIN_NEIGHBOURS
+	           ? 0.0f : visitor.divergence;
+	mParticles[1-mPingPong][PARTICLE_DENSITY][i] = mConstants.restDensity
+	                                             + DT * rate;
+	mPressureIncrements[i] = std::max(rate, 0.0f)
+	                       * _JACOBI_RELAXATION * mDiagonals[i] / DT;
+	mDivergencePressures[i]+= mPressureIncrements[i];
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Update the velocity of a particle with the pressure increments
+void CpuSolver::_ApplyPressureIncrement(int i)
+{
+	ParticleArrays& particles = mParticles[mPingPong];
+	const float DT = mTicks;
+	float position[3];
+
+	_get_position(particles, i, position);
+	_PressureVisitor visitor(particles,
+	                         &mPressureIncrements[0],
+	                         particles[PARTICLE_DENSITY],
+	                         i,
+	                         mConstants);
+	_VisitNeighbours(i, position, visitor);
+	for(int c=0; c<3; ++c)
+		particles[PARTICLE_VX+c][i]+= visitor.acceleration[c] * DT;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Step with position based fluids: the positions predicted from gravity are
+// projected on the density constraints for a fixed number of Jacobi
+// iterations, and the velocities are derived from the motion (Macklin and
+// Mueller 2013). Walls only clamp the positions, so dt is not bounded by
+// their stiffness.
+void CpuSolver::_SolvePbf()
+{
+	ParticleArrays& particles = mParticles[mPingPong];
+	ParticleArrays& start     = mParticles[1-mPingPong];
+	float *acceleration = particles[PARTICLE_ACCELERATION];
+	const int COUNT     = static_cast<int>(mParticleCount);
+	const float DT      = mTicks;
+	const float G       = DT * _GRAVITY;
+	double startTime    = get_wall_time();
+
+	// predict (the other particle arrays keep the positions of the start of
+	// the step, mAccelerations the velocities)
+#pragma omp parallel for schedule(static)
+	for(int i=0; i<COUNT; ++i)
+		for(int c=0; c<3; ++c)
+		{
+			float *velocity = &particles[PARTICLE_VX+c][i];
+			start[PARTICLE_X+c][i]      = particles[PARTICLE_X+c][i];
+			mAccelerations[c*COUNT + i] = *velocity;
+			*velocity+= G * mGravityDir[c];
+		}
+	_Drift(DT);
+	_UpdateCells();
+
+	// project
+	for(unsigned n=0; n<mPbfIterationCount; ++n)
+	{
+		_ForEachParticle(&CpuSolver::_ComputePbfLambda);
+		_ForEachParticle(&CpuSolver::_ComputePbfDisplacement);
+		for(int c=0; c<3; ++c)
+		{
+			float *position     = particles[PARTICLE_X+c];
+			const float *offset = &mPressureAccelerations[c*COUNT];
+			const float MIN     = mConstants.simBoundsMin[c] + _BOUNDARY_CLAMP;
+			const float MAX     = mConstants.simBoundsMax[c] - _BOUNDARY_CLAMP;
+#pragma omp parallel for schedule(static)
+			for(int i=0; i<COUNT; ++i)
+				position[i] = std::min(std::max(position[i] + offset[i], MIN),
+				                       MAX);
+		}
+	}
+	mPressureIterationCount = mPbfIterationCount;
+	mPressureError          = _GetPredictedDensityError();
+
+	// velocities
+#pragma omp parallel for schedule(static)
+	for(int i=0; i<COUNT; ++i)
+	{
+		float accelerationNorm2 = 0.0f;
+		for(int c=0; c<3; ++c)
+		{
+			float *velocity = &particles[PARTICLE_VX+c][i];
+			*velocity = ( particles[PARTICLE_X+c][i]
+			            - start[PARTICLE_X+c][i] ) / DT;
+			float a = (*velocity - mAccelerations[c*COUNT + i]) / DT;
+			accelerationNorm2+= a * a;
+		}
+		acceleration[i] = std::sqrt(accelerationNorm2);
+	}
+	mDensitySolveTime+= get_wall_time() - startTime;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Density and constraint multiplier of a particle (compression only, so
+// that the free surface does not clump)
+void CpuSolver::_ComputePbfLambda(int i)
+{
+	ParticleArrays& particles = mParticles[mPingPong];
+	const float D0 = mConstants.restDensity;
+	float position[3];
+
+	_get_position(particles, i, position);
+	_DensityVisitor density(particles,
+	                        i,
+	                        mConstants.smoothingLengthSquared,
+	                        mDensityKernel);
+	_VisitNeighbours(i, position, density);
+	density.Flush();
+	_GradientVisitor gradient(particles,
+	                          particles[PARTICLE_VX],
+	                          particles.Stride(),
+	                          i,
+	                          mConstants);
+	_VisitNeighbours(i, position, gradient);
+
+	// the error is read from the other particle arrays
+	float d = density.density * mConstants.densityConstants;
+	particles[PARTICLE_DENSITY][i] = mParticles[1-mPingPong][PARTICLE_DENSITY][i]
+	                               = d;
+
+	const float *g = gradient.gradient;
+	float norm2    = ( g[0]*g[0] + g[1]*g[1] + g[2]*g[2]
+	                 + gradient.gradientNorm2 ) / (D0 * D0);
+	float c        = std::max(d / D0 - 1.0f, 0.0f);
+	mPressures[i]  = norm2 > 0.0f
+	               ? -c / ((1.0f + _PBF_RELAXATION) * norm2) : 0.0f;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Position correction of a particle (sum (li + lj) Gij / d0, the pressure
+// acceleration of the multipliers scaled by -d0)
+void CpuSolver::_ComputePbfDisplacement(int i)
+{
+	const ParticleArrays& particles = mParticles[mPingPong];
+	const int COUNT = static_cast<int>(mParticleCount);
+	float position[3];
+
+	_get_position(particles, i, position);
+	_PressureVisitor visitor(particles, &mPressures[0], NULL, i, mConstants);
+	_VisitNeighbours(i, position, visitor);
+	for(int c=0; c<3; ++c)
+		mPressureAccelerations[c*COUNT + i] = -mConstants.restDensity
+		                                    * visitor.acceleration[c];
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Compute the acceleration of a particle without pressure
+void CpuSolver::_ComputeNonPressureAcceleration(int i)
+{
+	const ParticleArrays& particles = mParticles[mPingPong];
+	const int COUNT = static_cast<int>(mParticleCount);
+	float ri[3], vi[3], acceleration[3];
+
+	for(int c=0; c<3; ++c)
+	{
+		ri[c] = particles[PARTICLE_X+c][i];
+		vi[c] = particles[PARTICLE_VX+c][i];
+	}
+	_GetAcceleration(i, ri, vi, false, acceleration, NULL);
+	for(int c=0; c<3; ++c)
+	{
+		mAccelerations[c*COUNT + i]         = acceleration[c];
+		mPressureAccelerations[c*COUNT + i] = 0.0f;
+	}
+
+	// PCISPH starts from zero, IISPH from half the previous pressure (DFSPH
+	// warm starts in _IterateDfsph)
+	if(SOLVER_MODE_PCISPH == mSolverMode)
+		mPressures[i] = 0.0f;
+	else if(SOLVER_MODE_IISPH == mSolverMode)
+		mPressures[i]*= 0.5f;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Predict the position of a particle (stored in the other particle arrays)
+void CpuSolver::_PredictPosition(int i)
+{
+	const ParticleArrays& iParticles = mParticles[mPingPong];
+	ParticleArrays& oParticles       = mParticles[1-mPingPong];
+	const int COUNT = static_cast<int>(mParticleCount);
+	const float DT  = mTicks;
+
+	for(int c=0; c<3; ++c)
+	{
+		float velocity = iParticles[PARTICLE_VX+c][i]
+		               + ( mAccelerations[c*COUNT + i]
+		                 + mPressureAccelerations[c*COUNT + i] ) * DT;
+		oParticles[PARTICLE_X+c][i] = iParticles[PARTICLE_X+c][i]
+		                            + velocity * DT;
+	}
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Correct the pressure of a particle from its predicted density (neighbours
+// come from the current positions)
+void CpuSolver::_CorrectPcisphPressure(int i)
+{
+	ParticleArrays& predicted = mParticles[1-mPingPong];
+	float position[3];
+
+	_get_position(mParticles[mPingPong], i, position);
+	_DensityVisitor visitor(predicted,
+	                        i,
+	                        mConstants.smoothingLengthSquared,
+	                        mDensityKernel);
+	_VisitNeighbours(i, position, visitor);
+	visitor.Flush();
+
+	float density = visitor.density * mConstants.densityConstants;
+	predicted[PARTICLE_DENSITY][i] = density;
+	mPressures[i] = std::max(mPressures[i] + mPcisphDelta
+	                         * (density - mConstants.restDensity),
+	                         0.0f);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Compute the pressure acceleration of a particle
+void CpuSolver::_ComputePressureAcceleration(int i)
+{
+	const ParticleArrays& particles = mParticles[mPingPong];
+	const int COUNT = static_cast<int>(mParticleCount);
+	float position[3];
+
+	_get_position(particles, i, position);
+	_PressureVisitor visitor(particles,
+	                         &mPressures[0],
+	                         SOLVER_MODE_IISPH == mSolverMode
+	                         ? particles[PARTICLE_DENSITY] : NULL,
+	                         i,
+	                         mConstants);
+	_VisitNeighbours(i, position, visitor);
+	for(int c=0; c<3; ++c)
+		mPressureAccelerations[c*COUNT + i] = visitor.acceleration[c];
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// PCISPH factor of a particle
+float CpuSolver::_GetPcisphFactor(int i) const
+{
+	const ParticleArrays& particles = mParticles[mPingPong];
+	float position[3];
+
+	_get_position(particles, i, position);
+	_PcisphFactorVisitor visitor(particles, i, mConstants);
+	_VisitNeighbours(i, position, visitor);
+	return visitor.Factor();
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Average density error at the predicted positions (compression only,
+// relative to the rest density), infinite if a density is not finite
+float CpuSolver::_GetPredictedDensityError() const
+{
+	const float *density = mParticles[1-mPingPong][PARTICLE_DENSITY];
+	const float D0       = mConstants.restDensity;
+	const int COUNT      = static_cast<int>(mParticleCount);
+	double error    = 0.0;
+	int    diverged = 0;
+
+#pragma omp parallel for schedule(static) reduction(+:error,diverged)
+	for(int i=0; i<COUNT; ++i)
+	{
+		if(_is_diverged(density[i]))
+			++diverged;
+		else
+			error+= std::max(density[i] - D0, 0.0f);
+	}
+	return diverged > 0 ? std::numeric_limits<float>::infinity()
+	                    : static_cast<float>(error / (COUNT * D0));
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Move the particles (see sph_force.glsl)
+void CpuSolver::_Drift(float ticks)
+{
+	ParticleArrays& particles = mParticles[mPingPong];
+	const int COUNT = static_cast<int>(mParticleCount);
+
+	for(int c=0; c<3; ++c)
+	{
+		float *position       = particles[PARTICLE_X+c];
+		const float *velocity = particles[PARTICLE_VX+c];
+		const float MIN       = mConstants.simBoundsMin[c] + _BOUNDARY_CLAMP;
+		const float MAX       = mConstants.simBoundsMax[c] - _BOUNDARY_CLAMP;
+#pragma omp parallel for schedule(static)
+		for(int i=0; i<COUNT; ++i)
+			position[i] = std::min(std::max(position[i] + velocity[i]*ticks,
+			                                MIN),
+			                       MAX);
+	}
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Finest dt level of the particles
+int CpuSolver::_FinestTimeLevel() const
+{
+	const float *levels = mParticles[mPingPong][PARTICLE_TIME_LEVEL];
+	const int COUNT     = static_cast<int>(mParticleCount);
+	int finest = 0, mask = 0;
+
+#pragma omp parallel for schedule(static) reduction(|:mask)
+	for(int i=0; i<COUNT; ++i)
+		mask|= 1 << static_cast<int>(levels[i]);
+	while(mask >>= 1)
+		++finest;
+	return finest;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Check if the level of a particle starts a kick at the current substep
+bool CpuSolver::_IsActive(const ParticleArrays& particles, int i) const
+{
+	int level = static_cast<int>(particles[PARTICLE_TIME_LEVEL][i]);
+	return 0 == mSubstep % ((1 << (mTimeLevelCount-1)) >> level);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Number of particles kicked at the current substep
+int CpuSolver::_ActiveParticleCount() const
+{
+	const ParticleArrays& particles = mParticles[mPingPong];
+	const int COUNT = static_cast<int>(mParticleCount);
+	int count = 0;
+
+#pragma omp parallel for schedule(static) reduction(+:count)
+	for(int i=0; i<COUNT; ++i)
+		count+= _IsActive(particles, i) ? 1 : 0;
+	return count;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Run a per particle method on all the particles (static split of the
+// particles, or blocks of cells run by the work stealing scheduler; the grid
+// holds each particle once, even when the neighbour lists are reused)
+void CpuSolver::_ForEachParticle(void (CpuSolver::*method)(int))
+{
+	const int COUNT = static_cast<int>(mParticleCount);
+	const int CELLS = _ScannedCellCount();
+
+	if(SCHEDULE_MODE_STEAL == mScheduleMode)
+	{
+		_CellBlockTask task(*this, method);
+		mScheduler.Run((CELLS + _BLOCK_CELLS - 1) / _BLOCK_CELLS, task);
+		return;
+	}
+
+#pragma omp parallel for schedule(static)
+	for(int i=0; i<COUNT; ++i)
+		(this->*method)(i);
+}
+
+
+} // namespace sph
+
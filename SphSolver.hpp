@@ -0,0 +1,442 @@
+////////////////////////////////////////////////////////////////////////////////
+// \author   Jonathan Dupuy
+// \brief    CPU implementation of the SPH solver. Mirrors the sph_grid.glsl,
+//           sph_density.glsl and sph_force.glsl programs, and runs on all
+//           cores via OpenMP (serial if OpenMP is disabled).
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef SPH_SOLVER_HPP
+#define SPH_SOLVER_HPP
+
+#include "Algebra.hpp"
+#include "SphKernels.hpp"
+#include "SphScheduler.hpp"
+
+#include <vector>
+
+namespace sph
+{
+	// Grid construction modes
+	enum GridMode
+	{
+		GRID_MODE_LINKED_LIST = 0, // per cell linked lists (atomic exchanges)
+		GRID_MODE_SORTED,          // counting sort, cells are index ranges
+		GRID_MODE_COUNT
+	};
+
+	// Grid mode names ("list" or "sorted")
+	const char* grid_mode_name(GridMode gridMode);
+	GridMode    grid_mode_from_name(const char* name); // sorted if unknown
+
+	// Cell indexing modes
+	enum CellIndexMode
+	{
+		CELL_INDEX_DENSE = 0, // one cell per cell of the domain (clamped)
+		CELL_INDEX_HASHED,    // fixed size table, cell coordinates wrap around
+		CELL_INDEX_COUNT
+	};
+
+	// Cell index names ("dense" or "hash")
+	const char*   cell_index_name(CellIndexMode cellIndexMode);
+	CellIndexMode cell_index_from_name(const char* name); // dense if unknown
+
+	// Neighbour search modes
+	enum SearchMode
+	{
+		SEARCH_MODE_27 = 0, // cells of h, the 27 cells around the particle
+		SEARCH_MODE_8,      // cells of 2h, the 8 cells closest to the particle
+		SEARCH_MODE_COUNT
+	};
+
+	// Search mode names ("27" or "8")
+	const char* search_mode_name(SearchMode searchMode);
+	SearchMode  search_mode_from_name(const char* name); // 27 if unknown
+
+	// Cell size of a search mode (h or 2h)
+	float get_search_cell_size(SearchMode searchMode, float smoothingLength);
+
+	// Offsets of the searched cells from the 1d bucket of a cell of a dense
+	// grid, x first. 27 offsets for SEARCH_MODE_27 (cell + (x,y,z) at
+	// x+1 + 3*(y+1) + 9*(z+1)), 64 for SEARCH_MODE_8 (cell + (x,y,z)*side at
+	// 8*octant + x + 2*y + 4*z, where bit i of the octant is set if the
+	// particle lies in the upper half of its cell along axis i)
+	void get_cell_stencil(SearchMode searchMode,
+	                      const Vector3& bucket3dSize,
+	                      std::vector<int>& offsets);
+
+	// Size of the hashed grid of a particle count: powers of two, at least 8
+	// cells per dimension (neighbourhoods of up to 7^3 cells never overlap)
+	// and a cell per 8 particles
+	Vector3 get_hashed_grid_size(unsigned particleCount);
+
+	// Pair evaluation modes
+	enum PairMode
+	{
+		PAIR_MODE_FULL = 0, // each particle sums over all its neighbours
+		PAIR_MODE_HALF,     // half shell, each pair is evaluated once
+		PAIR_MODE_COUNT
+	};
+
+	// Pair mode names ("full" or "half")
+	const char* pair_mode_name(PairMode pairMode);
+	PairMode    pair_mode_from_name(const char* name); // full if unknown
+
+	// Scheduling modes of the per particle passes
+	enum ScheduleMode
+	{
+		SCHEDULE_MODE_STATIC = 0, // particles split evenly among the threads
+		SCHEDULE_MODE_STEAL,      // blocks of cells, work stealing
+		SCHEDULE_MODE_COUNT
+	};
+
+	// Schedule mode names ("static" or "steal")
+	const char*  schedule_mode_name(ScheduleMode scheduleMode);
+	ScheduleMode schedule_mode_from_name(const char* name); // static if unknown
+
+	// Pressure solvers
+	enum SolverMode
+	{
+		SOLVER_MODE_WCSPH = 0, // weakly compressible, pressure = k*(d - d0)
+		SOLVER_MODE_PCISPH,    // predictive-corrective incompressible
+		SOLVER_MODE_IISPH,     // implicit incompressible (relaxed Jacobi)
+		SOLVER_MODE_DFSPH,     // divergence-free
+		SOLVER_MODE_PBF,       // position based (fixed iteration count)
+		SOLVER_MODE_COUNT
+	};
+
+	// Solver mode names ("wcsph", "pcisph", "iisph", "dfsph" or "pbf")
+	const char* solver_mode_name(SolverMode solverMode);
+	SolverMode  solver_mode_from_name(const char* name); // wcsph if unknown
+
+	// Morton (Z-order) code of a 3d cell (10 bits per coordinate)
+	unsigned morton_code(unsigned x, unsigned y, unsigned z);
+
+	// Rank of each cell of a 3d bucket once sorted along the Z-order curve
+	void get_cell_morton_ranks(const Vector3& bucket3dSize,
+	                           std::vector<int>& ranks);
+
+
+	// Solver constants (see set_sph_constants() in main.cpp)
+	struct Constants
+	{
+		float   smoothingLength;        // h
+		float   smoothingLengthSquared; // h2
+		float   particleMass;           // mass of the particles
+		float   densityConstants;       // poly6 * mass
+		float   gradDensityConstants;   // gradPoly6 * mass
+		float   pressureConstants;      // -gradSpiky * mass / 2
+		float   viscosityConstants;     // grad2Viscosity * mass * mu
+		float   viscosity;              // mu
+		float   restDensity;            // rest density
+		float   k;                      // pressure constant
+		float   stiffness;              // boundary stiffness
+		float   dampening;              // boundary dampening
+		float   bucketCellSize;         // dimensions of a cell
+		Vector3 bucket3dSize;           // number of cells in each dimension
+		Vector3 bucketBoundsMin;        // min bounds of the bucket
+		Vector3 simBoundsMin;           // simulation bounds (min)
+		Vector3 simBoundsMax;           // simulation bounds (max)
+	};
+
+
+	// Largest stable dt of a particle (CFL and force conditions, at most
+	// maxTicks)
+	float get_particle_ticks(const Constants& constants,
+	                         float speed,
+	                         float acceleration,
+	                         float maxTicks);
+
+	// Largest stable dt for the maximum speed and acceleration of the
+	// particles (CFL, force and viscosity conditions, at most maxTicks)
+	float get_adaptive_ticks(const Constants& constants,
+	                         float maxSpeed,
+	                         float maxAcceleration,
+	                         float maxTicks);
+
+
+	// CPU solver
+	class CpuSolver
+	{
+	public:
+		// Constructors / Destructor
+		CpuSolver();
+
+		// Manipulation
+			// set the constants (rebuilds the grid storage)
+		void SetConstants(const Constants& constants);
+			// set dt (the maximum dt if adaptive)
+		void SetTicks(float ticks);
+			// pick dt before each step from the maximum speed and acceleration
+			// of the previous one (see get_adaptive_ticks)
+		void SetAdaptiveTicks(bool enable);
+			// set the pressure solver (block time stepping only applies to the
+			// weakly compressible one)
+		void SetSolverMode(SolverMode solverMode);
+			// set the average density error the iterative solvers stop at
+			// (compression only, relative to the rest density)
+		void SetPressureTolerance(float tolerance);
+			// set the number of density constraint iterations of PBF (the
+			// cost of a step does not depend on the error)
+		void SetPbfIterations(unsigned iterationCount);
+			// set the number of dt levels of block time stepping (particles of
+			// level l move with dt/2^l, picked from their own CFL and force
+			// conditions; a step runs 2^(levels-1) substeps, 1: single rate)
+		void SetTimeLevels(unsigned levelCount);
+			// integrate the densities with the continuity equation in the force
+			// pass, the density pass only runs every densityFrequency steps to
+			// remove the drift (0 or 1: every step; weakly compressible solver
+			// with a single dt level only)
+		void SetFusedDensity(unsigned densityFrequency);
+			// set the grid construction mode
+		void SetGridMode(GridMode gridMode);
+			// repair the sorted grid of the previous build instead of sorting
+			// all the particles again: the particles which changed cell are
+			// sorted and merged with the others, unless they are more than
+			// maxMovedFraction of the particles (0: always sort)
+		void SetIncrementalGrid(float maxMovedFraction);
+			// set the cell indexing (the hashed grid ignores the bucket size of
+			// the constants and is sized by the particle count)
+		void SetCellIndexMode(CellIndexMode cellIndexMode);
+			// set the neighbour search (the cells of the constants must be as
+			// large as get_search_cell_size)
+		void SetSearchMode(SearchMode searchMode);
+			// keep a bit per non-empty cell and the list of these cells when
+			// building the grid: neighbour searches skip the empty cells with a
+			// bit test, and the passes over the cells only visit the others
+		void SetOccupancy(bool enable);
+			// set the pair evaluation mode (half: 13 cells + the upper triangle
+			// of the particle's cell, or the upper half of the neighbour lists)
+		void SetPairMode(PairMode pairMode);
+			// set the scheduling of the density and force passes
+		void SetScheduleMode(ScheduleMode scheduleMode);
+			// set the number of steps between two Z-order reorders (0: never)
+		void SetReorderFrequency(unsigned reorderFrequency);
+			// use Verlet neighbour lists (search radius is h + skin, lists are
+			// rebuilt once a particle has moved by more than skin/2)
+		void SetNeighbourLists(bool enable, float skin);
+			// store the neighbour lists as 16 bit deltas from the index of
+			// the particle (far neighbours take an escape code and 32 bits)
+		void SetCompressedNeighbourLists(bool enable);
+			// record the neighbours within h found by the density pass (at
+			// most capacity per particle) and replay them in the force pass
+			// instead of searching the cells again; particles with more
+			// neighbours search the cells (weakly compressible solver, full
+			// pairs, without neighbour lists or fused densities; 0: off)
+		void SetPairReuse(int capacity);
+			// set the instruction set of the kernels (clamped to the supported one)
+		void SetSimdIsa(SimdIsa simdIsa);
+			// set direction of the gravity acceleration
+		void SetGravityDir(const Vector3& gravityDir);
+			// set particles (densities and accelerations are reserved)
+		void SetParticles(const ParticleArrays& particles);
+			// advance the simulation by one step
+		void Step();
+
+		// Queries
+		float                 Ticks()         const; // dt of the last step
+		GridMode              GetGridMode()   const;
+		CellIndexMode         GetCellIndexMode() const;
+		SearchMode            GetSearchMode() const;
+		unsigned              ActiveCellCount() const; // occupancy only
+		float                 MovedFraction() const; // last grid (incremental)
+		unsigned              GridRepairCount() const; // all steps
+		SimdIsa               GetSimdIsa()    const;
+		PairMode              GetPairMode()   const;
+		ScheduleMode          GetScheduleMode() const;
+		SolverMode            GetSolverMode() const;
+		unsigned              PressureIterationCount() const; // last step
+		float                 PressureError() const; // last step, compression
+		unsigned              DivergenceIterationCount() const; // dfsph
+		float                 DivergenceError() const; // dfsph, relative
+		unsigned              DivergedSolveCount() const; // all steps
+		double                DensitySolveTime() const; // seconds, all steps
+		double                DivergenceSolveTime() const; // (dfsph)
+		unsigned              DensityPassCount() const; // all steps
+		float                 DensityDrift()    const; // fused: mean and max
+		float                 MaxDensityDrift() const; // at the last pass
+		unsigned              ParticleCount() const;
+		const ParticleArrays& Particles()     const;
+		int                   ThreadCount()   const;
+		unsigned              NeighbourListBuildCount() const;
+		size_t                NeighbourListBytes() const; // lists and starts
+			// pairs within h (all steps)
+		double                PairCount()     const;
+			// candidates tested (all steps)
+		double                CandidateCount() const;
+			// particles over the capacity
+		unsigned              PairOverflowCount() const;
+		double                ForceEvaluationCount() const; // per particle
+		const BlockScheduler& Scheduler()     const; // worker counters
+
+	private:
+		// Non copyable
+		CpuSolver(const CpuSolver& solver);
+		CpuSolver& operator=(const CpuSolver& solver);
+
+		// Internal types
+		struct _CellBlockTask; // per particle method over blocks of cells
+
+		// Internal manipulation
+		void _ResizeCells();
+		void _UpdateCells();
+		void _GetStepMaxima(float *maxSpeed, float *maxAcceleration) const;
+		void _BuildGrid();
+		void _BuildSortedGrid();
+		bool _RepairSortedGrid(int movedCount);
+		void _FindActiveCells();
+		bool _IsOccupied(int bucket1d) const;
+		int  _ScannedCellCount() const;
+		int  _ScannedCell(int n) const;
+		void _SortParticles();
+		void _ReorderParticles();
+		bool _NeighbourListsExpired() const;
+		void _BuildNeighbourLists();
+		bool _FusesDensity() const;
+		bool _ReusesPairs() const;
+		void _CountPairs();
+		void _UpdateDensities();
+		void _ComputeDensities();
+		void _ComputeDensity(int i);
+		void _ComputeForces();
+		void _ComputeForce(int i);
+		void _GetAcceleration(int i,
+		                      const float *ri,
+		                      const float *vi,
+		                      bool pressure,
+		                      float *acceleration,
+		                      float *densityRate) const;
+		void _SolvePcisph();
+		void _ComputeNonPressureAcceleration(int i);
+		void _PredictPosition(int i);
+		void _CorrectPcisphPressure(int i);
+		void _ComputePressureAcceleration(int i);
+		float _GetPcisphFactor(int i) const;
+		float _GetPredictedDensityError() const;
+		void _SolveIisph();
+		void _ComputeIisphDiagonal(int i);
+		void _RelaxIisphPressure(int i);
+		void _IntegratePressure();
+		void _SolveDfsph();
+		unsigned _IterateDfsph(void (CpuSolver::*correct)(int),
+		                       std::vector<float>& pressures,
+		                       float& error);
+		void _ComputeDfsphFactor(int i);
+		void _CorrectDfsphDensity(int i);
+		void _CorrectDfsphDivergence(int i);
+		void _ApplyPressureIncrement(int i);
+		void _SolvePbf();
+		void _ComputePbfLambda(int i);
+		void _ComputePbfDisplacement(int i);
+		void _Drift(float ticks);
+		bool _IsActive(const ParticleArrays& particles, int i) const;
+		int  _ActiveParticleCount() const;
+		int  _FinestTimeLevel() const;
+		void _ForEachParticle(void (CpuSolver::*method)(int));
+		void _GetBucket3d(const float *position, int *bucket3d) const;
+		int  _GetBucket1d(int x, int y, int z) const;
+		bool _HasStencil(const int *bucket3d) const;
+		int  _GetCellParticles(int bucket1d,
+		                       std::vector<int>& scratch,
+		                       const int **particles) const;
+		template<typename Visitor>
+		void _VisitCell(int bucket1d, Visitor& visitor) const;
+		template<typename Visitor>
+		void _VisitCells(const float *position,
+		                 int range,
+		                 Visitor& visitor) const;
+		template<typename Visitor>
+		void _VisitOctant(const float *position, Visitor& visitor) const;
+		template<typename Visitor>
+		void _VisitNeighbours(int i,
+		                      const float *position,
+		                      Visitor& visitor) const;
+		template<typename PairVisitor>
+		void _VisitPairs(int components, const PairVisitor& visitor);
+
+		// Members
+		Constants        mConstants;
+		Vector3          mGravityDir;
+		float            mTicks;
+		float            mMaxTicks;
+		bool             mAdaptiveTicks;
+		SolverMode       mSolverMode;
+		float            mPressureTolerance;
+		unsigned         mPressureIterationCount;
+		float            mPressureError;
+		float            mPcisphDelta;       // pressure per density error
+		unsigned         mPbfIterationCount;
+		std::vector<float> mPressures; // PBF: constraint multipliers
+		std::vector<float> mAccelerations;         // non pressure (SoA)
+		std::vector<float> mPressureAccelerations; // (SoA)
+		std::vector<float> mAdvectedDensities; // density without pressure
+		std::vector<float> mDiagonals; // IISPH diagonals, DFSPH factors
+		std::vector<float> mDivergencePressures; // DFSPH divergence solve
+		std::vector<float> mPressureIncrements;  // DFSPH iteration
+		unsigned         mDivergenceIterationCount;
+		float            mDivergenceError;
+		unsigned         mDivergedSolveCount; // non-finite density errors
+		double           mDensitySolveTime;
+		double           mDivergenceSolveTime;
+		unsigned         mTimeLevelCount;
+		unsigned         mDensityFrequency; // steps between density passes
+		unsigned         mDensityPassCount;
+		float            mDensityDrift;    // relative, continuity vs summation
+		float            mMaxDensityDrift;
+		int              mSubstep;        // substep of block time stepping
+		double           mForceEvaluationCount;
+		unsigned         mParticleCount;
+		GridMode         mGridMode;
+		CellIndexMode    mCellIndexMode;
+		SearchMode       mSearchMode;
+		Vector3          mBucket3dSize; // cells in each dimension
+		SimdIsa          mSimdIsa;
+		DensityKernel    mDensityKernel;
+		ForceKernel      mForceKernel;
+		NeighbourDecoder mNeighbourDecoder;
+		PairMode         mPairMode;
+		ScheduleMode     mScheduleMode;
+		BlockScheduler   mScheduler;
+		unsigned         mReorderFrequency;
+		unsigned         mStepCount;
+		ParticleArrays   mParticles[2]; // ping pong
+		std::vector<int> mHead;       // first particle of each cell
+		std::vector<int> mList;       // next particle in the same cell
+		std::vector<int> mCellStarts;    // first slot of each cell (sorted)
+		std::vector<int> mParticleCells; // sort key of each particle
+		std::vector<int> mPreviousCells; // cells of the previous build
+		std::vector<int> mSortedIndices; // particles sorted by cell (sorted)
+		float            mMaxMovedFraction; // incremental grid threshold
+		bool             mSortedGridValid;  // cells of the current indices
+		float            mMovedFraction;
+		unsigned         mGridRepairCount;
+		std::vector<int> mMovedParticles; // particles which changed cell
+		std::vector<int> mCellMortonRanks; // rank of each cell in Z-order
+		std::vector<int> mCellStencil;    // see get_cell_stencil
+		bool             mOccupancy;
+		std::vector<unsigned> mCellBits;  // bit of each non-empty cell
+		std::vector<int> mActiveCells;    // non-empty cells, in order
+		bool             mNeighbourLists;
+		bool             mNeighbourListsValid;
+		float            mNeighbourSkin;
+		unsigned         mNeighbourListBuildCount;
+		std::vector<int> mNeighbourStarts; // first neighbour of each particle
+		std::vector<int> mNeighbours;      // neighbours of all the particles
+		bool             mCompressedLists;
+		std::vector<short> mPackedNeighbours; // (compressed, starts in words)
+		std::vector<float> mNeighbourRefs; // positions at last list build (SoA)
+		std::vector<float> mPairSums;      // per thread sums (half shell)
+		int              mPairCapacity;  // pairs recorded per particle
+		std::vector<int> mPairs;         // neighbours within h (density pass)
+		std::vector<int> mPairCounts;    // (more than the capacity: overflow)
+		std::vector<int> mCandidateCounts;
+		double           mPairCount;
+		double           mCandidateCount;
+		unsigned         mPairOverflowCount;
+		int              mPingPong;
+	};
+
+} // namespace sph
+
+#endif
+
@@ -19,13 +19,23 @@
 #include "Algebra.hpp"      // Basic algebra library
 #include "Transform.hpp"    // Basic transformations
 #include "Framework.hpp"    // utility classes/functions
+#include "SphSolver.hpp"    // CPU solver
+#include "SphExchange.hpp"  // states of the solver thread
 
 // Standard librabries
 #include <cmath>
 #include <iostream>
 #include <sstream>
 #include <vector>
+#include <string>
 #include <stdexcept>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+
+#ifdef _OPENMP
+#	include <omp.h>
+#endif // _OPENMP
 
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -39,11 +49,13 @@ const GLuint MAX_PARTICLE_COUNT = 256u*1024u; // maximum number of particless
 const Vector3 SIMULATION_DOMAIN = Vector3(30.0f,60.0f,30.0f); // centimeters
 const Vector3 SIM_BOUNDS_MIN    = -0.5f*SIMULATION_DOMAIN;
 const float MIN_SMOOTHING_LENGTH = 1.0f;                   // centimeters
-const Vector3 BUCKET_3D_MAX   = (SIMULATION_DOMAIN/MIN_SMOOTHING_LENGTH).Ceil()
-                              + Vector3(2,2,2); // border cells
-const GLuint  BUCKET_1D_MAX   = BUCKET_3D_MAX[0]
-                              * BUCKET_3D_MAX[1]
-                              * BUCKET_3D_MAX[2];
+const GLuint NEIGHBOUR_CAPACITY = 128; // max neighbours per particle (lists)
+const GLuint MAX_NEIGHBOUR_CAPACITY = 512; // after growing on overflows
+const GLuint STEP_MAXIMA_SLOTS  = 3;   // readbacks of the dt maxima in flight
+const GLuint DISPLACEMENT_SLOTS = 3;   // readbacks of the list displacement
+const GLuint TASK_LOG_SLOTS     = 4;   // frames of task timestamps in flight
+const GLuint TASK_LOG_CAPACITY  = 64;  // task runs timed per frame
+const GLuint TASK_LOG_WIDTH     = 60;  // characters of the frame timelines
 
 enum // OpenGLNames
 {
@@ -54,6 +66,19 @@ enum // OpenGLNames
 	BUFFER_VELOCITIES_PONG,
 	BUFFER_HEAD,
 	BUFFER_LIST,
+	BUFFER_SORTED,
+	BUFFER_CELL_SCAN_PING,
+	BUFFER_CELL_SCAN_PONG,
+	BUFFER_CELL_MORTON,
+	BUFFER_CELL_BITS,
+	BUFFER_ACTIVE_CELLS,
+	BUFFER_NEIGHBOURS,
+	BUFFER_NEIGHBOUR_COUNTS,
+	BUFFER_NEIGHBOUR_REFS,
+	BUFFER_DISPLACEMENT,
+	BUFFER_DISPLACEMENT_READ,
+	BUFFER_STEP_MAXIMA,
+	BUFFER_STEP_MAXIMA_READ,
 	BUFFER_CUBE_VERTICES,
 	BUFFER_CUBE_INDEXES,
 	BUFFER_COUNT,
@@ -70,6 +95,17 @@ enum // OpenGLNames
 	// textures
 	TEXTURE_HEAD = 0,
 	TEXTURE_LIST,
+	TEXTURE_SORTED,
+	TEXTURE_NEIGHBOURS,
+	TEXTURE_DISPLACEMENT,
+	TEXTURE_STEP_MAXIMA,
+	TEXTURE_CELL_BITS,
+	TEXTURE_ACTIVE_CELLS, // last image unit (GL 4.2 guarantees 8)
+	TEXTURE_CELL_SCAN_PING,
+	TEXTURE_CELL_SCAN_PONG,
+	TEXTURE_CELL_MORTON,
+	TEXTURE_NEIGHBOUR_COUNTS,
+	TEXTURE_NEIGHBOUR_REFS,
 	TEXTURE_POS_DENSITIES_PING,
 	TEXTURE_POS_DENSITIES_PONG,
 	TEXTURE_VELOCITIES_PING,
@@ -83,25 +119,72 @@ enum // OpenGLNames
 	TRANSFORM_FEEDBACK_DENSITY_PONG,
 	TRANSFORM_FEEDBACK_PARTICLE_PING,
 	TRANSFORM_FEEDBACK_PARTICLE_PONG,
+	TRANSFORM_FEEDBACK_CELL_SCAN_PING,
+	TRANSFORM_FEEDBACK_CELL_SCAN_PONG,
+	TRANSFORM_FEEDBACK_NEIGHBOURS,
+	TRANSFORM_FEEDBACK_CELL_BITS,
 	TRANSFORM_FEEDBACK_COUNT,
 
 	// programs
 	PROGRAM_DENSITY = 0,
 	PROGRAM_BUCKET,
 	PROGRAM_GRID,
+	PROGRAM_GRID_SCATTER,
+	PROGRAM_CELL_SCAN,
+	PROGRAM_CELL_CLEAR,
+	PROGRAM_REORDER_COUNT,
+	PROGRAM_REORDER_SCATTER,
+	PROGRAM_REORDER,
+	PROGRAM_NEIGHBOURS,
 	PROGRAM_FORCE,
+	PROGRAM_PBF_PREDICT,
+	PROGRAM_PBF_LAMBDA,
+	PROGRAM_PBF_DISPLACEMENT,
+	PROGRAM_PBF_UPDATE,
 	PROGRAM_FLUID_RENDER,
 	PROGRAM_CUBE_RENDER,
 	PROGRAM_BUCKET_RENDER,
 	PROGRAM_COUNT
 };
 
+// passes of the position based fluids step (see sph_pbf.glsl)
+const GLuint PBF_PROGRAMS[] = { PROGRAM_PBF_PREDICT,
+                                PROGRAM_PBF_LAMBDA,
+                                PROGRAM_PBF_DISPLACEMENT,
+                                PROGRAM_PBF_UPDATE };
+const GLuint PBF_PROGRAM_COUNT = sizeof(PBF_PROGRAMS)/sizeof(GLuint);
+
+// timed tasks of a frame, in issue order (a frame runs the first three once
+// per step, then the last two)
+enum FrameTask
+{
+	TASK_GRID = 0, // reorder, grid (and neighbour lists), pbf prediction
+	TASK_DENSITY,
+	TASK_FORCE,    // force pass, or pbf iterations
+	TASK_STATS,    // readback of the dt maxima
+	TASK_RENDER,   // particles (and upload of the solver thread state)
+	TASK_COUNT
+};
+const char *FRAME_TASK_NAMES[TASK_COUNT] = { "grid",
+                                             "density",
+                                             "force",
+                                             "stats",
+                                             "render" };
+// tasks whose results a task reads (bit masks), for the dependency bound of
+// the task log only: the tasks are still issued in order
+const GLuint FRAME_TASK_INPUTS[TASK_COUNT] = { 0,
+                                               1u << TASK_GRID,
+                                               1u << TASK_DENSITY,
+                                               1u << TASK_FORCE,
+                                               1u << TASK_FORCE };
+
 // OpenGL objects
 GLuint *buffers      = NULL;
 GLuint *vertexArrays = NULL;
 GLuint *textures     = NULL;
 GLuint *programs     = NULL;
 GLuint *transformFeedbacks = NULL;
+GLuint *taskQueries = NULL; // timestamps: slot x run x (begin, end)
 
 // SPH variables
 GLfloat smoothingLength = MIN_SMOOTHING_LENGTH*3.0f;  // centimeters
@@ -109,12 +192,75 @@ GLfloat particleMass    = 1.0f;                       // grams
 GLuint particleCount    = MAX_PARTICLE_COUNT / 32;     // number of particles
 GLuint cellCount        = 0;    // number of cells
 Vector3 gravityVector   = Vector3(0,-1,0); // gravity direction
+sph::GridMode gridMode  = sph::GRID_MODE_SORTED; // grid construction
+GLfloat maxMovedFraction = 0.0f;  // incremental sorted grid (cpu, 0: off)
+sph::CellIndexMode cellIndexMode = sph::CELL_INDEX_DENSE; // cell indexing
+sph::SearchMode searchMode = sph::SEARCH_MODE_27; // cells of h or 2h
+bool occupancy          = false;  // skip empty cells (a bit per cell)
+sph::SimdIsa simdIsa    = sph::SIMD_ISA_AVX512;  // cpu kernels (clamped)
+sph::PairMode pairMode  = sph::PAIR_MODE_FULL;   // cpu pair evaluation
+sph::ScheduleMode scheduleMode = sph::SCHEDULE_MODE_STATIC; // cpu passes
 GLfloat deltaT          = 0.08f;
+bool adaptiveDeltaT     = false;  // pick dt each step (deltaT is the max)
+GLfloat stepDeltaT      = deltaT; // dt of the current step
+GLfloat stepMaxima[2]   = {0.0f, 0.0f}; // max speed and |acceleration|
+GLfloat stepDeltaTRange[2] = {0.0f, 0.0f}; // dt picked since the last log
+GLsync stepMaximaFences[STEP_MAXIMA_SLOTS]; // pending readbacks
+GLuint stepMaximaSlot   = 0;      // next readback slot
+GLuint timeLevels       = 1;      // dt levels of block time stepping (cpu)
+GLuint densityFrequency = 0;      // steps between density passes (fused)
+GLfloat timeScale       = 0.0f;   // simulated s per second (0: step per frame)
+GLuint maxFrameSteps    = 4;      // steps per frame at most (time scale)
+double simulationLag    = 0.0;    // simulated time behind the wall clock
+double droppedSimulationTime = 0.0; // lag dropped by slow frames
+sph::SolverMode solverMode = sph::SOLVER_MODE_WCSPH; // gpu: wcsph or pbf
+GLfloat pressureTolerance  = 0.01f; // density error of incompressible solvers
+GLuint pbfIterations    = 4;      // constraint iterations of pbf steps
 GLint sphPingPong       = 0;
+GLuint sphStepCount     = 0;    // number of simulation steps
+GLuint reorderFrequency = 64;   // steps between two Z-order reorders (0: never)
+bool neighbourLists     = false; // use Verlet neighbour lists
+GLfloat neighbourSkin   = 0.3f;  // centimeters
+GLfloat listSkin        = 0.3f;  // skin of the lists (clamped on hashed grids)
+bool compressedLists    = false; // 16 bit deltas in the lists (cpu)
+bool neighbourListsValid       = false;
+GLuint neighbourListBuildCount = 0;
+GLuint neighbourCapacity       = NEIGHBOUR_CAPACITY; // doubled on overflows
+GLuint listOverflowCount       = 0; // truncated lists (latest readback)
+GLuint neighbourListSteps      = 0; // force passes since the last build
+GLfloat listDisplacement2      = 0.0f; // latest max squared displacement
+GLuint listDisplacementSteps   = 0; // its force passes (0: none read yet)
+GLsync displacementFences[DISPLACEMENT_SLOTS]; // pending readbacks
+GLuint displacementBuilds[DISPLACEMENT_SLOTS]; // lists of each readback
+GLuint displacementSteps[DISPLACEMENT_SLOTS];  // force passes of each one
+GLuint displacementSlot        = 0; // next readback slot
+GLuint pairCapacity     = 0;     // pairs replayed per particle (0: off)
 GLfloat restDensity     = 0.05f;
 GLfloat k               = 25.01f;
 GLfloat mu              = 10000.015f;
+GLfloat boundaryStiffness = 1000.0f;
+GLfloat boundaryDampening = 25.60f;
+sph::Constants sphConstants;      // of the parameters above (set on change)
 bool renderBucket       = false;
+bool solverThread       = false;  // cpu solver on its own thread, gpu renders
+GLuint solverThreadCount = 0;     // its OpenMP threads (0: all cores but one)
+sph::StateExchange solverStates;  // completed states of the solver thread
+
+// Frame task instrumentation
+GLuint taskLogFrequency = 0;      // frames between two task logs (0: off)
+GLuint taskLogSlot      = 0;      // slot of the current frame
+GLuint taskRuns[TASK_LOG_SLOTS][TASK_LOG_CAPACITY]; // task of each timed run
+GLuint taskRunCounts[TASK_LOG_SLOTS];  // timed runs (0: slot is free)
+GLint64 taskIssueTimes[TASK_LOG_SLOTS]; // gl time when the frame was issued
+fw::Timer taskTimer;              // cpu time of the current task
+double taskCpuTimes[TASK_COUNT];  // sums since the last log, in seconds
+double taskGpuTimes[TASK_COUNT];
+double taskLatency      = 0.0;    // from issue to the first task on the gpu
+double taskSpan         = 0.0;    // from the first task to the last one
+double taskCriticalPath = 0.0;    // longest chain of task inputs
+GLuint taskCriticalTasks = 0;     // tasks on the chain (bit mask, last frame)
+GLuint taskFrameCount   = 0;      // frames collected since the last log
+std::string taskTimelines[TASK_COUNT]; // last frame collected
 
 
 // Tools
@@ -137,11 +283,20 @@ double secondsPerFrame = 0.0; // spf
 ////////////////////////////////////////////////////////////////////////////////
 
 
+// get the size of a cell (h, or 2h for the 8 cell search)
+GLfloat get_bucket_cell_size()
+{
+	return sph::get_search_cell_size(searchMode, smoothingLength);
+}
+
+
 // get the size of the 3d bucket
 Vector3 get_bucket_3d_size()
 {
-	return (SIMULATION_DOMAIN/smoothingLength).Ceil() + Vector3(2.0f,2.0f,2.0f);
-//	return (SIMULATION_DOMAIN/(smoothingLength*2.0f)).Ceil() + Vector3(2.0f,2.0f,2.0f);
+	if(sph::CELL_INDEX_HASHED == cellIndexMode)
+		return sph::get_hashed_grid_size(particleCount);
+	return (SIMULATION_DOMAIN/get_bucket_cell_size()).Ceil()
+	       + Vector3(2.0f,2.0f,2.0f);
 }
 
 
@@ -153,6 +308,14 @@ GLuint get_bucket_1d_size()
 }
 
 
+// get the size of the cell bits: the number of non-empty cells, then a bit
+// per cell
+GLuint get_cell_bit_words()
+{
+	return 1 + (cellCount + 31) / 32;
+}
+
+
 // compute grid params and send to programs
 void set_grid_params()
 {
@@ -165,11 +328,63 @@ void set_grid_params()
 	// set global variables
 	cellCount = get_bucket_1d_size();
 
+	// resize cell buffers
+	const GLuint CELL_BUFFERS[] = { BUFFER_HEAD,
+	                                BUFFER_CELL_SCAN_PING,
+	                                BUFFER_CELL_SCAN_PONG,
+	                                BUFFER_ACTIVE_CELLS };
+	for(GLuint i=0; i<sizeof(CELL_BUFFERS)/sizeof(GLuint); ++i)
+	{
+		glBindBuffer(GL_TEXTURE_BUFFER, buffers[CELL_BUFFERS[i]]);
+			glBufferData(GL_TEXTURE_BUFFER,
+			             sizeof(GLint)*cellCount,
+			             NULL,
+			             GL_STATIC_DRAW);
+	}
+	glBindBuffer(GL_TEXTURE_BUFFER, buffers[BUFFER_CELL_BITS]);
+		glBufferData(GL_TEXTURE_BUFFER,
+		             sizeof(GLint)*get_cell_bit_words(),
+		             NULL,
+		             GL_STATIC_DRAW);
+
+	// set Z-order ranks of the cells
+	std::vector<GLint> cellMortonRanks;
+	sph::get_cell_morton_ranks(bucket3d, cellMortonRanks);
+	glBindBuffer(GL_TEXTURE_BUFFER, buffers[BUFFER_CELL_MORTON]);
+		glBufferData(GL_TEXTURE_BUFFER,
+		             sizeof(GLint)*cellMortonRanks.size(),
+		             &cellMortonRanks[0],
+		             GL_STATIC_DRAW);
+	glBindBuffer(GL_TEXTURE_BUFFER, 0);
+
 	// set 3d
 	glProgramUniform2i(programs[PROGRAM_BUCKET_RENDER],
 	                   glGetUniformLocation(programs[PROGRAM_BUCKET_RENDER],
 	                                        "uBucket3dSize"),
 	                   bucket3d[0], bucket3d[1]);
+	glProgramUniform3i(programs[PROGRAM_NEIGHBOURS],
+	                   glGetUniformLocation(programs[PROGRAM_NEIGHBOURS],
+	                                        "uBucket3dSize"),
+	                   bucket3d[0], bucket3d[1], bucket3d[2]);
+
+	// set hashed grid masks
+	if(sph::CELL_INDEX_HASHED == cellIndexMode)
+	{
+		const GLuint HASHED_PROGRAMS[] = { PROGRAM_DENSITY,
+		                                   PROGRAM_GRID,
+		                                   PROGRAM_GRID_SCATTER,
+		                                   PROGRAM_FORCE,
+		                                   PROGRAM_REORDER_COUNT,
+		                                   PROGRAM_REORDER_SCATTER,
+		                                   PROGRAM_NEIGHBOURS,
+		                                   PROGRAM_PBF_LAMBDA,
+		                                   PROGRAM_PBF_DISPLACEMENT };
+		for(GLuint i=0; i<sizeof(HASHED_PROGRAMS)/sizeof(GLuint); ++i)
+			glProgramUniform3i(programs[HASHED_PROGRAMS[i]],
+			                   glGetUniformLocation(programs[HASHED_PROGRAMS[i]],
+			                                        "uBucketMask"),
+			                   bucket3d[0]-1, bucket3d[1]-1, bucket3d[2]-1);
+	}
 
 	// set 1d
 	glProgramUniform3fv(programs[PROGRAM_DENSITY],
@@ -182,35 +397,133 @@ void set_grid_params()
 	                                         "uBucket1dCoeffs"),
 	                    1,
 	                    reinterpret_cast<GLfloat*>(&bucket1dCoeffs));
+	glProgramUniform3fv(programs[PROGRAM_GRID_SCATTER],
+	                    glGetUniformLocation(programs[PROGRAM_GRID_SCATTER],
+	                                         "uBucket1dCoeffs"),
+	                    1,
+	                    reinterpret_cast<GLfloat*>(&bucket1dCoeffs));
 	glProgramUniform3fv(programs[PROGRAM_FORCE],
 	                    glGetUniformLocation(programs[PROGRAM_FORCE],
 	                                         "uBucket1dCoeffs"),
 	                    1,
 	                    reinterpret_cast<GLfloat*>(&bucket1dCoeffs));
+	glProgramUniform3fv(programs[PROGRAM_REORDER_COUNT],
+	                    glGetUniformLocation(programs[PROGRAM_REORDER_COUNT],
+	                                         "uBucket1dCoeffs"),
+	                    1,
+	                    reinterpret_cast<GLfloat*>(&bucket1dCoeffs));
+	glProgramUniform3fv(programs[PROGRAM_REORDER_SCATTER],
+	                    glGetUniformLocation(programs[PROGRAM_REORDER_SCATTER],
+	                                         "uBucket1dCoeffs"),
+	                    1,
+	                    reinterpret_cast<GLfloat*>(&bucket1dCoeffs));
+	glProgramUniform3fv(programs[PROGRAM_NEIGHBOURS],
+	                    glGetUniformLocation(programs[PROGRAM_NEIGHBOURS],
+	                                         "uBucket1dCoeffs"),
+	                    1,
+	                    reinterpret_cast<GLfloat*>(&bucket1dCoeffs));
+
+	// set offsets of the searched cells (dense grid)
+	std::vector<GLint> cellStencil;
+	sph::get_cell_stencil(searchMode, bucket3d, cellStencil);
+	const GLuint STENCIL_PROGRAMS[] = { PROGRAM_DENSITY,
+	                                    PROGRAM_FORCE,
+	                                    PROGRAM_PBF_LAMBDA,
+	                                    PROGRAM_PBF_DISPLACEMENT };
+	for(GLuint i=0; i<sizeof(STENCIL_PROGRAMS)/sizeof(GLuint); ++i)
+		glProgramUniform1iv(programs[STENCIL_PROGRAMS[i]],
+		                    glGetUniformLocation(programs[STENCIL_PROGRAMS[i]],
+		                                         "uCellStencil"),
+		                    cellStencil.size(),
+		                    &cellStencil[0]);
 
 	// set cell size
+	const GLfloat CELL_SIZE = get_bucket_cell_size();
 	glProgramUniform1f(programs[PROGRAM_DENSITY],
 	                   glGetUniformLocation(programs[PROGRAM_DENSITY],
 	                                        "uBucketCellSize"),
-	                   smoothingLength);
+	                   CELL_SIZE);
 	glProgramUniform1f(programs[PROGRAM_GRID],
 	                   glGetUniformLocation(programs[PROGRAM_GRID],
 	                                        "uBucketCellSize"),
-	                   smoothingLength);
+	                   CELL_SIZE);
+	glProgramUniform1f(programs[PROGRAM_GRID_SCATTER],
+	                   glGetUniformLocation(programs[PROGRAM_GRID_SCATTER],
+	                                        "uBucketCellSize"),
+	                   CELL_SIZE);
 	glProgramUniform1f(programs[PROGRAM_BUCKET_RENDER],
 	                   glGetUniformLocation(programs[PROGRAM_BUCKET_RENDER],
 	                                        "uBucketCellSize"),
-	                    smoothingLength);
+	                    CELL_SIZE);
+	glProgramUniform1i(programs[PROGRAM_BUCKET_RENDER],
+	                   glGetUniformLocation(programs[PROGRAM_BUCKET_RENDER],
+	                                        "uActiveCells"),
+	                   occupancy);
 	glProgramUniform1f(programs[PROGRAM_FORCE],
 	                   glGetUniformLocation(programs[PROGRAM_FORCE],
 	                                        "uBucketCellSize"),
-	                    smoothingLength);
+	                    CELL_SIZE);
+	glProgramUniform1f(programs[PROGRAM_REORDER_COUNT],
+	                   glGetUniformLocation(programs[PROGRAM_REORDER_COUNT],
+	                                        "uBucketCellSize"),
+	                   CELL_SIZE);
+	glProgramUniform1f(programs[PROGRAM_REORDER_SCATTER],
+	                   glGetUniformLocation(programs[PROGRAM_REORDER_SCATTER],
+	                                        "uBucketCellSize"),
+	                   CELL_SIZE);
+	glProgramUniform1f(programs[PROGRAM_NEIGHBOURS],
+	                   glGetUniformLocation(programs[PROGRAM_NEIGHBOURS],
+	                                        "uBucketCellSize"),
+	                   CELL_SIZE);
+
+	// set the grid of the pbf passes (unused uniforms are ignored)
+	for(GLuint i=0; i<PBF_PROGRAM_COUNT; ++i)
+	{
+		glProgramUniform3fv(programs[PBF_PROGRAMS[i]],
+		                    glGetUniformLocation(programs[PBF_PROGRAMS[i]],
+		                                         "uBucket1dCoeffs"),
+		                    1,
+		                    reinterpret_cast<GLfloat*>(&bucket1dCoeffs));
+		glProgramUniform1f(programs[PBF_PROGRAMS[i]],
+		                   glGetUniformLocation(programs[PBF_PROGRAMS[i]],
+		                                        "uBucketCellSize"),
+		                   CELL_SIZE);
+	}
+
+	// set neighbour search (h + skin; the layers of a hashed grid must not
+	// wrap around the table, or cells would be visited twice, so the skin
+	// shrinks on small tables)
+	GLfloat searchRadius = smoothingLength + neighbourSkin;
+	GLint cellRange      = GLint(ceil(searchRadius / CELL_SIZE));
+	if(sph::CELL_INDEX_HASHED == cellIndexMode)
+	{
+		const GLint MAX_RANGE = (GLint(std::min(std::min(bucket3d[0],
+		                                                 bucket3d[1]),
+		                                        bucket3d[2])) - 1) / 2;
+		if(cellRange > MAX_RANGE)
+		{
+			cellRange    = MAX_RANGE;
+			searchRadius = MAX_RANGE * CELL_SIZE;
+		}
+	}
+	listSkin = searchRadius - smoothingLength;
+	glProgramUniform1i(programs[PROGRAM_NEIGHBOURS],
+	                   glGetUniformLocation(programs[PROGRAM_NEIGHBOURS],
+	                                        "uCellRange"),
+	                   cellRange);
+	glProgramUniform1f(programs[PROGRAM_NEIGHBOURS],
+	                   glGetUniformLocation(programs[PROGRAM_NEIGHBOURS],
+	                                        "uSearchRadiusSquared"),
+	                   searchRadius * searchRadius);
+
+	// cells have changed
+	neighbourListsValid = false;
 
 }
 
 
-// precompute sph force constant components and send to programs
-void set_sph_constants()
+// precompute sph force constant components
+sph::Constants get_sph_constants()
 {
 	GLfloat h2        = smoothingLength*smoothingLength;
 	GLfloat h6        = pow(smoothingLength,6.0f); // mind precision !!
@@ -219,17 +532,42 @@ void set_sph_constants()
 	GLfloat gradPoly6 = (-945.0f/h9)/(32.0f*PI);
 	GLfloat gradSpiky = (-45.0f/h6)/PI;
 	GLfloat grad2Viscosity = -gradSpiky; /* = 45.0f/(PI*h6); */
-	const Vector3 SIM_MIN  = SIM_BOUNDS_MIN
-	                       - Vector3(smoothingLength,
-	                                 smoothingLength,
-	                                 smoothingLength);
-
-//	std::cout << "h6: " << h6 << std::endl;
-//	std::cout << "h9: " << h9 << std::endl;
-	std::cout << "poly6: " << poly6 << std::endl;
-	std::cout << "gradPoly6: " << gradPoly6 << std::endl;
-//	std::cout << "gradSpiky: " << gradSpiky << std::endl;
-//	std::cout << "grad2Viscosity: " << grad2Viscosity << std::endl;
+	sph::Constants constants;
+
+	constants.smoothingLength        = smoothingLength;
+	constants.smoothingLengthSquared = h2;
+	constants.particleMass           = particleMass;
+	constants.densityConstants       = poly6 * particleMass;
+	constants.gradDensityConstants   = gradPoly6 * particleMass;
+	constants.pressureConstants      = -gradSpiky * particleMass * 0.5f;
+	constants.viscosityConstants     = grad2Viscosity * particleMass * mu;
+	constants.viscosity              = mu;
+	constants.restDensity            = restDensity;
+	constants.k                      = k;
+	constants.stiffness              = boundaryStiffness;
+	constants.dampening              = boundaryDampening;
+	constants.bucketCellSize         = get_bucket_cell_size();
+	constants.bucket3dSize           = get_bucket_3d_size();
+	constants.bucketBoundsMin        = SIM_BOUNDS_MIN
+	                                 - Vector3(smoothingLength,
+	                                           smoothingLength,
+	                                           smoothingLength);
+	constants.simBoundsMin           = SIM_BOUNDS_MIN;
+	constants.simBoundsMax           = 0.5f*SIMULATION_DOMAIN;
+
+	return constants;
+}
+
+
+// send sph constants to programs
+void set_sph_constants()
+{
+	sphConstants = get_sph_constants();
+	const sph::Constants& CONSTANTS = sphConstants;
+	const Vector3 SIM_MIN  = CONSTANTS.bucketBoundsMin;
+
+	std::cout << "density: " << CONSTANTS.densityConstants << std::endl;
+	std::cout << "gradDensity: " << CONSTANTS.gradDensityConstants << std::endl;
 
 	// set masses
 	glProgramUniform1f(programs[PROGRAM_FORCE],
@@ -247,37 +585,37 @@ void set_sph_constants()
 	glProgramUniform1f(programs[PROGRAM_DENSITY],
 	                   glGetUniformLocation(programs[PROGRAM_DENSITY],
 	                                        "uSmoothingLengthSquared"),
-	                   h2);
+	                   CONSTANTS.smoothingLengthSquared);
 	glProgramUniform1f(programs[PROGRAM_FORCE],
 	                   glGetUniformLocation(programs[PROGRAM_FORCE],
 	                                        "uSmoothingLengthSquared"),
-	                   h2);
+	                   CONSTANTS.smoothingLengthSquared);
 
 	// set uniforms: Poly6
 	glProgramUniform1f(programs[PROGRAM_DENSITY],
 	                   glGetUniformLocation(programs[PROGRAM_DENSITY],
 	                                        "uDensityConstants"),
-	                   poly6 * particleMass);
+	                   CONSTANTS.densityConstants);
 
 	// gradPoly6
 	glProgramUniform1f(programs[PROGRAM_FORCE],
 	                   glGetUniformLocation(programs[PROGRAM_FORCE],
 	                                        "uDensityConstants"),
-	                   gradPoly6 * particleMass);
+	                   CONSTANTS.gradDensityConstants);
 
 	// spiky
 	glProgramUniform1f(programs[PROGRAM_FORCE],
 	                   glGetUniformLocation(programs[PROGRAM_FORCE],
 	                                        "uPressureConstants"),
-	                   -gradSpiky  * particleMass * 0.5f);
-std::cout << "pressure: " << -gradSpiky  * particleMass * 0.5f << std::endl;
+	                   CONSTANTS.pressureConstants);
+std::cout << "pressure: " << CONSTANTS.pressureConstants << std::endl;
 
 	// viscosity
 	glProgramUniform1f(programs[PROGRAM_FORCE],
 	                   glGetUniformLocation(programs[PROGRAM_FORCE],
 	                                        "uViscosityConstants"),
-	                   grad2Viscosity * particleMass * mu);
-std::cout << "viscosity: " << grad2Viscosity * particleMass * mu << std::endl;
+	                   CONSTANTS.viscosityConstants);
+std::cout << "viscosity: " << CONSTANTS.viscosityConstants << std::endl;
 
 	// rest density
 	glProgramUniform1f(programs[PROGRAM_FORCE],
@@ -291,6 +629,16 @@ std::cout << "viscosity: " << grad2Viscosity * particleMass * mu << std::endl;
 	                                        "uK"),
 	                   k);
 
+	// boundary constants
+	glProgramUniform1f(programs[PROGRAM_FORCE],
+	                   glGetUniformLocation(programs[PROGRAM_FORCE],
+	                                        "uStiffness"),
+	                   CONSTANTS.stiffness);
+	glProgramUniform1f(programs[PROGRAM_FORCE],
+	                   glGetUniformLocation(programs[PROGRAM_FORCE],
+	                                        "uDampening"),
+	                   CONSTANTS.dampening);
+
 	// set min bounds of simulation
 	glProgramUniform3fv(programs[PROGRAM_DENSITY],
 	                    glGetUniformLocation(programs[PROGRAM_DENSITY],
@@ -316,25 +664,82 @@ std::cout << "viscosity: " << grad2Viscosity * particleMass * mu << std::endl;
 	                    1,
 	                    reinterpret_cast<GLfloat *>(
 	                    const_cast<Vector3 *>(&SIM_MIN)));
+	glProgramUniform3fv(programs[PROGRAM_GRID_SCATTER],
+	                    glGetUniformLocation(programs[PROGRAM_GRID_SCATTER],
+	                                         "uBucketBoundsMin"),
+	                    1,
+	                    reinterpret_cast<GLfloat *>(
+	                    const_cast<Vector3 *>(&SIM_MIN)));
+	glProgramUniform3fv(programs[PROGRAM_REORDER_COUNT],
+	                    glGetUniformLocation(programs[PROGRAM_REORDER_COUNT],
+	                                         "uBucketBoundsMin"),
+	                    1,
+	                    reinterpret_cast<GLfloat *>(
+	                    const_cast<Vector3 *>(&SIM_MIN)));
+	glProgramUniform3fv(programs[PROGRAM_REORDER_SCATTER],
+	                    glGetUniformLocation(programs[PROGRAM_REORDER_SCATTER],
+	                                         "uBucketBoundsMin"),
+	                    1,
+	                    reinterpret_cast<GLfloat *>(
+	                    const_cast<Vector3 *>(&SIM_MIN)));
+	glProgramUniform3fv(programs[PROGRAM_NEIGHBOURS],
+	                    glGetUniformLocation(programs[PROGRAM_NEIGHBOURS],
+	                                         "uBucketBoundsMin"),
+	                    1,
+	                    reinterpret_cast<GLfloat *>(
+	                    const_cast<Vector3 *>(&SIM_MIN)));
 	glProgramUniform3f(programs[PROGRAM_BUCKET_RENDER],
 	                   glGetUniformLocation(programs[PROGRAM_BUCKET_RENDER],
 	                                        "uBucketBoundsMin"),
-	                   SIM_MIN[0]+smoothingLength*0.5f,
-	                   SIM_MIN[1]+smoothingLength*0.5f,
-	                   SIM_MIN[2]+smoothingLength*0.5f);
+	                   SIM_MIN[0]+get_bucket_cell_size()*0.5f,
+	                   SIM_MIN[1]+get_bucket_cell_size()*0.5f,
+	                   SIM_MIN[2]+get_bucket_cell_size()*0.5f);
 
 	// min bounds of domain
 	glProgramUniform3fv(programs[PROGRAM_FORCE],
 	                    glGetUniformLocation(programs[PROGRAM_FORCE],
 	                                         "uSimBoundsMin"),
 	                    1,
-	                    &SIM_BOUNDS_MIN[0]);
-	glProgramUniform3f(programs[PROGRAM_FORCE],
-	                   glGetUniformLocation(programs[PROGRAM_FORCE],
-	                                        "uSimBoundsMax"),
-	                    0.5f*SIMULATION_DOMAIN[0],
-	                    0.5f*SIMULATION_DOMAIN[1],
-	                    0.5f*SIMULATION_DOMAIN[2] );
+	                    &CONSTANTS.simBoundsMin[0]);
+	glProgramUniform3fv(programs[PROGRAM_FORCE],
+	                    glGetUniformLocation(programs[PROGRAM_FORCE],
+	                                         "uSimBoundsMax"),
+	                    1,
+	                    &CONSTANTS.simBoundsMax[0]);
+
+	// pbf passes (unused uniforms are ignored)
+	for(GLuint i=0; i<PBF_PROGRAM_COUNT; ++i)
+	{
+		const GLuint PROGRAM = programs[PBF_PROGRAMS[i]];
+		glProgramUniform1f(PROGRAM,
+		                   glGetUniformLocation(PROGRAM, "uSmoothingLength"),
+		                   smoothingLength);
+		glProgramUniform1f(PROGRAM,
+		                   glGetUniformLocation(PROGRAM,
+		                                        "uSmoothingLengthSquared"),
+		                   CONSTANTS.smoothingLengthSquared);
+		glProgramUniform1f(PROGRAM,
+		                   glGetUniformLocation(PROGRAM, "uDensityConstants"),
+		                   CONSTANTS.densityConstants);
+		glProgramUniform1f(PROGRAM,
+		                   glGetUniformLocation(PROGRAM, "uPressureConstants"),
+		                   CONSTANTS.pressureConstants);
+		glProgramUniform1f(PROGRAM,
+		                   glGetUniformLocation(PROGRAM, "uRestDensity"),
+		                   restDensity);
+		glProgramUniform3fv(PROGRAM,
+		                    glGetUniformLocation(PROGRAM, "uBucketBoundsMin"),
+		                    1,
+		                    &SIM_MIN[0]);
+		glProgramUniform3fv(PROGRAM,
+		                    glGetUniformLocation(PROGRAM, "uSimBoundsMin"),
+		                    1,
+		                    &CONSTANTS.simBoundsMin[0]);
+		glProgramUniform3fv(PROGRAM,
+		                    glGetUniformLocation(PROGRAM, "uSimBoundsMax"),
+		                    1,
+		                    &CONSTANTS.simBoundsMax[0]);
+	}
 
 	// build grid
 	set_grid_params();
@@ -344,10 +749,260 @@ std::cout << "viscosity: " << grad2Viscosity * particleMass * mu << std::endl;
 // set delta 
 void set_delta()
 {
+	if(!adaptiveDeltaT)
+		stepDeltaT = deltaT;
 	glProgramUniform1f(programs[PROGRAM_FORCE],
 	                   glGetUniformLocation(programs[PROGRAM_FORCE],
 	                                        "uTicks"),
-	                   deltaT);
+	                   stepDeltaT);
+	for(GLuint i=0; i<PBF_PROGRAM_COUNT; ++i)
+		glProgramUniform1f(programs[PBF_PROGRAMS[i]],
+		                   glGetUniformLocation(programs[PBF_PROGRAMS[i]],
+		                                        "uTicks"),
+		                   stepDeltaT);
+}
+
+
+// pick dt from the latest maxima read back (never waits for the GPU: the
+// maxima are a few steps old at most)
+void update_sph_delta()
+{
+	for(GLuint i=0; i<STEP_MAXIMA_SLOTS; ++i)
+	{
+		// oldest readbacks first
+		GLuint slot = (stepMaximaSlot + i) % STEP_MAXIMA_SLOTS;
+		if(!stepMaximaFences[slot]
+		|| GL_TIMEOUT_EXPIRED == glClientWaitSync(stepMaximaFences[slot], 0, 0))
+			continue;
+		glDeleteSync(stepMaximaFences[slot]);
+		stepMaximaFences[slot] = 0;
+		glBindBuffer(GL_COPY_READ_BUFFER, buffers[BUFFER_STEP_MAXIMA_READ]);
+			glGetBufferSubData(GL_COPY_READ_BUFFER,
+			                   slot*sizeof(stepMaxima),
+			                   sizeof(stepMaxima),
+			                   stepMaxima);
+		glBindBuffer(GL_COPY_READ_BUFFER, 0);
+	}
+
+	stepDeltaT = sph::get_adaptive_ticks(sphConstants,
+	                                     stepMaxima[0],
+	                                     stepMaxima[1],
+	                                     deltaT);
+	set_delta();
+
+	// range for the task log
+	if(0.0f == stepDeltaTRange[1])
+		stepDeltaTRange[0] = stepDeltaTRange[1] = stepDeltaT;
+	stepDeltaTRange[0] = std::min(stepDeltaTRange[0], stepDeltaT);
+	stepDeltaTRange[1] = std::max(stepDeltaTRange[1], stepDeltaT);
+}
+
+
+// copy the maxima of the last force pass to a readback slot and reset them
+void read_sph_step_maxima()
+{
+	const GLint ZEROS[2] = {0, 0};
+
+	// drop the slot if it has not been read yet
+	if(stepMaximaFences[stepMaximaSlot])
+		glDeleteSync(stepMaximaFences[stepMaximaSlot]);
+
+	glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+	glBindBuffer(GL_COPY_READ_BUFFER, buffers[BUFFER_STEP_MAXIMA]);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, buffers[BUFFER_STEP_MAXIMA_READ]);
+		glCopyBufferSubData(GL_COPY_READ_BUFFER,
+		                    GL_COPY_WRITE_BUFFER,
+		                    0,
+		                    stepMaximaSlot*sizeof(stepMaxima),
+		                    sizeof(stepMaxima));
+		glBufferSubData(GL_COPY_READ_BUFFER, 0, sizeof(ZEROS), ZEROS);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+	glBindBuffer(GL_COPY_READ_BUFFER, 0);
+
+	stepMaximaFences[stepMaximaSlot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE,
+	                                               0);
+	stepMaximaSlot = (stepMaximaSlot + 1) % STEP_MAXIMA_SLOTS;
+}
+
+
+// print the task times collected since the last log, and the timelines of
+// the last frame
+void log_frame_tasks()
+{
+	const double FRAMES = taskFrameCount;
+	double busy = 0.0;
+	const char *separator = "";
+
+	for(GLuint t=0; t<TASK_COUNT; ++t)
+		busy+= taskGpuTimes[t];
+	std::cout << "tasks (" << taskFrameCount << " frames): the gpu starts "
+	          << taskLatency*1e3/FRAMES << " ms after the frame is issued,"
+	          << " busy " << busy*1e3/FRAMES << " ms of a "
+	          << taskSpan*1e3/FRAMES << " ms span, dependency bound ";
+	for(GLuint t=0; t<TASK_COUNT; ++t)
+		if(taskCriticalTasks & (1u << t))
+		{
+			std::cout << separator << FRAME_TASK_NAMES[t];
+			separator = " > ";
+		}
+	std::cout << ' ' << taskCriticalPath*1e3/FRAMES << " ms" << std::endl;
+	if(adaptiveDeltaT)
+		std::cout << "  dt " << stepDeltaTRange[0] << " to "
+		          << stepDeltaTRange[1] << " (max speed " << stepMaxima[0]
+		          << ", max acceleration " << stepMaxima[1] << ")"
+		          << std::endl;
+	for(GLuint t=0; t<TASK_COUNT; ++t)
+	{
+		std::string name(FRAME_TASK_NAMES[t]);
+		name.resize(8, ' ');
+		std::cout << "  " << name << '|' << taskTimelines[t] << "| "
+		          << taskGpuTimes[t]*1e3/FRAMES << " ms gpu, "
+		          << taskCpuTimes[t]*1e3/FRAMES << " ms cpu" << std::endl;
+		taskGpuTimes[t] = 0.0;
+		taskCpuTimes[t] = 0.0;
+	}
+
+	taskLatency      = 0.0;
+	taskSpan         = 0.0;
+	taskCriticalPath = 0.0;
+	taskFrameCount   = 0;
+	stepDeltaTRange[0] = stepDeltaTRange[1] = 0.0f;
+}
+
+
+// read the timestamps of a frame if the gpu is done with it (never waits)
+void collect_frame_tasks(GLuint slot)
+{
+	const GLuint COUNT  = taskRunCounts[slot];
+	const GLuint *QUERIES = taskQueries + 2*slot*TASK_LOG_CAPACITY;
+	GLint available = 0;
+
+	if(0 == COUNT)
+		return;
+	glGetQueryObjectiv(QUERIES[2*COUNT-1],
+	                   GL_QUERY_RESULT_AVAILABLE,
+	                   &available);
+	if(!available)
+		return;
+	taskRunCounts[slot] = 0;
+
+	// run times
+	std::vector<GLuint64> begins(COUNT), ends(COUNT);
+	double durations[TASK_COUNT] = {0.0};
+	GLuint64 first = ~GLuint64(0), last = 0;
+	for(GLuint r=0; r<COUNT; ++r)
+	{
+		glGetQueryObjectui64v(QUERIES[2*r], GL_QUERY_RESULT, &begins[r]);
+		glGetQueryObjectui64v(QUERIES[2*r+1], GL_QUERY_RESULT, &ends[r]);
+		durations[taskRuns[slot][r]]+= (ends[r] - begins[r]) * 1e-9;
+		first = std::min(first, begins[r]);
+		last  = std::max(last, ends[r]);
+	}
+
+	// longest chain of task inputs (of the task times summed over the steps)
+	double finishes[TASK_COUNT];
+	GLuint previous[TASK_COUNT];
+	GLuint lastTask = 0;
+	for(GLuint t=0; t<TASK_COUNT; ++t)
+	{
+		double start = 0.0;
+		previous[t] = TASK_COUNT;
+		for(GLuint d=0; d<t; ++d)
+			if((FRAME_TASK_INPUTS[t] & (1u << d)) && finishes[d] > start)
+			{
+				start       = finishes[d];
+				previous[t] = d;
+			}
+		finishes[t] = start + durations[t];
+		if(finishes[t] > finishes[lastTask])
+			lastTask = t;
+	}
+	taskCriticalTasks = 0;
+	for(GLuint t=lastTask; t<TASK_COUNT; t=previous[t])
+		if(durations[t] > 0.0)
+			taskCriticalTasks|= 1u << t;
+
+	// timelines over the span of the frame
+	const double SPAN = std::max(double(last - first), 1.0);
+	for(GLuint t=0; t<TASK_COUNT; ++t)
+		taskTimelines[t].assign(TASK_LOG_WIDTH, ' ');
+	for(GLuint r=0; r<COUNT; ++r)
+	{
+		GLuint begin = GLuint((begins[r] - first) / SPAN * TASK_LOG_WIDTH);
+		GLuint end   = GLuint((ends[r] - first) / SPAN * TASK_LOG_WIDTH);
+		end = std::min(std::max(end, begin+1), TASK_LOG_WIDTH);
+		for(GLuint c=std::min(begin, TASK_LOG_WIDTH-1); c<end; ++c)
+			taskTimelines[taskRuns[slot][r]][c] = '#';
+	}
+
+	// sums
+	for(GLuint t=0; t<TASK_COUNT; ++t)
+		taskGpuTimes[t]+= durations[t];
+	taskLatency+= (GLint64(first) - taskIssueTimes[slot]) * 1e-9;
+	taskSpan+= (last - first) * 1e-9;
+	taskCriticalPath+= finishes[lastTask];
+	if(++taskFrameCount == taskLogFrequency)
+		log_frame_tasks();
+}
+
+
+// start timing the tasks of a frame (the slot of the oldest frame is reused,
+// dropped if the gpu is not done with it yet)
+void begin_frame_tasks()
+{
+	if(0 == taskLogFrequency)
+		return;
+
+	for(GLuint i=0; i<TASK_LOG_SLOTS; ++i)
+		collect_frame_tasks((taskLogSlot + i) % TASK_LOG_SLOTS);
+	taskRunCounts[taskLogSlot] = 0;
+	glGetInteger64v(GL_TIMESTAMP, &taskIssueTimes[taskLogSlot]);
+}
+
+
+// stop timing the tasks of a frame
+void end_frame_tasks()
+{
+	if(0 == taskLogFrequency)
+		return;
+
+	taskLogSlot = (taskLogSlot + 1) % TASK_LOG_SLOTS;
+}
+
+
+// time a run of a task, on the gpu (timestamps) and on the cpu (issue time)
+void begin_frame_task(GLuint task)
+{
+	GLuint& count = taskRunCounts[taskLogSlot];
+
+	if(0 == taskLogFrequency)
+		return;
+
+	if(count < TASK_LOG_CAPACITY)
+	{
+		taskRuns[taskLogSlot][count] = task;
+		glQueryCounter(taskQueries[2*(taskLogSlot*TASK_LOG_CAPACITY + count)],
+		               GL_TIMESTAMP);
+	}
+	taskTimer.Start();
+}
+
+void end_frame_task(GLuint task)
+{
+	GLuint& count = taskRunCounts[taskLogSlot];
+
+	if(0 == taskLogFrequency)
+		return;
+
+	taskTimer.Stop();
+	taskCpuTimes[task]+= taskTimer.Ticks();
+	if(count < TASK_LOG_CAPACITY)
+	{
+		glQueryCounter(taskQueries[2*(taskLogSlot*TASK_LOG_CAPACITY + count)
+		                           + 1],
+		               GL_TIMESTAMP);
+		++count;
+	}
 }
 
 
@@ -359,33 +1014,91 @@ void set_gravity_vector()
 	                                         "uGravityDir"),
 	                    1,
 	                    &gravityVector[0]);
+	glProgramUniform3fv(programs[PROGRAM_PBF_PREDICT],
+	                    glGetUniformLocation(programs[PROGRAM_PBF_PREDICT],
+	                                         "uGravityDir"),
+	                    1,
+	                    &gravityVector[0]);
 }
 
 
 // initialize cells (rasterizer must be disabled)
 void init_sph_cells()
 {
-	glUseProgram(programs[PROGRAM_BUCKET]);
 	glBindVertexArray(vertexArrays[VERTEX_ARRAY_BUCKET]);
 
+	// no cell is occupied yet
+	if(occupancy)
+	{
+		const GLuint WORDS = get_cell_bit_words();
+		glUseProgram(programs[PROGRAM_CELL_CLEAR]);
+		glBindTransformFeedback(GL_TRANSFORM_FEEDBACK,
+		                        transformFeedbacks[TRANSFORM_FEEDBACK_CELL_BITS]);
+		glBeginTransformFeedback(GL_POINTS);
+			glDrawArrays(GL_POINTS, 0, WORDS/4 + WORDS%4);
+		glEndTransformFeedback();
+	}
+
+	glUseProgram(programs[PROGRAM_BUCKET]);
+
 	glBindTransformFeedback(GL_TRANSFORM_FEEDBACK,
 	                        transformFeedbacks[TRANSFORM_FEEDBACK_HEAD]);
 	glBeginTransformFeedback(GL_POINTS);
 		glDrawArrays(GL_POINTS, 0, cellCount/4 + cellCount%4);
 	glEndTransformFeedback();
 
-	glFinish(); // apparently, this is mandatory on AMD11.12
+	// the grid pass reads the heads as images (this used to be a glFinish,
+	// mandatory on AMD11.12, which kept the cpu from running ahead)
+	glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
 
-	glBindTransformFeedback(GL_TRANSFORM_FEEDBACK,
-	                        transformFeedbacks[TRANSFORM_FEEDBACK_LIST]);
-	glBeginTransformFeedback(GL_POINTS);
-		glDrawArrays(GL_POINTS, 0, particleCount/4);
-	glEndTransformFeedback();
+	// ranks of the sorted grid need no initialization
+	if(sph::GRID_MODE_LINKED_LIST == gridMode)
+	{
+		glBindTransformFeedback(GL_TRANSFORM_FEEDBACK,
+		                        transformFeedbacks[TRANSFORM_FEEDBACK_LIST]);
+		glBeginTransformFeedback(GL_POINTS);
+			glDrawArrays(GL_POINTS, 0, particleCount/4);
+		glEndTransformFeedback();
+	}
 
 	glBindTransformFeedback(GL_TRANSFORM_FEEDBACK, 0);
 }
 
 
+// compute the inclusive prefix sum of the cell counts (rasterizer must be
+// disabled). Returns the texture unit holding the result
+GLint scan_sph_cells()
+{
+	GLint source   = TEXTURE_HEAD;
+	GLint pingPong = 0;
+
+	glUseProgram(programs[PROGRAM_CELL_SCAN]);
+	glBindVertexArray(vertexArrays[VERTEX_ARRAY_BUCKET]);
+	for(GLuint offset=1; offset<cellCount; offset<<=1)
+	{
+		glUniform1i(glGetUniformLocation(programs[PROGRAM_CELL_SCAN],
+		                                 "sCellData"),
+		            source);
+		glUniform1i(glGetUniformLocation(programs[PROGRAM_CELL_SCAN],
+		                                 "uOffset"),
+		            offset);
+		glBindTransformFeedback(GL_TRANSFORM_FEEDBACK,
+		                        transformFeedbacks[TRANSFORM_FEEDBACK_CELL_SCAN_PING
+		                                           + pingPong]);
+		glBeginTransformFeedback(GL_POINTS);
+			glDrawArrays(GL_POINTS, 0, cellCount);
+		glEndTransformFeedback();
+
+		// ping pong
+		source   = TEXTURE_CELL_SCAN_PING + pingPong;
+		pingPong = 1 - pingPong;
+	}
+
+	glBindTransformFeedback(GL_TRANSFORM_FEEDBACK, 0);
+	return source;
+}
+
+
 // set runtime constants (called only once)
 void set_runtime_constant_uniforms()
 {
@@ -424,6 +1137,147 @@ void set_runtime_constant_uniforms()
 	                   glGetUniformLocation(programs[PROGRAM_FORCE],
 	                                        "imgList"),
 	                   TEXTURE_LIST);
+	glProgramUniform1i(programs[PROGRAM_GRID_SCATTER],
+	                   glGetUniformLocation(programs[PROGRAM_GRID_SCATTER],
+	                                        "imgHead"),
+	                   TEXTURE_HEAD);
+	glProgramUniform1i(programs[PROGRAM_GRID_SCATTER],
+	                   glGetUniformLocation(programs[PROGRAM_GRID_SCATTER],
+	                                        "imgList"),
+	                   TEXTURE_LIST);
+	glProgramUniform1i(programs[PROGRAM_GRID_SCATTER],
+	                   glGetUniformLocation(programs[PROGRAM_GRID_SCATTER],
+	                                        "imgSorted"),
+	                   TEXTURE_SORTED);
+	glProgramUniform1i(programs[PROGRAM_DENSITY],
+	                   glGetUniformLocation(programs[PROGRAM_DENSITY],
+	                                        "imgSorted"),
+	                   TEXTURE_SORTED);
+	glProgramUniform1i(programs[PROGRAM_FORCE],
+	                   glGetUniformLocation(programs[PROGRAM_FORCE],
+	                                        "imgSorted"),
+	                   TEXTURE_SORTED);
+	glProgramUniform1i(programs[PROGRAM_REORDER_COUNT],
+	                   glGetUniformLocation(programs[PROGRAM_REORDER_COUNT],
+	                                        "imgHead"),
+	                   TEXTURE_HEAD);
+	glProgramUniform1i(programs[PROGRAM_REORDER_COUNT],
+	                   glGetUniformLocation(programs[PROGRAM_REORDER_COUNT],
+	                                        "imgList"),
+	                   TEXTURE_LIST);
+	glProgramUniform1i(programs[PROGRAM_REORDER_SCATTER],
+	                   glGetUniformLocation(programs[PROGRAM_REORDER_SCATTER],
+	                                        "imgHead"),
+	                   TEXTURE_HEAD);
+	glProgramUniform1i(programs[PROGRAM_REORDER_SCATTER],
+	                   glGetUniformLocation(programs[PROGRAM_REORDER_SCATTER],
+	                                        "imgList"),
+	                   TEXTURE_LIST);
+	glProgramUniform1i(programs[PROGRAM_REORDER_SCATTER],
+	                   glGetUniformLocation(programs[PROGRAM_REORDER_SCATTER],
+	                                        "imgSorted"),
+	                   TEXTURE_SORTED);
+	glProgramUniform1i(programs[PROGRAM_REORDER],
+	                   glGetUniformLocation(programs[PROGRAM_REORDER],
+	                                        "imgSorted"),
+	                   TEXTURE_SORTED);
+	glProgramUniform1i(programs[PROGRAM_NEIGHBOURS],
+	                   glGetUniformLocation(programs[PROGRAM_NEIGHBOURS],
+	                                        "imgHead"),
+	                   TEXTURE_HEAD);
+	glProgramUniform1i(programs[PROGRAM_NEIGHBOURS],
+	                   glGetUniformLocation(programs[PROGRAM_NEIGHBOURS],
+	                                        "imgList"),
+	                   TEXTURE_LIST);
+	glProgramUniform1i(programs[PROGRAM_NEIGHBOURS],
+	                   glGetUniformLocation(programs[PROGRAM_NEIGHBOURS],
+	                                        "imgSorted"),
+	                   TEXTURE_SORTED);
+	glProgramUniform1i(programs[PROGRAM_NEIGHBOURS],
+	                   glGetUniformLocation(programs[PROGRAM_NEIGHBOURS],
+	                                        "imgNeighbours"),
+	                   TEXTURE_NEIGHBOURS);
+	glProgramUniform1i(programs[PROGRAM_NEIGHBOURS],
+	                   glGetUniformLocation(programs[PROGRAM_NEIGHBOURS],
+	                                        "imgDisplacement"),
+	                   TEXTURE_DISPLACEMENT);
+	glProgramUniform1i(programs[PROGRAM_DENSITY],
+	                   glGetUniformLocation(programs[PROGRAM_DENSITY],
+	                                        "imgNeighbours"),
+	                   TEXTURE_NEIGHBOURS);
+	glProgramUniform1i(programs[PROGRAM_FORCE],
+	                   glGetUniformLocation(programs[PROGRAM_FORCE],
+	                                        "imgNeighbours"),
+	                   TEXTURE_NEIGHBOURS);
+	glProgramUniform1i(programs[PROGRAM_FORCE],
+	                   glGetUniformLocation(programs[PROGRAM_FORCE],
+	                                        "imgDisplacement"),
+	                   TEXTURE_DISPLACEMENT);
+	glProgramUniform1i(programs[PROGRAM_FORCE],
+	                   glGetUniformLocation(programs[PROGRAM_FORCE],
+	                                        "imgStepMaxima"),
+	                   TEXTURE_STEP_MAXIMA);
+
+	// set samplers
+	glProgramUniform1i(programs[PROGRAM_REORDER_COUNT],
+	                   glGetUniformLocation(programs[PROGRAM_REORDER_COUNT],
+	                                        "sCellMortonRanks"),
+	                   TEXTURE_CELL_MORTON);
+	glProgramUniform1i(programs[PROGRAM_REORDER_SCATTER],
+	                   glGetUniformLocation(programs[PROGRAM_REORDER_SCATTER],
+	                                        "sCellMortonRanks"),
+	                   TEXTURE_CELL_MORTON);
+	glProgramUniform1i(programs[PROGRAM_DENSITY],
+	                   glGetUniformLocation(programs[PROGRAM_DENSITY],
+	                                        "sNeighbourCounts"),
+	                   TEXTURE_NEIGHBOUR_COUNTS);
+	glProgramUniform1i(programs[PROGRAM_FORCE],
+	                   glGetUniformLocation(programs[PROGRAM_FORCE],
+	                                        "sNeighbourCounts"),
+	                   TEXTURE_NEIGHBOUR_COUNTS);
+	glProgramUniform1i(programs[PROGRAM_FORCE],
+	                   glGetUniformLocation(programs[PROGRAM_FORCE],
+	                                        "sNeighbourRefs"),
+	                   TEXTURE_NEIGHBOUR_REFS);
+
+	// occupancy (unused uniforms are ignored)
+	const GLuint OCCUPANCY_PROGRAMS[] = { PROGRAM_GRID,
+	                                      PROGRAM_DENSITY,
+	                                      PROGRAM_FORCE,
+	                                      PROGRAM_PBF_LAMBDA,
+	                                      PROGRAM_PBF_DISPLACEMENT };
+	for(GLuint i=0; i<sizeof(OCCUPANCY_PROGRAMS)/sizeof(GLuint); ++i)
+		glProgramUniform1i(programs[OCCUPANCY_PROGRAMS[i]],
+		                   glGetUniformLocation(programs[OCCUPANCY_PROGRAMS[i]],
+		                                        "imgCellBits"),
+		                   TEXTURE_CELL_BITS);
+	glProgramUniform1i(programs[PROGRAM_GRID],
+	                   glGetUniformLocation(programs[PROGRAM_GRID],
+	                                        "imgActiveCells"),
+	                   TEXTURE_ACTIVE_CELLS);
+	glProgramUniform1i(programs[PROGRAM_BUCKET_RENDER],
+	                   glGetUniformLocation(programs[PROGRAM_BUCKET_RENDER],
+	                                        "sCellBits"),
+	                   TEXTURE_CELL_BITS);
+	glProgramUniform1i(programs[PROGRAM_BUCKET_RENDER],
+	                   glGetUniformLocation(programs[PROGRAM_BUCKET_RENDER],
+	                                        "sActiveCells"),
+	                   TEXTURE_ACTIVE_CELLS);
+
+	// pbf passes (unused uniforms are ignored)
+	for(GLuint i=0; i<PBF_PROGRAM_COUNT; ++i)
+	{
+		const GLuint PROGRAM = programs[PBF_PROGRAMS[i]];
+		glProgramUniform1i(PROGRAM,
+		                   glGetUniformLocation(PROGRAM, "imgHead"),
+		                   TEXTURE_HEAD);
+		glProgramUniform1i(PROGRAM,
+		                   glGetUniformLocation(PROGRAM, "imgList"),
+		                   TEXTURE_LIST);
+		glProgramUniform1i(PROGRAM,
+		                   glGetUniformLocation(PROGRAM, "imgSorted"),
+		                   TEXTURE_SORTED);
+	}
 }
 
 
@@ -435,26 +1289,252 @@ void build_grid()
 	// empty cells
 	init_sph_cells();
 
-	// compute
+	// compute (heads and lists, or counts and ranks)
 	glUseProgram(programs[PROGRAM_GRID]);
 	glBindVertexArray(vertexArrays[VERTEX_ARRAY_POS_DENSITY_PING+sphPingPong]);
 		glDrawArrays(GL_POINTS, 0, particleCount);
 
+	// sort particles by cell
+	if(sph::GRID_MODE_SORTED == gridMode)
+	{
+		glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT
+		                | GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+
+		// cell ranges
+		GLint cellEnds = scan_sph_cells();
+		glProgramUniform1i(programs[PROGRAM_GRID_SCATTER],
+		                   glGetUniformLocation(programs[PROGRAM_GRID_SCATTER],
+		                                        "sCellEnds"),
+		                   cellEnds);
+		glProgramUniform1i(programs[PROGRAM_DENSITY],
+		                   glGetUniformLocation(programs[PROGRAM_DENSITY],
+		                                        "sCellEnds"),
+		                   cellEnds);
+		glProgramUniform1i(programs[PROGRAM_FORCE],
+		                   glGetUniformLocation(programs[PROGRAM_FORCE],
+		                                        "sCellEnds"),
+		                   cellEnds);
+		glProgramUniform1i(programs[PROGRAM_NEIGHBOURS],
+		                   glGetUniformLocation(programs[PROGRAM_NEIGHBOURS],
+		                                        "sCellEnds"),
+		                   cellEnds);
+		for(GLuint i=0; i<PBF_PROGRAM_COUNT; ++i)
+			glProgramUniform1i(programs[PBF_PROGRAMS[i]],
+			                   glGetUniformLocation(programs[PBF_PROGRAMS[i]],
+			                                        "sCellEnds"),
+			                   cellEnds);
+
+		// scatter
+		glUseProgram(programs[PROGRAM_GRID_SCATTER]);
+		glBindVertexArray(vertexArrays[VERTEX_ARRAY_POS_DENSITY_PING
+		                               + sphPingPong]);
+			glDrawArrays(GL_POINTS, 0, particleCount);
+
+		glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+	}
+
+	glDisable(GL_RASTERIZER_DISCARD);
+}
+
+
+// sort the particles along the Z-order curve of the cells, so that neighbours
+// are close in memory (rasterizer must be disabled)
+void reorder_sph_particles()
+{
+	// empty cells
+	glUseProgram(programs[PROGRAM_CELL_CLEAR]);
+	glBindVertexArray(vertexArrays[VERTEX_ARRAY_BUCKET]);
+	glBindTransformFeedback(GL_TRANSFORM_FEEDBACK,
+	                        transformFeedbacks[TRANSFORM_FEEDBACK_HEAD]);
+	glBeginTransformFeedback(GL_POINTS);
+		glDrawArrays(GL_POINTS, 0, cellCount/4 + cellCount%4);
+	glEndTransformFeedback();
+	glBindTransformFeedback(GL_TRANSFORM_FEEDBACK, 0);
+
+	// count particles in cells (cells are indexed by their Z-order rank)
+	glUseProgram(programs[PROGRAM_REORDER_COUNT]);
+	glBindVertexArray(vertexArrays[VERTEX_ARRAY_POS_DENSITY_PING+sphPingPong]);
+		glDrawArrays(GL_POINTS, 0, particleCount);
+	glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT
+	                | GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+
+	// scatter
+	glProgramUniform1i(programs[PROGRAM_REORDER_SCATTER],
+	                   glGetUniformLocation(programs[PROGRAM_REORDER_SCATTER],
+	                                        "sCellEnds"),
+	                   scan_sph_cells());
+	glUseProgram(programs[PROGRAM_REORDER_SCATTER]);
+	glBindVertexArray(vertexArrays[VERTEX_ARRAY_POS_DENSITY_PING+sphPingPong]);
+		glDrawArrays(GL_POINTS, 0, particleCount);
+	glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+
+	// gather positions and velocities in the new order
+	glUseProgram(programs[PROGRAM_REORDER]);
+	glUniform1i(glGetUniformLocation(programs[PROGRAM_REORDER], "sData0"),
+	            TEXTURE_POS_DENSITIES_PING + sphPingPong);
+	glUniform1i(glGetUniformLocation(programs[PROGRAM_REORDER], "sData1"),
+	            TEXTURE_VELOCITIES_PING + sphPingPong);
+	glBindVertexArray(vertexArrays[VERTEX_ARRAY_BUCKET]);
+	glBindTransformFeedback(GL_TRANSFORM_FEEDBACK,
+	                        transformFeedbacks[TRANSFORM_FEEDBACK_PARTICLE_PING
+	                                           + sphPingPong]);
+	glBeginTransformFeedback(GL_POINTS);
+		glDrawArrays(GL_POINTS, 0, particleCount);
+	glEndTransformFeedback();
+	glBindTransformFeedback(GL_TRANSFORM_FEEDBACK, 0);
+
+	// ping pong
+	sphPingPong = 1 - sphPingPong;
+
+	// particle indices have changed
+	neighbourListsValid = false;
+}
+
+
+// read a displacement readback if the gpu is done with it (waits at most
+// timeout nanoseconds)
+bool collect_sph_displacement(GLuint slot, GLuint64 timeout)
+{
+	GLint values[2]; // max squared displacement (float bits), overflows
+
+	if(!displacementFences[slot]
+	|| GL_TIMEOUT_EXPIRED == glClientWaitSync(displacementFences[slot],
+	                                          GL_SYNC_FLUSH_COMMANDS_BIT,
+	                                          timeout))
+		return false;
+	glDeleteSync(displacementFences[slot]);
+	displacementFences[slot] = 0;
+
+	// readbacks of older lists are stale
+	if(displacementBuilds[slot] != neighbourListBuildCount
+	|| displacementSteps[slot] < listDisplacementSteps)
+		return true;
+	glBindBuffer(GL_COPY_READ_BUFFER, buffers[BUFFER_DISPLACEMENT_READ]);
+		glGetBufferSubData(GL_COPY_READ_BUFFER,
+		                   slot*sizeof(values),
+		                   sizeof(values),
+		                   values);
+	glBindBuffer(GL_COPY_READ_BUFFER, 0);
+	std::memcpy(&listDisplacement2, &values[0], sizeof(GLfloat));
+	listDisplacementSteps = displacementSteps[slot];
+	listOverflowCount     = values[1];
+	return true;
+}
+
+
+// copy the displacement of the last force pass, and the overflows of the
+// last build, to a readback slot (waits
+// only if the gpu is DISPLACEMENT_SLOTS steps behind, which bounds the lag)
+void read_sph_displacement()
+{
+	const GLuint64 SECOND = 1000000000; // nanoseconds
+	const GLuint SIZE     = 2*sizeof(GLint);
+
+	// the readback of DISPLACEMENT_SLOTS steps ago is read first
+	++neighbourListSteps;
+	while(displacementFences[displacementSlot])
+		collect_sph_displacement(displacementSlot, SECOND);
+
+	glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+	glBindBuffer(GL_COPY_READ_BUFFER, buffers[BUFFER_DISPLACEMENT]);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, buffers[BUFFER_DISPLACEMENT_READ]);
+		glCopyBufferSubData(GL_COPY_READ_BUFFER,
+		                    GL_COPY_WRITE_BUFFER,
+		                    0,
+		                    displacementSlot*SIZE,
+		                    SIZE);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+	glBindBuffer(GL_COPY_READ_BUFFER, 0);
+
+	displacementFences[displacementSlot]
+		= glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	displacementBuilds[displacementSlot] = neighbourListBuildCount;
+	displacementSteps[displacementSlot]  = neighbourListSteps;
+	displacementSlot = (displacementSlot + 1) % DISPLACEMENT_SLOTS;
+}
+
+
+// check if a particle has moved by more than skin/2 since the last build of
+// the neighbour lists (never waits: the displacement read back is a step or
+// two old, and is extrapolated to the last force pass)
+bool neighbour_lists_expired()
+{
+	if(!neighbourListsValid)
+		return true;
+
+	for(GLuint i=0; i<DISPLACEMENT_SLOTS; ++i)
+		collect_sph_displacement((displacementSlot + i) % DISPLACEMENT_SLOTS,
+		                         0);
+	if(0 == listDisplacementSteps)
+		return false;
+
+	// the particles move about as far during each pass
+	const GLfloat SCALE = GLfloat(neighbourListSteps) / listDisplacementSteps;
+	return listDisplacement2 * SCALE * SCALE > 0.25f*listSkin*listSkin;
+}
+
+
+// build the neighbour lists from the grid
+void build_sph_neighbours()
+{
+	const GLint ZEROS[2] = {0, 0};
+
+	glEnable(GL_RASTERIZER_DISCARD);
+
+	// reset displacement and overflows (counted by the build)
+	glBindBuffer(GL_TEXTURE_BUFFER, buffers[BUFFER_DISPLACEMENT]);
+		glBufferSubData(GL_TEXTURE_BUFFER, 0, sizeof(ZEROS), ZEROS);
+	glBindBuffer(GL_TEXTURE_BUFFER, 0);
+
+	// store neighbours, counts and reference positions
+	glUseProgram(programs[PROGRAM_NEIGHBOURS]);
+	glUniform1i(glGetUniformLocation(programs[PROGRAM_NEIGHBOURS],
+	                                 "sParticlePos"),
+	            TEXTURE_POS_DENSITIES_PING + sphPingPong);
+	glBindVertexArray(vertexArrays[VERTEX_ARRAY_POS_DENSITY_PING+sphPingPong]);
+	glBindTransformFeedback(GL_TRANSFORM_FEEDBACK,
+	                        transformFeedbacks[TRANSFORM_FEEDBACK_NEIGHBOURS]);
+	glBeginTransformFeedback(GL_POINTS);
+		glDrawArrays(GL_POINTS, 0, particleCount);
+	glEndTransformFeedback();
+	glBindTransformFeedback(GL_TRANSFORM_FEEDBACK, 0);
+	glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+
 	glDisable(GL_RASTERIZER_DISCARD);
+
+	neighbourListsValid = true;
+	++neighbourListBuildCount;
+	neighbourListSteps    = 0;
+	listDisplacement2     = 0.0f;
+	listDisplacementSteps = 0;
+	listOverflowCount     = 0;
 }
 
 
 // compute densities
 void init_sph_density()
 {
-	// build grid
-	build_grid();
+	// build grid (and neighbour lists once they have expired)
+	begin_frame_task(TASK_GRID);
+	if(!neighbourLists)
+		build_grid();
+	else if(neighbour_lists_expired())
+	{
+		build_grid();
+		build_sph_neighbours();
+	}
+	end_frame_task(TASK_GRID);
 //	glFinish();
 
+	// fused steps keep the densities integrated by the last force pass
+	if(densityFrequency > 1 && 0 != (sphStepCount-1) % densityFrequency)
+		return;
+
 	// compute densities and store ine TF
+	begin_frame_task(TASK_DENSITY);
 	glEnable(GL_RASTERIZER_DISCARD);
 	glUseProgram(programs[PROGRAM_DENSITY]);
-	glBindVertexArray(vertexArrays[VERTEX_ARRAY_POS_DENSITY_PING + sphPingPong]);
+	glBindVertexArray(vertexArrays[VERTEX_ARRAY_FLUID_RENDER_PING + sphPingPong]);
 	glBindTransformFeedback(GL_TRANSFORM_FEEDBACK,
 	                        transformFeedbacks[TRANSFORM_FEEDBACK_DENSITY_PING
 	                                           + sphPingPong]);
@@ -471,15 +1551,20 @@ void init_sph_density()
 	// ping pong
 	sphPingPong = 1 - sphPingPong;
 
+	// the force pass replays the recorded pairs
+	if(pairCapacity > 0)
+		glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+
 	// back to defaults
 	glBindTransformFeedback(GL_TRANSFORM_FEEDBACK, 0);
 	glDisable(GL_RASTERIZER_DISCARD);
+	end_frame_task(TASK_DENSITY);
 	glBindVertexArray(0);
 }
 
 
-// initialize the particles
-void init_sph_particles()
+// generate the initial particle positions and velocities
+void gen_sph_particles(sph::ParticleArrays& particles)
 {
 	// variables / constants
 	const float PARTICLE_SPACING = 1.1f; // in centimeters
@@ -491,43 +1576,214 @@ void init_sph_particles()
 	            + Vector3(SIMULATION_DOMAIN[0]*0.0125f,
 	                      5.0f*PARTICLE_SPACING,
 	                      SIMULATION_DOMAIN[2]*0.0125f);
-	std::vector<Vector4> positions;
-	std::vector<Vector4> velocities(particleCount, Vector4::ZERO);
 
 	// reserve memory
-	positions.reserve(particleCount);
+	particles.Resize(particleCount);
+	for(int a=0; a<sph::PARTICLE_ATTRIBUTE_COUNT; ++a)
+		std::fill(particles[a], particles[a]+particleCount, 0.0f);
 
 	// set positions
+	GLuint i = 0;
 	for(GLuint y=0; y<yCnt; ++y)
 		for(GLuint x=0; x<xCnt; ++x)
-			for(GLuint z=0; z<zCnt; ++z)
+			for(GLuint z=0; z<zCnt && i<particleCount; ++z, ++i)
 			{
-				positions.push_back(Vector4(min[0]+x*PARTICLE_SPACING,
-				                            min[1]+y*PARTICLE_SPACING,
-				                            min[2]+z*PARTICLE_SPACING,
-				                            0));
+				particles[sph::PARTICLE_X][i] = min[0]+x*PARTICLE_SPACING;
+				particles[sph::PARTICLE_Y][i] = min[1]+y*PARTICLE_SPACING;
+				particles[sph::PARTICLE_Z][i] = min[2]+z*PARTICLE_SPACING;
 			}
+}
+
 
-	// send data to buffers
+// send particles to the current buffers (interleaved straight into the
+// mapped buffers)
+void upload_sph_particles(const sph::ParticleArrays& particles)
+{
 	glBindBuffer(GL_ARRAY_BUFFER,
 	             buffers[BUFFER_POS_DENSITIES_PING + sphPingPong]);
-		glBufferSubData(GL_ARRAY_BUFFER,
-		                0,
-		                sizeof(Vector4)*particleCount,
-		                &positions[0]);
+		particles.Store(static_cast<Vector4*>(
+		                glMapBufferRange(GL_ARRAY_BUFFER,
+		                                 0,
+		                                 sizeof(Vector4)*particleCount,
+		                                 GL_MAP_WRITE_BIT
+		                                 | GL_MAP_INVALIDATE_RANGE_BIT)),
+		                NULL);
+		glUnmapBuffer(GL_ARRAY_BUFFER);
 	glBindBuffer(GL_ARRAY_BUFFER,
-	             buffers[BUFFER_VELOCITIES_PING + 1-sphPingPong]);
-		glBufferSubData(GL_ARRAY_BUFFER,
-		                0,
-		                sizeof(Vector4)*particleCount,
-		                &velocities[0]);
+	             buffers[BUFFER_VELOCITIES_PING + sphPingPong]);
+		particles.Store(NULL,
+		                static_cast<Vector4*>(
+		                glMapBufferRange(GL_ARRAY_BUFFER,
+		                                 0,
+		                                 sizeof(Vector4)*particleCount,
+		                                 GL_MAP_WRITE_BIT
+		                                 | GL_MAP_INVALIDATE_RANGE_BIT)));
+		glUnmapBuffer(GL_ARRAY_BUFFER);
 	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+
+// initialize the particles
+void init_sph_particles()
+{
+	sph::ParticleArrays particles;
+
+	// generate data
+	gen_sph_particles(particles);
+	upload_sph_particles(particles);
 
 	// pre compute densities
 //	init_sph_density();
 }
 
 
+// run a pass of the pbf step from the current particle buffers to the other
+// ones (rasterizer must be disabled)
+void run_sph_pbf_pass(GLuint program)
+{
+	glUseProgram(programs[program]);
+	glUniform1i(glGetUniformLocation(programs[program], "sData0"),
+	            TEXTURE_POS_DENSITIES_PING + sphPingPong);
+	glUniform1i(glGetUniformLocation(programs[program], "sData1"),
+	            TEXTURE_VELOCITIES_PING + sphPingPong);
+	glBindVertexArray(vertexArrays[VERTEX_ARRAY_FLUID_RENDER_PING+sphPingPong]);
+	glBindTransformFeedback(GL_TRANSFORM_FEEDBACK,
+	                        transformFeedbacks[TRANSFORM_FEEDBACK_PARTICLE_PING
+	                                           + sphPingPong]);
+	glBeginTransformFeedback(GL_POINTS);
+		glDrawArrays(GL_POINTS, 0, particleCount);
+	glEndTransformFeedback();
+	glBindTransformFeedback(GL_TRANSFORM_FEEDBACK, 0);
+
+	// ping pong
+	sphPingPong = 1 - sphPingPong;
+}
+
+
+// advance the particles with position based fluids: the positions predicted
+// from gravity are projected on the density constraints for a fixed number
+// of iterations, then the velocities are derived from the motion (the cost
+// of a step does not depend on the state, and dt is not bounded by the
+// stiffness of the walls, which only clamp the positions)
+void step_sph_pbf()
+{
+	begin_frame_task(TASK_GRID);
+	glEnable(GL_RASTERIZER_DISCARD);
+	run_sph_pbf_pass(PROGRAM_PBF_PREDICT);
+
+	// the grid holds the predicted positions
+	build_grid();
+	end_frame_task(TASK_GRID);
+
+	begin_frame_task(TASK_FORCE);
+	glEnable(GL_RASTERIZER_DISCARD);
+	for(GLuint i=0; i<pbfIterations; ++i)
+	{
+		run_sph_pbf_pass(PROGRAM_PBF_LAMBDA);
+		run_sph_pbf_pass(PROGRAM_PBF_DISPLACEMENT);
+	}
+	run_sph_pbf_pass(PROGRAM_PBF_UPDATE);
+
+	// back to defaults
+	glDisable(GL_RASTERIZER_DISCARD);
+	glBindVertexArray(0);
+	end_frame_task(TASK_FORCE);
+}
+
+
+// advance the simulation by one step
+void step_sph()
+{
+	// sort particles along the Z-order curve
+	if(reorderFrequency > 0 && 0 == sphStepCount % reorderFrequency)
+	{
+		begin_frame_task(TASK_GRID);
+		glEnable(GL_RASTERIZER_DISCARD);
+		reorder_sph_particles();
+		glDisable(GL_RASTERIZER_DISCARD);
+		end_frame_task(TASK_GRID);
+	}
+	++sphStepCount;
+
+	// position based step
+	if(sph::SOLVER_MODE_PBF == solverMode)
+	{
+		step_sph_pbf();
+		return;
+	}
+
+	// build grid
+//	build_grid();
+//fw::Timer timer;
+//timer.Start();
+	init_sph_density();
+//timer.Stop();
+//std::cout << "time: " << timer.Ticks() << "s \n";
+
+	// update attributes
+	begin_frame_task(TASK_FORCE);
+	glEnable(GL_RASTERIZER_DISCARD);
+
+	glUseProgram(programs[PROGRAM_FORCE]);
+	glUniform1i(glGetUniformLocation(programs[PROGRAM_FORCE],
+	                                 "sData0"),
+	            TEXTURE_POS_DENSITIES_PING + sphPingPong);
+	glUniform1i(glGetUniformLocation(programs[PROGRAM_FORCE],
+	                                 "sData1"),
+	            TEXTURE_VELOCITIES_PING + sphPingPong);
+
+	glBindTransformFeedback( GL_TRANSFORM_FEEDBACK,
+		transformFeedbacks[TRANSFORM_FEEDBACK_PARTICLE_PING + sphPingPong]
+		);
+
+	glBindVertexArray(vertexArrays[VERTEX_ARRAY_FLUID_RENDER_PING+sphPingPong]);
+	glBeginTransformFeedback(GL_POINTS);
+		glDrawArrays(GL_POINTS, 0, particleCount);
+	glEndTransformFeedback();
+
+	// ping pong
+	sphPingPong = 1 - sphPingPong;
+
+	// restore state
+	glBindTransformFeedback(GL_TRANSFORM_FEEDBACK, 0);
+	glDisable(GL_RASTERIZER_DISCARD);
+
+	// displacement of the lists, checked a step or two later
+	if(neighbourLists)
+		read_sph_displacement();
+	end_frame_task(TASK_FORCE);
+}
+
+
+// number of steps to run before the next frame: one per frame, or as many
+// as needed for the simulated time to follow the wall clock (fixed dt
+// accumulator, at most maxFrameSteps: the lag of slower frames is dropped
+// instead of piling up steps)
+GLuint get_sph_frame_step_count(double frameSeconds)
+{
+	GLuint stepCount = 0;
+
+	if(timeScale <= 0.0f || stepDeltaT <= 0.0f)
+		return 1;
+
+	simulationLag+= frameSeconds * timeScale;
+	while(stepCount < maxFrameSteps && simulationLag >= stepDeltaT)
+	{
+		simulationLag-= stepDeltaT;
+		++stepCount;
+	}
+	if(stepCount == maxFrameSteps && simulationLag >= stepDeltaT)
+	{
+		droppedSimulationTime+= simulationLag;
+		simulationLag = 0.0;
+		std::cout << "\rbehind the wall clock, dropped "
+		          << droppedSimulationTime << " s of simulation    "
+		          << std::flush;
+	}
+	return stepCount;
+}
+
+
 // build transform feedbacks
 void set_transform_feedbacks()
 {
@@ -546,6 +1802,27 @@ void set_transform_feedbacks()
 		                  buffers[BUFFER_LIST],
 		                  0,
 		                  particleCount * sizeof(GLint));
+	glBindTransformFeedback(GL_TRANSFORM_FEEDBACK,
+	                        transformFeedbacks[TRANSFORM_FEEDBACK_CELL_BITS]);
+		glBindBufferRange(GL_TRANSFORM_FEEDBACK_BUFFER,
+		                  0,
+		                  buffers[BUFFER_CELL_BITS],
+		                  0,
+		                  get_cell_bit_words() * sizeof(GLint));
+	glBindTransformFeedback(GL_TRANSFORM_FEEDBACK,
+	                        transformFeedbacks[TRANSFORM_FEEDBACK_CELL_SCAN_PING]);
+		glBindBufferRange(GL_TRANSFORM_FEEDBACK_BUFFER,
+		                  0,
+		                  buffers[BUFFER_CELL_SCAN_PING],
+		                  0,
+		                  cellCount * sizeof(GLint));
+	glBindTransformFeedback(GL_TRANSFORM_FEEDBACK,
+	                        transformFeedbacks[TRANSFORM_FEEDBACK_CELL_SCAN_PONG]);
+		glBindBufferRange(GL_TRANSFORM_FEEDBACK_BUFFER,
+		                  0,
+		                  buffers[BUFFER_CELL_SCAN_PONG],
+		                  0,
+		                  cellCount * sizeof(GLint));
 	glBindTransformFeedback(GL_TRANSFORM_FEEDBACK,
 	                        transformFeedbacks[TRANSFORM_FEEDBACK_PARTICLE_PING]);
 		glBindBufferRange(GL_TRANSFORM_FEEDBACK_BUFFER,
@@ -577,6 +1854,11 @@ void set_transform_feedbacks()
 		                  buffers[BUFFER_POS_DENSITIES_PONG],
 		                  0,
 		                  particleCount*sizeof(Vector4));
+		glBindBufferRange(GL_TRANSFORM_FEEDBACK_BUFFER,
+		                  1,
+		                  buffers[BUFFER_VELOCITIES_PONG],
+		                  0,
+		                  particleCount*sizeof(Vector4));
 	glBindTransformFeedback(GL_TRANSFORM_FEEDBACK,
 	                        transformFeedbacks[TRANSFORM_FEEDBACK_DENSITY_PONG]);
 		glBindBufferRange(GL_TRANSFORM_FEEDBACK_BUFFER,
@@ -584,10 +1866,466 @@ void set_transform_feedbacks()
 		                  buffers[BUFFER_POS_DENSITIES_PING],
 		                  0,
 		                  particleCount*sizeof(Vector4));
+		glBindBufferRange(GL_TRANSFORM_FEEDBACK_BUFFER,
+		                  1,
+		                  buffers[BUFFER_VELOCITIES_PING],
+		                  0,
+		                  particleCount*sizeof(Vector4));
+	glBindTransformFeedback(GL_TRANSFORM_FEEDBACK,
+	                        transformFeedbacks[TRANSFORM_FEEDBACK_NEIGHBOURS]);
+		glBindBufferRange(GL_TRANSFORM_FEEDBACK_BUFFER,
+		                  0,
+		                  buffers[BUFFER_NEIGHBOUR_REFS],
+		                  0,
+		                  particleCount*sizeof(Vector4));
+		glBindBufferRange(GL_TRANSFORM_FEEDBACK_BUFFER,
+		                  1,
+		                  buffers[BUFFER_NEIGHBOUR_COUNTS],
+		                  0,
+		                  particleCount*sizeof(GLint));
 	glBindTransformFeedback(GL_TRANSFORM_FEEDBACK,0);
 }
 
 
+// set the CPU solver from the options and generate its particles
+void set_cpu_solver(sph::CpuSolver& solver)
+{
+	sph::ParticleArrays particles;
+
+	gen_sph_particles(particles);
+	solver.SetConstants(get_sph_constants());
+	solver.SetTicks(deltaT);
+	solver.SetAdaptiveTicks(adaptiveDeltaT);
+	solver.SetTimeLevels(timeLevels);
+	solver.SetFusedDensity(densityFrequency);
+	solver.SetSolverMode(solverMode);
+	solver.SetPressureTolerance(pressureTolerance);
+	solver.SetPbfIterations(pbfIterations);
+	solver.SetGravityDir(gravityVector);
+	solver.SetGridMode(gridMode);
+	solver.SetIncrementalGrid(maxMovedFraction);
+	solver.SetCellIndexMode(cellIndexMode);
+	solver.SetSearchMode(searchMode);
+	solver.SetOccupancy(occupancy);
+	solver.SetSimdIsa(simdIsa);
+	solver.SetPairMode(pairMode);
+	solver.SetScheduleMode(scheduleMode);
+	solver.SetReorderFrequency(reorderFrequency);
+	solver.SetNeighbourLists(neighbourLists, neighbourSkin);
+	solver.SetCompressedNeighbourLists(compressedLists);
+	solver.SetPairReuse(pairCapacity);
+	solver.SetParticles(particles);
+
+	std::cout << "CPU solver: "
+	          << sph::solver_mode_name(solverMode) << ", "
+	          << solver.ParticleCount() << " particles, "
+	          << solver.ThreadCount()   << " threads, "
+	          << sph::grid_mode_name(gridMode) << " grid, "
+	          << sph::cell_index_name(cellIndexMode) << " cells, "
+	          << sph::search_mode_name(searchMode) << " cell search, "
+	          << sph::simd_isa_name(solver.GetSimdIsa()) << " kernels, "
+	          << sph::pair_mode_name(pairMode) << " pairs, "
+	          << sph::schedule_mode_name(scheduleMode) << " scheduling, "
+	          << "reorder every " << reorderFrequency << " steps";
+	if(neighbourLists)
+		std::cout << ", " << (compressedLists ? "compressed " : "")
+		          << "neighbour lists (skin " << neighbourSkin << ")";
+	if(pairCapacity > 0)
+		std::cout << ", pair reuse (" << pairCapacity << " per particle)";
+	if(occupancy)
+		std::cout << ", occupancy";
+	if(maxMovedFraction > 0.0f && sph::GRID_MODE_SORTED == gridMode)
+		std::cout << ", incremental grid (up to " << maxMovedFraction*100.0f
+		          << "% moved)";
+	if(adaptiveDeltaT)
+		std::cout << ", adaptive dt (max " << deltaT << ")";
+	if(timeLevels > 1)
+		std::cout << ", " << timeLevels << " dt levels";
+	if(sph::SOLVER_MODE_PBF == solverMode)
+		std::cout << ", " << pbfIterations << " pbf iterations";
+	if(densityFrequency > 1)
+		std::cout << ", fused density (density pass every "
+		          << densityFrequency << " steps)";
+	std::cout << std::endl;
+}
+
+
+// run the solver on the CPU (no GL context is created)
+int run_cpu_solver(GLuint stepCount)
+{
+	const GLuint REPORT_FREQUENCY = 100; // steps between two reports
+	sph::CpuSolver solver;
+	fw::Timer timer;
+	double totalTicks = 0.0;
+	double simulationTime = 0.0;             // sum of the dts
+	float minTicks = deltaT, maxTicks = 0.0f; // dt range since the last report
+	GLuint pressureIterations = 0; // pressure iterations since the last report
+	GLuint divergenceIterations = 0; // (dfsph divergence solve)
+	GLuint reportSteps = 0;        // steps since the last report
+	float movedFractions = 0.0f;   // sum of the incremental grids
+
+	set_cpu_solver(solver);
+
+	// run
+	for(GLuint step=1; step<=stepCount; ++step)
+	{
+		timer.Start();
+		solver.Step();
+		timer.Stop();
+		totalTicks+= timer.Ticks();
+		simulationTime+= solver.Ticks();
+		minTicks = std::min(minTicks, solver.Ticks());
+		maxTicks = std::max(maxTicks, solver.Ticks());
+		pressureIterations+= solver.PressureIterationCount();
+		divergenceIterations+= solver.DivergenceIterationCount();
+		movedFractions+= solver.MovedFraction();
+		++reportSteps;
+
+		if(0 == step % REPORT_FREQUENCY || step == stepCount)
+		{
+			const float *densities = solver.Particles()[sph::PARTICLE_DENSITY];
+			double meanDensity = 0.0;
+			for(GLuint i=0; i<solver.ParticleCount(); ++i)
+				meanDensity+= densities[i];
+			if(solver.ParticleCount() > 0)
+				meanDensity/= solver.ParticleCount();
+
+			std::cout << "step " << step
+			          << ": " << totalTicks*1e3/step << " ms/step"
+			          << ", mean density " << meanDensity;
+			if(neighbourLists)
+				std::cout << ", " << solver.NeighbourListBuildCount()
+				          << " list builds ("
+				          << solver.NeighbourListBytes() / 1048576.0
+				          << " MB)";
+			if(pairCapacity > 0 && solver.CandidateCount() > 0.0)
+				std::cout << ", " << solver.PairCount()
+				                     / solver.CandidateCount()
+				          << " pairs per candidate, "
+				          << solver.PairOverflowCount() << " overflows";
+			if(occupancy)
+				std::cout << ", " << solver.ActiveCellCount() << " of "
+				          << get_bucket_1d_size() << " cells occupied";
+			if(maxMovedFraction > 0.0f && sph::GRID_MODE_SORTED == gridMode)
+				std::cout << ", " << movedFractions*100.0f / reportSteps
+				          << "% moved/step, " << solver.GridRepairCount()
+				          << " grids repaired";
+			if(adaptiveDeltaT)
+				std::cout << ", dt " << minTicks << " to " << maxTicks
+				          << ", simulated " << simulationTime << " s";
+			if(simulationTime > 0.0)
+				std::cout << ", " << solver.ForceEvaluationCount()
+				                     / simulationTime
+				          << " force evaluations per simulated second";
+			if(sph::SOLVER_MODE_WCSPH != solverMode)
+				std::cout << ", " << float(pressureIterations) / reportSteps
+				          << " pressure iterations/step, compression "
+				          << solver.PressureError()*100.0f << "%";
+			if(solver.DivergedSolveCount() > 0)
+				std::cout << ", " << solver.DivergedSolveCount()
+				          << " diverged solves";
+			std::cout << std::endl;
+
+			// time split of the two dfsph solves
+			if(sph::SOLVER_MODE_DFSPH == solverMode)
+				std::cout << "  density solve "
+				          << solver.DensitySolveTime()*1e3/step
+				          << " ms/step, divergence solve "
+				          << solver.DivergenceSolveTime()*1e3/step
+				          << " ms/step, "
+				          << float(divergenceIterations) / reportSteps
+				          << " iterations/step, divergence error "
+				          << solver.DivergenceError()*100.0f << "%"
+				          << std::endl;
+
+			// drift of the densities integrated by the force pass
+			if(densityFrequency > 1)
+				std::cout << "  " << solver.DensityPassCount()
+				          << " density passes, drift at the last one "
+				          << solver.DensityDrift()*100.0f << "% mean, "
+				          << solver.MaxDensityDrift()*100.0f << "% max"
+				          << std::endl;
+
+			// particles per dt level
+			if(timeLevels > 1)
+			{
+				const sph::ParticleArrays& state = solver.Particles();
+				const float *levels = state[sph::PARTICLE_TIME_LEVEL];
+				std::vector<GLuint> levelCounts(timeLevels, 0);
+				for(GLuint i=0; i<solver.ParticleCount(); ++i)
+					++levelCounts[GLuint(levels[i])];
+				std::cout << "  particles per dt level:";
+				for(GLuint l=0; l<timeLevels; ++l)
+					std::cout << ' ' << levelCounts[l];
+				std::cout << std::endl;
+			}
+			minTicks = deltaT;
+			maxTicks = 0.0f;
+			pressureIterations = 0;
+			divergenceIterations = 0;
+			movedFractions = 0.0f;
+			reportSteps = 0;
+
+			// load balance of the workers
+			const sph::BlockScheduler& scheduler = solver.Scheduler();
+			for(int w=0; w<scheduler.WorkerCount(); ++w)
+			{
+				const sph::WorkerCounters& counters = scheduler.Counters(w);
+				std::cout << "  worker " << w
+				          << ": busy " << counters.busyTime*1e3/step
+				          << " ms/step, idle " << counters.idleTime*1e3/step
+				          << " ms/step, " << counters.blockCount << " blocks, "
+				          << counters.stealCount << " steals" << std::endl;
+			}
+		}
+	}
+
+	return 0;
+}
+
+
+// step the CPU solver on the calling thread and publish every completed
+// state to the render thread, until the exchange is closed
+void run_solver_thread()
+{
+	sph::CpuSolver solver;
+
+#ifdef _OPENMP
+	GLuint threadCount = solverThreadCount;
+	if(0 == threadCount)
+		threadCount = std::max(omp_get_num_procs() - 1, 1);
+	omp_set_num_threads(threadCount);
+#endif
+	set_cpu_solver(solver);
+
+	do
+	{
+		solver.Step();
+		solverStates.Back() = solver.Particles();
+	} while(solverStates.Publish());
+}
+
+
+// (re)build the sph programs for the current modes and set their constants
+void build_sph_programs()
+{
+	const GLuint SPH_PROGRAMS[] = { PROGRAM_DENSITY,
+	                                PROGRAM_BUCKET,
+	                                PROGRAM_GRID,
+	                                PROGRAM_GRID_SCATTER,
+	                                PROGRAM_CELL_SCAN,
+	                                PROGRAM_CELL_CLEAR,
+	                                PROGRAM_REORDER_COUNT,
+	                                PROGRAM_REORDER_SCATTER,
+	                                PROGRAM_REORDER,
+	                                PROGRAM_NEIGHBOURS,
+	                                PROGRAM_FORCE,
+	                                PROGRAM_PBF_PREDICT,
+	                                PROGRAM_PBF_LAMBDA,
+	                                PROGRAM_PBF_DISPLACEMENT,
+	                                PROGRAM_PBF_UPDATE };
+	const GLuint SPH_PROGRAM_COUNT = sizeof(SPH_PROGRAMS)/sizeof(GLuint);
+	std::string cellOptions;
+	std::string gridOptions;
+	std::string cellInitOptions;
+	std::string sphOptions;
+	std::string neighbourOptions;
+	std::string pbfOptions;
+	std::stringstream capacity;
+
+	// set options
+	if(sph::CELL_INDEX_HASHED == cellIndexMode)
+		cellOptions = "#define _HASHED_GRID\n";
+	gridOptions = sphOptions = cellOptions;
+	if(sph::GRID_MODE_SORTED == gridMode)
+	{
+		gridOptions    += "#define _SORTED_GRID_COUNT";
+		cellInitOptions = "#define _CELL_INIT_VALUE 0";
+		sphOptions     += "#define _SORTED_GRID\n";
+	}
+	if(sph::SEARCH_MODE_8 == searchMode)
+		sphOptions += "#define _OCTANT_SEARCH\n";
+	pbfOptions = sphOptions; // always on the grid
+	capacity << "#define _NEIGHBOUR_CAPACITY " << neighbourCapacity;
+	neighbourOptions = sphOptions + capacity.str();
+	if(neighbourLists)
+		sphOptions = neighbourOptions + "\n#define _NEIGHBOUR_LIST";
+	else if(pairCapacity > 0 && densityFrequency <= 1)
+		// the density pass runs before every force pass (up to the capacity
+		// of the neighbour lists)
+		sphOptions = neighbourOptions + "\n#define _PAIR_REUSE";
+	if(occupancy)
+	{
+		// the neighbour lists replace the cells
+		gridOptions+= "\n#define _OCCUPANCY";
+		pbfOptions += "\n#define _OCCUPANCY";
+		if(!neighbourLists)
+			sphOptions+= "\n#define _OCCUPANCY";
+	}
+	if(adaptiveDeltaT)
+		sphOptions+= "\n#define _ADAPTIVE_TIME_STEP";
+
+	// new names
+	for(GLuint i=0; i<SPH_PROGRAM_COUNT; ++i)
+	{
+		glDeleteProgram(programs[SPH_PROGRAMS[i]]);
+		programs[SPH_PROGRAMS[i]] = glCreateProgram();
+	}
+
+	// build
+	fw::build_glsl_program(programs[PROGRAM_DENSITY],
+	                       "sph_density.glsl",
+	                       sphOptions,
+	                       GL_FALSE);
+	const GLchar* densityVaryings[] = {"oData", "oVelocity"};
+	glTransformFeedbackVaryings(programs[PROGRAM_DENSITY],
+	                            2,
+	                            densityVaryings,
+	                            GL_SEPARATE_ATTRIBS);
+	glLinkProgram(programs[PROGRAM_DENSITY]);
+
+	const GLchar* varyings1[] = {"oData"};
+
+	fw::build_glsl_program(programs[PROGRAM_BUCKET],
+	                       "sph_cell_init.glsl",
+	                       cellInitOptions,
+	                       GL_FALSE);
+	glTransformFeedbackVaryings(programs[PROGRAM_BUCKET],
+	                            1,
+	                            varyings1,
+	                            GL_INTERLEAVED_ATTRIBS);
+	glLinkProgram(programs[PROGRAM_BUCKET]);
+
+	fw::build_glsl_program(programs[PROGRAM_CELL_SCAN],
+	                       "sph_cell_scan.glsl",
+	                       "",
+	                       GL_FALSE);
+	glTransformFeedbackVaryings(programs[PROGRAM_CELL_SCAN],
+	                            1,
+	                            varyings1,
+	                            GL_INTERLEAVED_ATTRIBS);
+	glLinkProgram(programs[PROGRAM_CELL_SCAN]);
+
+	fw::build_glsl_program(programs[PROGRAM_CELL_CLEAR],
+	                       "sph_cell_init.glsl",
+	                       "#define _CELL_INIT_VALUE 0",
+	                       GL_FALSE);
+	glTransformFeedbackVaryings(programs[PROGRAM_CELL_CLEAR],
+	                            1,
+	                            varyings1,
+	                            GL_INTERLEAVED_ATTRIBS);
+	glLinkProgram(programs[PROGRAM_CELL_CLEAR]);
+
+	fw::build_glsl_program(programs[PROGRAM_FORCE],
+	                       "sph_force.glsl",
+	                       densityFrequency > 1
+	                       ? sphOptions + "\n#define _FUSED_DENSITY"
+	                       : sphOptions,
+	                       GL_FALSE);
+	const GLchar* varyings2[] = {"oData0", "oData1"};
+	glTransformFeedbackVaryings(programs[PROGRAM_FORCE],
+	                            2,
+	                            varyings2,
+	                            GL_SEPARATE_ATTRIBS);
+	glLinkProgram(programs[PROGRAM_FORCE]);
+
+	const GLchar* PBF_PASSES[] = { "#define _PBF_PREDICT",
+	                               "#define _PBF_LAMBDA",
+	                               "#define _PBF_DISPLACEMENT",
+	                               "#define _PBF_UPDATE" };
+	for(GLuint i=0; i<PBF_PROGRAM_COUNT; ++i)
+	{
+		fw::build_glsl_program(programs[PBF_PROGRAMS[i]],
+		                       "sph_pbf.glsl",
+		                       pbfOptions + PBF_PASSES[i],
+		                       GL_FALSE);
+		glTransformFeedbackVaryings(programs[PBF_PROGRAMS[i]],
+		                            2,
+		                            varyings2,
+		                            GL_SEPARATE_ATTRIBS);
+		glLinkProgram(programs[PBF_PROGRAMS[i]]);
+	}
+
+	fw::build_glsl_program(programs[PROGRAM_REORDER],
+	                       "sph_reorder.glsl",
+	                       "",
+	                       GL_FALSE);
+	glTransformFeedbackVaryings(programs[PROGRAM_REORDER],
+	                            2,
+	                            varyings2,
+	                            GL_SEPARATE_ATTRIBS);
+	glLinkProgram(programs[PROGRAM_REORDER]);
+
+	fw::build_glsl_program(programs[PROGRAM_NEIGHBOURS],
+	                       "sph_neighbours.glsl",
+	                       neighbourOptions,
+	                       GL_FALSE);
+	const GLchar* neighbourVaryings[] = {"oPosition", "oCount"};
+	glTransformFeedbackVaryings(programs[PROGRAM_NEIGHBOURS],
+	                            2,
+	                            neighbourVaryings,
+	                            GL_SEPARATE_ATTRIBS);
+	glLinkProgram(programs[PROGRAM_NEIGHBOURS]);
+
+	fw::build_glsl_program(programs[PROGRAM_GRID],
+	                       "sph_grid.glsl",
+	                       gridOptions,
+	                       GL_TRUE);
+
+	fw::build_glsl_program(programs[PROGRAM_GRID_SCATTER],
+	                       "sph_grid.glsl",
+	                       cellOptions + "#define _SORTED_GRID_SCATTER",
+	                       GL_TRUE);
+
+	fw::build_glsl_program(programs[PROGRAM_REORDER_COUNT],
+	                       "sph_grid.glsl",
+	                       cellOptions
+	                       + "#define _SORTED_GRID_COUNT\n#define _MORTON_ORDER",
+	                       GL_TRUE);
+
+	fw::build_glsl_program(programs[PROGRAM_REORDER_SCATTER],
+	                       "sph_grid.glsl",
+	                       cellOptions
+	                       + "#define _SORTED_GRID_SCATTER\n#define _MORTON_ORDER",
+	                       GL_TRUE);
+
+	// set constants
+	set_runtime_constant_uniforms();
+	set_sph_constants();
+	set_delta();
+	set_gravity_vector();
+}
+
+
+// double the capacity of the neighbour lists if the last build truncated
+// some of them (the lists are rebuilt by the next step)
+void grow_sph_neighbours()
+{
+	if(0 == listOverflowCount)
+		return;
+
+	std::cout << "neighbour lists: " << listOverflowCount
+	          << " particles over the capacity of " << neighbourCapacity;
+	listOverflowCount = 0;
+	if(neighbourCapacity >= MAX_NEIGHBOUR_CAPACITY)
+	{
+		std::cout << " (truncated)" << std::endl;
+		return;
+	}
+
+	// the particle count is fixed by now
+	neighbourCapacity*= 2;
+	glBindBuffer(GL_TEXTURE_BUFFER, buffers[BUFFER_NEIGHBOURS]);
+		glBufferData(GL_TEXTURE_BUFFER,
+		             sizeof(GLint)*particleCount*neighbourCapacity,
+		             NULL,
+		             GL_STATIC_DRAW);
+	glBindBuffer(GL_TEXTURE_BUFFER, 0);
+	build_sph_programs();
+	std::cout << ", now " << neighbourCapacity << std::endl;
+}
+
+
 #ifdef _ANT_ENABLE
 
 #endif
@@ -616,12 +2354,14 @@ void on_init()
 	textures     = new GLuint[TEXTURE_COUNT];
 	programs     = new GLuint[PROGRAM_COUNT];
 	transformFeedbacks = new GLuint[TRANSFORM_FEEDBACK_COUNT];
+	taskQueries  = new GLuint[2*TASK_LOG_SLOTS*TASK_LOG_CAPACITY];
 
 	// gen names
 	glGenBuffers(BUFFER_COUNT, buffers);
 	glGenVertexArrays(VERTEX_ARRAY_COUNT, vertexArrays);
 	glGenTextures(TEXTURE_COUNT, textures);
 	glGenTransformFeedbacks(TRANSFORM_FEEDBACK_COUNT, transformFeedbacks);
+	glGenQueries(2*TASK_LOG_SLOTS*TASK_LOG_CAPACITY, taskQueries);
 	for(GLuint i=0; i<PROGRAM_COUNT;++i)
 		programs[i] = glCreateProgram();
 
@@ -658,20 +2398,53 @@ void on_init()
 		             NULL,
 		             GL_STATIC_DRAW);
 	glBindBuffer(GL_ARRAY_BUFFER, 0);
-	glBindBuffer(GL_TEXTURE_BUFFER, buffers[BUFFER_HEAD]);
+	glBindBuffer(GL_TEXTURE_BUFFER, buffers[BUFFER_LIST]);
 		glBufferData(GL_TEXTURE_BUFFER,
-		             sizeof(GLint)*BUCKET_1D_MAX,
+		             sizeof(GLint)*MAX_PARTICLE_COUNT,
 		             NULL,
 		             GL_STATIC_DRAW);
-	glBindBuffer(GL_TEXTURE_BUFFER, buffers[BUFFER_LIST]);
+	glBindBuffer(GL_TEXTURE_BUFFER, buffers[BUFFER_SORTED]);
+		glBufferData(GL_TEXTURE_BUFFER,
+		             sizeof(GLint)*MAX_PARTICLE_COUNT,
+		             NULL,
+		             GL_STATIC_DRAW);
+	glBindBuffer(GL_TEXTURE_BUFFER, buffers[BUFFER_NEIGHBOURS]);
+		glBufferData(GL_TEXTURE_BUFFER,
+		             sizeof(GLint)*MAX_PARTICLE_COUNT*NEIGHBOUR_CAPACITY,
+		             NULL,
+		             GL_STATIC_DRAW);
+	glBindBuffer(GL_TEXTURE_BUFFER, buffers[BUFFER_NEIGHBOUR_COUNTS]);
 		glBufferData(GL_TEXTURE_BUFFER,
 		             sizeof(GLint)*MAX_PARTICLE_COUNT,
 		             NULL,
 		             GL_STATIC_DRAW);
+	glBindBuffer(GL_TEXTURE_BUFFER, buffers[BUFFER_NEIGHBOUR_REFS]);
+		glBufferData(GL_TEXTURE_BUFFER,
+		             sizeof(Vector4)*MAX_PARTICLE_COUNT,
+		             NULL,
+		             GL_STATIC_DRAW);
+	glBindBuffer(GL_TEXTURE_BUFFER, buffers[BUFFER_DISPLACEMENT]);
+		glBufferData(GL_TEXTURE_BUFFER,
+		             2*sizeof(GLint),
+		             NULL,
+		             GL_DYNAMIC_COPY);
+	glBindBuffer(GL_TEXTURE_BUFFER, buffers[BUFFER_DISPLACEMENT_READ]);
+		glBufferData(GL_TEXTURE_BUFFER,
+		             2*sizeof(GLint)*DISPLACEMENT_SLOTS,
+		             NULL,
+		             GL_STREAM_READ);
+	glBindBuffer(GL_TEXTURE_BUFFER, buffers[BUFFER_STEP_MAXIMA]);
+		glBufferData(GL_TEXTURE_BUFFER,
+		             sizeof(stepMaxima),
+		             stepMaxima,
+		             GL_DYNAMIC_COPY);
+	glBindBuffer(GL_TEXTURE_BUFFER, buffers[BUFFER_STEP_MAXIMA_READ]);
+		glBufferData(GL_TEXTURE_BUFFER,
+		             sizeof(stepMaxima)*STEP_MAXIMA_SLOTS,
+		             NULL,
+		             GL_STREAM_READ);
 	glBindBuffer(GL_TEXTURE_BUFFER, 0);
 
-//	std::cout << "BUCKET_1D_MAX " << BUCKET_1D_MAX << std::endl;
-
 	// textures
 	glActiveTexture(GL_TEXTURE0 + TEXTURE_HEAD);
 		glBindTexture(GL_TEXTURE_BUFFER, textures[TEXTURE_HEAD]);
@@ -681,6 +2454,54 @@ void on_init()
 		glBindTexture(GL_TEXTURE_BUFFER, textures[TEXTURE_LIST]);
 		glTexBuffer(GL_TEXTURE_BUFFER, GL_R32I, buffers[BUFFER_LIST]);
 
+	glActiveTexture(GL_TEXTURE0 + TEXTURE_SORTED);
+		glBindTexture(GL_TEXTURE_BUFFER, textures[TEXTURE_SORTED]);
+		glTexBuffer(GL_TEXTURE_BUFFER, GL_R32I, buffers[BUFFER_SORTED]);
+
+	glActiveTexture(GL_TEXTURE0 + TEXTURE_NEIGHBOURS);
+		glBindTexture(GL_TEXTURE_BUFFER, textures[TEXTURE_NEIGHBOURS]);
+		glTexBuffer(GL_TEXTURE_BUFFER, GL_R32I, buffers[BUFFER_NEIGHBOURS]);
+
+	glActiveTexture(GL_TEXTURE0 + TEXTURE_DISPLACEMENT);
+		glBindTexture(GL_TEXTURE_BUFFER, textures[TEXTURE_DISPLACEMENT]);
+		glTexBuffer(GL_TEXTURE_BUFFER, GL_R32I, buffers[BUFFER_DISPLACEMENT]);
+
+	glActiveTexture(GL_TEXTURE0 + TEXTURE_STEP_MAXIMA);
+		glBindTexture(GL_TEXTURE_BUFFER, textures[TEXTURE_STEP_MAXIMA]);
+		glTexBuffer(GL_TEXTURE_BUFFER, GL_R32I, buffers[BUFFER_STEP_MAXIMA]);
+
+	glActiveTexture(GL_TEXTURE0 + TEXTURE_CELL_BITS);
+		glBindTexture(GL_TEXTURE_BUFFER, textures[TEXTURE_CELL_BITS]);
+		glTexBuffer(GL_TEXTURE_BUFFER, GL_R32I, buffers[BUFFER_CELL_BITS]);
+
+	glActiveTexture(GL_TEXTURE0 + TEXTURE_ACTIVE_CELLS);
+		glBindTexture(GL_TEXTURE_BUFFER, textures[TEXTURE_ACTIVE_CELLS]);
+		glTexBuffer(GL_TEXTURE_BUFFER, GL_R32I, buffers[BUFFER_ACTIVE_CELLS]);
+
+	glActiveTexture(GL_TEXTURE0 + TEXTURE_CELL_SCAN_PING);
+		glBindTexture(GL_TEXTURE_BUFFER, textures[TEXTURE_CELL_SCAN_PING]);
+		glTexBuffer(GL_TEXTURE_BUFFER, GL_R32I, buffers[BUFFER_CELL_SCAN_PING]);
+
+	glActiveTexture(GL_TEXTURE0 + TEXTURE_CELL_SCAN_PONG);
+		glBindTexture(GL_TEXTURE_BUFFER, textures[TEXTURE_CELL_SCAN_PONG]);
+		glTexBuffer(GL_TEXTURE_BUFFER, GL_R32I, buffers[BUFFER_CELL_SCAN_PONG]);
+
+	glActiveTexture(GL_TEXTURE0 + TEXTURE_CELL_MORTON);
+		glBindTexture(GL_TEXTURE_BUFFER, textures[TEXTURE_CELL_MORTON]);
+		glTexBuffer(GL_TEXTURE_BUFFER, GL_R32I, buffers[BUFFER_CELL_MORTON]);
+
+	glActiveTexture(GL_TEXTURE0 + TEXTURE_NEIGHBOUR_COUNTS);
+		glBindTexture(GL_TEXTURE_BUFFER, textures[TEXTURE_NEIGHBOUR_COUNTS]);
+		glTexBuffer(GL_TEXTURE_BUFFER,
+		            GL_R32I,
+		            buffers[BUFFER_NEIGHBOUR_COUNTS]);
+
+	glActiveTexture(GL_TEXTURE0 + TEXTURE_NEIGHBOUR_REFS);
+		glBindTexture(GL_TEXTURE_BUFFER, textures[TEXTURE_NEIGHBOUR_REFS]);
+		glTexBuffer(GL_TEXTURE_BUFFER,
+		            GL_RGBA32F,
+		            buffers[BUFFER_NEIGHBOUR_REFS]);
+
 	glActiveTexture(GL_TEXTURE0 + TEXTURE_POS_DENSITIES_PING);
 		glBindTexture(GL_TEXTURE_BUFFER, textures[TEXTURE_POS_DENSITIES_PING]);
 		glTexBuffer(GL_TEXTURE_BUFFER,
@@ -721,6 +2542,54 @@ void on_init()
 	                   GL_READ_WRITE,
 	                   GL_R32I);
 
+	glBindImageTexture(TEXTURE_SORTED,
+	                   textures[TEXTURE_SORTED],
+	                   0,
+	                   GL_FALSE,
+	                   0,
+	                   GL_READ_WRITE,
+	                   GL_R32I);
+
+	glBindImageTexture(TEXTURE_NEIGHBOURS,
+	                   textures[TEXTURE_NEIGHBOURS],
+	                   0,
+	                   GL_FALSE,
+	                   0,
+	                   GL_READ_WRITE,
+	                   GL_R32I);
+
+	glBindImageTexture(TEXTURE_DISPLACEMENT,
+	                   textures[TEXTURE_DISPLACEMENT],
+	                   0,
+	                   GL_FALSE,
+	                   0,
+	                   GL_READ_WRITE,
+	                   GL_R32I);
+
+	glBindImageTexture(TEXTURE_STEP_MAXIMA,
+	                   textures[TEXTURE_STEP_MAXIMA],
+	                   0,
+	                   GL_FALSE,
+	                   0,
+	                   GL_READ_WRITE,
+	                   GL_R32I);
+
+	glBindImageTexture(TEXTURE_CELL_BITS,
+	                   textures[TEXTURE_CELL_BITS],
+	                   0,
+	                   GL_FALSE,
+	                   0,
+	                   GL_READ_WRITE,
+	                   GL_R32I);
+
+	glBindImageTexture(TEXTURE_ACTIVE_CELLS,
+	                   textures[TEXTURE_ACTIVE_CELLS],
+	                   0,
+	                   GL_FALSE,
+	                   0,
+	                   GL_READ_WRITE,
+	                   GL_R32I);
+
 	// configure vertex arrays
 	glBindVertexArray(vertexArrays[VERTEX_ARRAY_BUCKET]);
 		// empty !
@@ -754,43 +2623,6 @@ void on_init()
 	glBindVertexArray(0);
 
 	// configure programs
-	fw::build_glsl_program(programs[PROGRAM_DENSITY],
-	                       "sph_density.glsl",
-	                       "",
-	                       GL_FALSE);
-	const GLchar* varyings1[] = {"oData"};
-	glTransformFeedbackVaryings(programs[PROGRAM_DENSITY],
-	                            1,
-	                            varyings1,
-	                            GL_INTERLEAVED_ATTRIBS);
-	glLinkProgram(programs[PROGRAM_DENSITY]);
-
-	fw::build_glsl_program(programs[PROGRAM_BUCKET],
-	                       "sph_cell_init.glsl",
-	                       "",
-	                       GL_FALSE);
-	glTransformFeedbackVaryings(programs[PROGRAM_BUCKET],
-	                            1,
-	                            varyings1,
-	                            GL_INTERLEAVED_ATTRIBS);
-	glLinkProgram(programs[PROGRAM_BUCKET]);
-
-	fw::build_glsl_program(programs[PROGRAM_FORCE],
-	                       "sph_force.glsl",
-	                       "",
-	                       GL_FALSE);
-	const GLchar* varyings2[] = {"oData0", "oData1"};
-	glTransformFeedbackVaryings(programs[PROGRAM_FORCE],
-	                            2,
-	                            varyings2,
-	                            GL_SEPARATE_ATTRIBS);
-	glLinkProgram(programs[PROGRAM_FORCE]);
-
-	fw::build_glsl_program(programs[PROGRAM_GRID],
-	                       "sph_grid.glsl",
-	                       "",
-	                       GL_TRUE);
-
 	fw::build_glsl_program(programs[PROGRAM_FLUID_RENDER],
 	                       "sph_render.glsl",
 	                       "",
@@ -806,11 +2638,8 @@ void on_init()
 	                       "",
 	                       GL_TRUE);
 
-	// set constants
-	set_runtime_constant_uniforms();
-	set_sph_constants();
-	set_delta();
-	set_gravity_vector();
+	// build sph programs and set constants
+	build_sph_programs();
 
 	// set TF
 	set_transform_feedbacks();
@@ -845,6 +2674,7 @@ void on_clean()
 	glDeleteVertexArrays(VERTEX_ARRAY_COUNT, vertexArrays);
 	glDeleteTextures(TEXTURE_COUNT, textures);
 	glDeleteTransformFeedbacks(TRANSFORM_FEEDBACK_COUNT, transformFeedbacks);
+	glDeleteQueries(2*TASK_LOG_SLOTS*TASK_LOG_CAPACITY, taskQueries);
 	for(GLuint i=0; i<PROGRAM_COUNT;++i)
 		glDeleteProgram(programs[i]);
 
@@ -854,6 +2684,7 @@ void on_clean()
 	delete[] textures;
 	delete[] programs;
 	delete[] transformFeedbacks;
+	delete[] taskQueries;
 
 #ifdef _ANT_ENABLE
 	TwTerminate();
@@ -869,6 +2700,7 @@ void on_update()
 {
 	// Global variable
 	static fw::Timer deltaTimer;
+	static fw::Timer frameTimer; // time between the starts of two frames
 	GLint windowWidth  = glutGet(GLUT_WINDOW_WIDTH);
 	GLint windowHeight = glutGet(GLUT_WINDOW_HEIGHT);
 	float aspect = float(windowWidth)/float(windowHeight);
@@ -878,6 +2710,8 @@ void on_update()
 
 	// stop the timer during update
 	deltaTimer.Stop();
+	frameTimer.Stop();
+	begin_frame_tasks();
 
 #ifdef _ANT_ENABLE
 	// begin timing
@@ -934,45 +2768,48 @@ void on_update()
 		                        cellCount);
 	}
 
-	// build grid
-//	build_grid();
-//fw::Timer timer;
-//timer.Start();
-	init_sph_density();
-//timer.Stop();
-//std::cout << "time: " << timer.Ticks() << "s \n";
-
-	// update attributes
-	glEnable(GL_RASTERIZER_DISCARD);
-
-	glUseProgram(programs[PROGRAM_FORCE]);
-	glUniform1i(glGetUniformLocation(programs[PROGRAM_FORCE],
-	                                 "sData0"),
-	            TEXTURE_POS_DENSITIES_PING + sphPingPong);
-	glUniform1i(glGetUniformLocation(programs[PROGRAM_FORCE],
-	                                 "sData1"),
-	            TEXTURE_VELOCITIES_PING + sphPingPong);
-
-	glBindTransformFeedback( GL_TRANSFORM_FEEDBACK,
-		transformFeedbacks[TRANSFORM_FEEDBACK_PARTICLE_PING + sphPingPong]
-		);
-
-	glBindVertexArray(vertexArrays[VERTEX_ARRAY_FLUID_RENDER_PING+sphPingPong]);
-	glBeginTransformFeedback(GL_POINTS);
-		glDrawArrays(GL_POINTS, 0, particleCount);
-	glEndTransformFeedback();
-
-	// ping pong
-	sphPingPong = 1 - sphPingPong;
-
-	// restore state
-	glBindTransformFeedback(GL_TRANSFORM_FEEDBACK, 0);
-	glDisable(GL_RASTERIZER_DISCARD);
+	// show the latest state of the solver thread: it goes to the other
+	// buffers, the current ones may still be read by the previous frame
+	if(solverThread)
+	{
+		if(solverStates.Acquire())
+		{
+			begin_frame_task(TASK_RENDER);
+			sphPingPong = 1 - sphPingPong;
+			upload_sph_particles(solverStates.Front());
+			end_frame_task(TASK_RENDER);
+		}
+	}
+	else
+	{
+		// pick dt (once per frame, the maxima are a few steps old anyway)
+		if(adaptiveDeltaT)
+			update_sph_delta();
+		if(neighbourLists)
+			grow_sph_neighbours();
+
+		// run the steps of the frame back to back
+		GLuint stepCount = get_sph_frame_step_count(frameTimer.Ticks());
+		frameTimer.Start();
+		for(GLuint i=0; i<stepCount; ++i)
+			step_sph();
+
+		// read back the maxima of the next dt (over all the steps of the frame)
+		if(adaptiveDeltaT && stepCount > 0)
+		{
+			begin_frame_task(TASK_STATS);
+			read_sph_step_maxima();
+			end_frame_task(TASK_STATS);
+		}
+	}
 
 	// render particles
+	begin_frame_task(TASK_RENDER);
 	glUseProgram(programs[PROGRAM_FLUID_RENDER]);
 	glBindVertexArray(vertexArrays[VERTEX_ARRAY_FLUID_RENDER_PING + sphPingPong]);
 	glDrawArrays(GL_POINTS, 0, particleCount);
+	end_frame_task(TASK_RENDER);
+	end_frame_tasks();
 
 	// back to default vertex array
 	glBindVertexArray(0);
@@ -1045,6 +2882,60 @@ void on_key_down(GLubyte key, GLint x, GLint y)
 	{
 		++smoothingLength;
 		set_sph_constants();
+		set_transform_feedbacks();
+	}
+	if(key=='g')
+	{
+		gridMode = sph::GridMode((gridMode + 1) % sph::GRID_MODE_COUNT);
+		build_sph_programs();
+		std::cout << "grid mode: " << sph::grid_mode_name(gridMode)
+		          << std::endl;
+	}
+	if(key=='h')
+	{
+		cellIndexMode = sph::CellIndexMode((cellIndexMode + 1)
+		                                   % sph::CELL_INDEX_COUNT);
+		build_sph_programs();
+		set_transform_feedbacks();
+		std::cout << "cell index: " << sph::cell_index_name(cellIndexMode)
+		          << " (" << cellCount << " cells)" << std::endl;
+	}
+	if(key=='o')
+	{
+		searchMode = sph::SearchMode((searchMode + 1) % sph::SEARCH_MODE_COUNT);
+		build_sph_programs();
+		set_transform_feedbacks();
+		std::cout << "search: " << sph::search_mode_name(searchMode)
+		          << " cells (" << cellCount << " cells)" << std::endl;
+	}
+	if(key=='e')
+	{
+		occupancy = !occupancy;
+		build_sph_programs();
+		std::cout << "occupancy: " << (occupancy ? "on" : "off")
+		          << std::endl;
+	}
+	if(key=='t')
+	{
+		adaptiveDeltaT = !adaptiveDeltaT;
+		build_sph_programs();
+		std::cout << "adaptive dt: " << (adaptiveDeltaT ? "on" : "off")
+		          << " (max " << deltaT << ")" << std::endl;
+	}
+	if(key=='n')
+	{
+		neighbourLists = !neighbourLists;
+		build_sph_programs();
+		std::cout << "neighbour lists: " << (neighbourLists ? "on" : "off")
+		          << " (" << neighbourListBuildCount << " builds)"
+		          << std::endl;
+	}
+	if(key=='u')
+	{
+		pairCapacity = pairCapacity > 0 ? 0 : NEIGHBOUR_CAPACITY;
+		build_sph_programs();
+		std::cout << "pair reuse: " << (pairCapacity > 0 ? "on" : "off")
+		          << std::endl;
 	}
 	if(key=='b')
 		renderBucket = !renderBucket;
@@ -1119,6 +3010,26 @@ void on_mouse_wheel(GLint wheel, GLint direction, GLint x, GLint y)
 }
 
 
+////////////////////////////////////////////////////////////////////////////////
+// run the demo (on_init and the main loop)
+int run_demo()
+{
+	try
+	{
+		// run demo
+		on_init();
+		glutMainLoop();
+	}
+	catch(std::exception& e)
+	{
+		std::cerr << "Fatal exception: " << e.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
+
+
 ////////////////////////////////////////////////////////////////////////////////
 // Main
 //
@@ -1127,6 +3038,88 @@ int main(int argc, char** argv)
 {
 	const GLuint CONTEXT_MAJOR = 4;
 	const GLuint CONTEXT_MINOR = 1;
+	GLuint cpuStepCount = 0; // run on the cpu if non zero
+
+	// parse options
+	for(int i=1; i<argc; ++i)
+	{
+		const bool VALUE = i+1 < argc; // the option has a value
+		if(VALUE && 0 == strcmp(argv[i], "--cpu"))
+			cpuStepCount = atoi(argv[++i]);
+		else if(VALUE && 0 == strcmp(argv[i], "--particles"))
+			particleCount = std::min(GLuint(atoi(argv[++i])),
+			                         MAX_PARTICLE_COUNT);
+		else if(VALUE && 0 == strcmp(argv[i], "--grid"))
+			gridMode = sph::grid_mode_from_name(argv[++i]);
+		else if(VALUE && 0 == strcmp(argv[i], "--incremental-grid"))
+			maxMovedFraction = std::max(GLfloat(atof(argv[++i])), 0.0f);
+		else if(VALUE && 0 == strcmp(argv[i], "--cells"))
+			cellIndexMode = sph::cell_index_from_name(argv[++i]);
+		else if(VALUE && 0 == strcmp(argv[i], "--search"))
+			searchMode = sph::search_mode_from_name(argv[++i]);
+		else if(0 == strcmp(argv[i], "--occupancy"))
+			occupancy = true;
+		else if(VALUE && 0 == strcmp(argv[i], "--simd"))
+			simdIsa = sph::simd_isa_from_name(argv[++i]);
+		else if(VALUE && 0 == strcmp(argv[i], "--pairs"))
+			pairMode = sph::pair_mode_from_name(argv[++i]);
+		else if(VALUE && 0 == strcmp(argv[i], "--schedule"))
+			scheduleMode = sph::schedule_mode_from_name(argv[++i]);
+		else if(VALUE && 0 == strcmp(argv[i], "--reorder"))
+			reorderFrequency = atoi(argv[++i]);
+		else if(VALUE && 0 == strcmp(argv[i], "--levels"))
+			timeLevels = std::max(atoi(argv[++i]), 1);
+		else if(VALUE && 0 == strcmp(argv[i], "--solver"))
+			solverMode = sph::solver_mode_from_name(argv[++i]);
+		else if(VALUE && 0 == strcmp(argv[i], "--tolerance"))
+			pressureTolerance = std::max(GLfloat(atof(argv[++i])), 0.0f);
+		else if(VALUE && 0 == strcmp(argv[i], "--pbf-iterations"))
+			pbfIterations = std::max(atoi(argv[++i]), 1);
+		else if(VALUE && 0 == strcmp(argv[i], "--rest-density"))
+			restDensity = std::max(GLfloat(atof(argv[++i])), 0.001f);
+		else if(VALUE && 0 == strcmp(argv[i], "--fused-density"))
+			densityFrequency = atoi(argv[++i]);
+		else if(VALUE && 0 == strcmp(argv[i], "--time-scale"))
+			timeScale = std::max(GLfloat(atof(argv[++i])), 0.0f);
+		else if(VALUE && 0 == strcmp(argv[i], "--frame-steps"))
+			maxFrameSteps = std::max(atoi(argv[++i]), 1);
+		else if(VALUE && 0 == strcmp(argv[i], "--task-log"))
+			taskLogFrequency = atoi(argv[++i]);
+		else if(VALUE && 0 == strcmp(argv[i], "--solver-thread"))
+		{
+			solverThread      = true;
+			solverThreadCount = std::max(atoi(argv[++i]), 0);
+		}
+		else if(VALUE && 0 == strcmp(argv[i], "--adaptive"))
+		{
+			adaptiveDeltaT = true;
+			deltaT         = std::max(GLfloat(atof(argv[++i])), 0.0f);
+		}
+		else if(VALUE && 0 == strcmp(argv[i], "--neighbours"))
+		{
+			neighbourLists = true;
+			neighbourSkin  = std::max(GLfloat(atof(argv[++i])), 0.0f);
+		}
+		else if(0 == strcmp(argv[i], "--compressed-lists"))
+			compressedLists = true;
+		else if(VALUE && 0 == strcmp(argv[i], "--pair-reuse"))
+			pairCapacity = std::max(atoi(argv[++i]), 0);
+	}
+
+	// headless run
+	if(cpuStepCount > 0)
+		return run_cpu_solver(cpuStepCount);
+
+	// the gpu steps with the equation of state or pbf only
+	if(!solverThread
+	&& sph::SOLVER_MODE_WCSPH != solverMode
+	&& sph::SOLVER_MODE_PBF != solverMode)
+	{
+		std::cerr << "solver " << sph::solver_mode_name(solverMode)
+		          << " runs on the cpu only (--cpu or --solver-thread),"
+		          << " the gpu falls back to wcsph" << std::endl;
+		solverMode = sph::SOLVER_MODE_WCSPH;
+	}
 
 	// init glut
 	glutInit(&argc, argv);
@@ -1172,18 +3165,43 @@ int main(int argc, char** argv)
 	glutMouseWheelFunc(&on_mouse_wheel);
 
 	// run
-	try
-	{
-		// run demo
-		on_init();
-		glutMainLoop();
-	}
-	catch(std::exception& e)
+	if(!solverThread)
+		return run_demo();
+
+	// run with the solver on a second thread (the render thread keeps the
+	// GL context), until the window is closed
+	int status = 0;
+	glutSetOption(GLUT_ACTION_ON_WINDOW_CLOSE,
+	              GLUT_ACTION_GLUTMAINLOOP_RETURNS);
+#ifdef _OPENMP
+	omp_set_max_active_levels(2); // the solver runs its own parallel passes
+#endif
+#pragma omp parallel num_threads(2)
 	{
-		std::cerr << "Fatal exception: " << e.what() << std::endl;
-		return 1;
+#ifdef _OPENMP
+		const int THREAD = omp_get_thread_num();
+		const int THREADS = omp_get_num_threads();
+#else
+		const int THREAD = 0, THREADS = 1;
+#endif
+		if(0 == THREAD)
+		{
+			if(THREADS < 2)
+			{
+				std::cerr << "no solver thread, stepping on the GPU"
+				          << std::endl;
+				solverThread = false;
+			}
+			status = run_demo();
+			solverStates.Close();
+		}
+		else
+			run_solver_thread();
 	}
 
-	return 0;
+	std::cout << "solver thread: " << solverStates.PublishCount()
+	          << " steps, " << solverStates.AcquireCount()
+	          << " displayed" << std::endl;
+	return status;
 }
 
@@ -20,6 +20,13 @@ solution "OpenGL"
 		}
 		objdir "obj"
 
+-- OpenMP (multithreaded CPU solver)
+		configuration {"gmake"}
+			buildoptions {"-fopenmp"}
+			linkoptions {"-fopenmp"}
+		configuration {"vs2010"}
+			buildoptions {"/openmp"}
+
 -- Debug configurations
 		configuration {"debug"}
 			defines {"DEBUG"}
@@ -4,6 +4,10 @@ uniform float uBucketCellSize; // size of a cell
 uniform ivec2 uBucket3dSize;   // size of the 3d bucket
 uniform vec3  uBucketBoundsMin;
 uniform mat4  uModelViewProjection;
+uniform bool  uActiveCells;    // only draw the non-empty cells (occupancy)
+
+uniform isamplerBuffer sCellBits;    // number of non-empty cells first
+uniform isamplerBuffer sActiveCells; // non-empty cells
 
 #ifdef _VERTEX_
 
@@ -11,10 +15,20 @@ layout(location=0) in vec4 iPosition;
 
 void main()
 {
+	// cell of the instance (instances past the non-empty cells are clipped)
+	int cell = gl_InstanceID;
+	if(uActiveCells) {
+		if(gl_InstanceID >= texelFetch(sCellBits, 0).r) {
+			gl_Position = vec4(2.0, 2.0, 2.0, 1.0);
+			return;
+		}
+		cell = texelFetch(sActiveCells, gl_InstanceID).r;
+	}
+
 	// compute 3d cell pos
-	vec3 bucket = vec3(gl_InstanceID % uBucket3dSize.x,
-	                   gl_InstanceID / uBucket3dSize.y % uBucket3dSize.y,
-	                   gl_InstanceID / (uBucket3dSize.x*uBucket3dSize.y));
+	vec3 bucket = vec3(cell % uBucket3dSize.x,
+	                   cell / uBucket3dSize.x % uBucket3dSize.y,
+	                   cell / (uBucket3dSize.x*uBucket3dSize.y));
 
 	// world position
 	vec3 world = uBucketCellSize*(iPosition.xyz+bucket)
@@ -1,12 +1,17 @@
 #version 420 core
 
+// value of empty cells (-1 for linked lists, 0 for counts)
+#ifndef _CELL_INIT_VALUE
+#	define _CELL_INIT_VALUE -1
+#endif
+
 #ifdef _VERTEX_
 
 layout(location=0) out ivec4 oData;
 
 void main()
 {
-	oData = ivec4(-1);
+	oData = ivec4(_CELL_INIT_VALUE);
 }
 
 #endif // _VERTEX_
@@ -0,0 +1,22 @@
+#version 420 core
+
+// samplers
+uniform isamplerBuffer sCellData; // cell counts or partial sums
+
+// uniforms
+uniform int uOffset; // distance to the summed cell
+
+#ifdef _VERTEX_
+
+layout(location=0) out int oData;
+
+// one pass of an inclusive prefix sum (Hillis-Steele)
+void main()
+{
+	oData = texelFetch(sCellData, gl_VertexID).r;
+	if(gl_VertexID >= uOffset)
+		oData+= texelFetch(sCellData, gl_VertexID - uOffset).r;
+}
+
+#endif // _VERTEX_
+
@@ -3,9 +3,26 @@
 // images
 layout(r32i) readonly uniform iimageBuffer imgHead;
 layout(r32i) readonly uniform iimageBuffer imgList;
+#ifdef _SORTED_GRID
+layout(r32i) readonly uniform iimageBuffer imgSorted;
+#endif
+#ifdef _OCCUPANCY
+layout(r32i) readonly uniform iimageBuffer imgCellBits; // a bit per cell
+#endif
+#ifdef _NEIGHBOUR_LIST
+layout(r32i) readonly uniform iimageBuffer imgNeighbours;
+#elif defined _PAIR_REUSE
+layout(r32i) writeonly uniform iimageBuffer imgNeighbours; // pairs within h
+#endif
 
 // samplers
 uniform samplerBuffer sParticlePos;
+#ifdef _SORTED_GRID
+uniform isamplerBuffer sCellEnds; // inclusive prefix sum of the cell counts
+#endif
+#ifdef _NEIGHBOUR_LIST
+uniform isamplerBuffer sNeighbourCounts; // sizes of the neighbour lists
+#endif
 //uniform isamplerBuffer imgHead;
 //uniform isamplerBuffer imgList;
 
@@ -13,13 +30,23 @@ uniform samplerBuffer sParticlePos;
 uniform vec3  uBucket1dCoeffs;    // for conversion from bucket 3d to bucket 1d
 uniform vec3  uBucketBoundsMin;   // constant
 uniform float uBucketCellSize;    // dimensions of the bucket
+#ifdef _HASHED_GRID
+uniform ivec3 uBucketMask;        // hashed grid size - 1 (cells wrap around)
+#elif defined _OCTANT_SEARCH
+uniform int   uCellStencil[64];   // offsets of the cells of each octant
+#else
+uniform int   uCellStencil[27];   // offsets of the cells around a cell
+#endif
 uniform float uSmoothingLengthSquared;
 uniform float uDensityConstants;
 
 #ifdef _VERTEX_
 
-layout(location=0) in  vec4 iData;  // position + reserved
-layout(location=0) out vec4 oData;  // position + density
+layout(location=0) in  vec4 iData;      // position + reserved
+layout(location=1) in  vec4 iVelocity;  // velocity + reserved
+layout(location=0) out vec4 oData;      // position + density
+layout(location=1) out vec4 oVelocity;  // velocity + reserved (copy), or
+                                        // pairs recorded (-1: overflow)
 
 // evaluate density
 float eval_density(float h2, vec3 ri, vec3 rj)
@@ -29,92 +56,109 @@ float eval_density(float h2, vec3 ri, vec3 rj)
 	return (step(0.0, dist2) * pow(dist2, 3.0));
 }
 
-#if 0
-
 void main()
 {
-	// positions
-	oData = vec4(iData.xyz,0.0);
+	// positions and velocities
+	oData     = vec4(iData.xyz,0.0);
+	oVelocity = iVelocity;
+
+#if defined _NEIGHBOUR_LIST
+	// the neighbour list replaces the 27 cells
+	const int cellCount = 1;
+#elif defined _OCTANT_SEARCH
+	// cells of 2h: the cell of the particle and its neighbours on the side of
+	// the half it lies in, along each axis
+	const int cellCount = 8;
 
 	// 3d bucket texture (in [0,D]x[0,W]x[0,H])
 	vec3 relPos   = iData.xyz - uBucketBoundsMin;
-	vec3 bucket3d = floor(relPos / (uBucketCellSize * 2.0));
-	vec3 b3d2     = mod(floor(relPos / uBucketCellSize), 2.0)*2.0-1.0;
+	vec3 bucket3d = floor(relPos / uBucketCellSize);
+	vec3 side     = mod(floor(2.0 * relPos / uBucketCellSize), 2.0)*2.0-1.0;
 
-	// 1d bucket positions of cells
+#ifdef _HASHED_GRID
+	// 1d bucket positions of cells (coordinates wrap around)
 	int buckets1d[8];
 	for(int i=0; i<2; ++i)
 	for(int j=0; j<2; ++j)
 	for(int k=0; k<2; ++k)
-		buckets1d[i+2*j+4*k] = int(dot(bucket3d + b3d2*vec3(i,j,k),
-		                               uBucket1dCoeffs));
-
-	// loop through neighbour particles
-	int iter   = 0;    // iterator
-	int offset = 0;    // texture offset
-	vec3 neighbourPos; // neighbour position
-	while(iter<8)
-	{
-		// get offset
-		offset = imageLoad(imgHead, buckets1d[iter]).r;
-//		offset = texelFetch(imgHead, buckets1d[iter]).r;
-		offset = 0;
-//		while(offset != -1)
-		while(offset < 10)
-		{
-			// get stored particle position
-			neighbourPos = texelFetch(sParticlePos, offset).rgb;
-
-			// add contribution
-			if(offset != gl_VertexID)
-				oData.w += eval_density(uSmoothingLengthSquared,
-				                        iData.xyz,
-				                        neighbourPos);
-
-			// next offset
-//			offset = imageLoad(imgList, offset).r;
-//			offset = texelFetch(imgList, offset).r;
-			++offset;
-		}
-		++iter;
-	}
-
-	// mutliply sum by constants
-	oData.w *= uDensityConstants;
-}
-
+		buckets1d[i+2*j+4*k]
+			= int(dot(vec3(ivec3(bucket3d + side*vec3(i,j,k)) & uBucketMask),
+			          uBucket1dCoeffs));
 #else
-
-void main()
-{
-	// positions
-	oData = vec4(iData.xyz,0.0);
+	// 1d bucket position of the cell, and stencil of its octant (see
+	// get_cell_stencil in SphSolver.cpp)
+	int bucket1d = int(dot(bucket3d, uBucket1dCoeffs));
+	int stencil  = 8 * int(dot(step(0.0, side), vec3(1,2,4)));
+#endif
+#else
+	const int cellCount = 27;
 
 	// 3d bucket texture (in [0,D]x[0,W]x[0,H])
 	vec3 relPos   = iData.xyz - uBucketBoundsMin;
 	vec3 bucket3d = floor(relPos / uBucketCellSize);
 
-	// 1d bucket positions of cells
+#ifdef _HASHED_GRID
+	// 1d bucket positions of cells (coordinates wrap around)
 	int buckets1d[27];
 	for(int i=-1; i<2; ++i)
 	for(int j=-1; j<2; ++j)
 	for(int k=-1; k<2; ++k)
-		buckets1d[i+1+3*(j+1)+9*(k+1)] = int(dot(bucket3d + vec3(i,j,k),
-		                                         uBucket1dCoeffs));
+		buckets1d[i+1+3*(j+1)+9*(k+1)]
+			= int(dot(vec3((ivec3(bucket3d) + ivec3(i,j,k)) & uBucketMask),
+			          uBucket1dCoeffs));
+#else
+	// 1d bucket position of the cell (the stencil gives the others)
+	int bucket1d = int(dot(bucket3d, uBucket1dCoeffs));
+	const int stencil = 0;
+#endif
+#endif
 
 	// loop through neighbour particles
 	int iter   = 0;    // iterator
 	int offset = 0;    // texture offset
 	vec3 neighbourPos; // neighbour position
-	while(iter<27)
+#ifdef _PAIR_REUSE
+	int pairCount = 0; // neighbours within h (replayed by the force pass)
+#endif
+	while(iter<cellCount)
 	{
+#if defined _HASHED_GRID && !defined _NEIGHBOUR_LIST
+		int cell = buckets1d[iter];
+#elif !defined _NEIGHBOUR_LIST
+		int cell = bucket1d + uCellStencil[stencil + iter];
+#endif
+#ifdef _OCCUPANCY
+		// skip empty cells (the bits start at word 1)
+		if(0 == (imageLoad(imgCellBits, 1 + (cell >> 5)).r
+		         & (1 << (cell & 31))))
+		{
+			++iter;
+			continue;
+		}
+#endif
+#if defined _NEIGHBOUR_LIST
+		// get range of the list
+		int slot    = gl_VertexID * _NEIGHBOUR_CAPACITY;
+		int slotEnd = slot + texelFetch(sNeighbourCounts, gl_VertexID).r;
+		while(slot != slotEnd)
+		{
+			offset = imageLoad(imgNeighbours, slot++).r;
+#elif defined _SORTED_GRID
+		// get range of the cell
+		int slotEnd = texelFetch(sCellEnds, cell).r;
+		int slot    = slotEnd - imageLoad(imgHead, cell).r;
+		while(slot != slotEnd)
+		{
+			offset = imageLoad(imgSorted, slot++).r;
+#else
 		// get offset
-		offset = imageLoad(imgHead, buckets1d[iter]).r;
-//		offset = texelFetch(imgHead, buckets1d[iter]).r;
+		offset = imageLoad(imgHead, cell).r;
+//		offset = texelFetch(imgHead, cell).r;
 //		offset = 0;
 		while(offset != -1)
 //		while(offset < 10)
 		{
+#endif
 			// get stored particle position
 			neighbourPos = texelFetch(sParticlePos, offset).rgb;
 
@@ -123,20 +167,37 @@ void main()
 				oData.w += eval_density(uSmoothingLengthSquared,
 				                        iData.xyz,
 				                        neighbourPos);
+#ifdef _PAIR_REUSE
+			// record the pair (the force pass ignores the others)
+			vec3 rij = iData.xyz - neighbourPos;
+			float r2 = dot(rij,rij);
+			if(offset != gl_VertexID && r2 < uSmoothingLengthSquared
+			&& r2 > 0.0) {
+				if(pairCount < _NEIGHBOUR_CAPACITY)
+					imageStore(imgNeighbours,
+					           gl_VertexID * _NEIGHBOUR_CAPACITY + pairCount,
+					           ivec4(offset));
+				++pairCount;
+			}
+#endif
 
 //			++offset;
 
+#if !defined _SORTED_GRID && !defined _NEIGHBOUR_LIST
 			// next offset
 			offset = imageLoad(imgList, offset).r;
 //			offset = texelFetch(imgList, offset).r;
+#endif
 		}
 		++iter;
 	}
 
 	// mutliply sum by constants
 	oData.w *= uDensityConstants;
-}
+#ifdef _PAIR_REUSE
+	oVelocity.w = pairCount > _NEIGHBOUR_CAPACITY ? -1.0 : float(pairCount);
 #endif
+}
 
 #endif // _VERTEX_
 
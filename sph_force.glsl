@@ -3,15 +3,46 @@
 // images
 layout(r32i) readonly uniform iimageBuffer imgHead;
 layout(r32i) readonly uniform iimageBuffer imgList;
+#ifdef _SORTED_GRID
+layout(r32i) readonly uniform iimageBuffer imgSorted;
+#endif
+#ifdef _OCCUPANCY
+layout(r32i) readonly uniform iimageBuffer imgCellBits; // a bit per cell
+#endif
+#ifdef _NEIGHBOUR_LIST
+layout(r32i) readonly uniform iimageBuffer imgNeighbours;
+layout(r32i) coherent uniform iimageBuffer imgDisplacement; // max squared
+                                                            // displacement
+#elif defined _PAIR_REUSE
+layout(r32i) readonly uniform iimageBuffer imgNeighbours; // pairs within h
+#endif
+#ifdef _ADAPTIVE_TIME_STEP
+layout(r32i) coherent uniform iimageBuffer imgStepMaxima; // max speed and
+                                                          // |acceleration|
+#endif
 
 // samplers
 uniform samplerBuffer sData0; // pos + density
 uniform samplerBuffer sData1; // velocity
+#ifdef _SORTED_GRID
+uniform isamplerBuffer sCellEnds; // inclusive prefix sum of the cell counts
+#endif
+#ifdef _NEIGHBOUR_LIST
+uniform isamplerBuffer sNeighbourCounts; // sizes of the neighbour lists
+uniform samplerBuffer  sNeighbourRefs;   // positions at list build
+#endif
 
 // uniforms
 uniform vec3  uBucket1dCoeffs;     // for conversion from bucket 3d to bucket 1d
 uniform vec3  uBucketBoundsMin;    // constant
 uniform float uBucketCellSize;     // dimensions of the bucket
+#ifdef _HASHED_GRID
+uniform ivec3 uBucketMask;         // hashed grid size - 1 (cells wrap around)
+#elif defined _OCTANT_SEARCH
+uniform int   uCellStencil[64];    // offsets of the cells of each octant
+#else
+uniform int   uCellStencil[27];    // offsets of the cells around a cell
+#endif
 
 uniform float uSmoothingLength;        // h
 uniform float uSmoothingLengthSquared; // h2
@@ -37,11 +68,11 @@ float pressure(float k, float d, float d0) {
 	return k * (d - d0);
 }
 
-//// poly 
-//vec3 poly6_coeffs(float h2, vec3 rij) {
-////	return rij * pow(vec3(max(h2 - dot(rij,rij),0.0)), vec3(2.0)); 
-//	return rij * pow(max(h2-dot(rij,rij),0.0), 2.0);
-//}
+// compute poly6 kernel gradient variables
+vec3 poly6_coeffs(float h2, vec3 rij) {
+//	return rij * pow(vec3(max(h2 - dot(rij,rij),0.0)), vec3(2.0)); 
+	return rij * pow(max(h2-dot(rij,rij),0.0), 2.0);
+}
 
 // compute spiky kernel gradient variables
 vec3 spiky_coeffs(float h, vec3 rij, float r) {
@@ -54,67 +85,154 @@ float viscosity_coeffs(float h, float r) {
 	return max(h-r, 0.0);
 }
 
+// add the contribution of neighbour j
+void sph_pair(in int offset,
+              in vec3 ri,
+              in float di,
+              in vec3 vi,
+              inout vec3 fPressure,
+              inout vec3 fViscosity,
+              inout float densityRate) {
+	// get neighbour attributes
+	vec3 rj  = texelFetch(sData0, offset).rgb;
+	float dj = texelFetch(sData0, offset).a;
+	vec3 vj  = texelFetch(sData1, offset).rgb;
+
+	// compute rij and vij
+	vec3 rij = ri - rj;
+	vec3 vij = vj - vi;
+
+	// precompute variables
+	float r = length(rij);
+	float invDj = 1.0/dj;
+
+#ifdef _FUSED_DENSITY
+	// evaluate density rate (continuity equation)
+	densityRate -= dot(vij,poly6_coeffs(uSmoothingLengthSquared, rij));
+#endif
+
+	// evaluate pressure
+	fPressure  += ( pressure(uK, di, uRestDensity)
+	              + pressure(uK, dj, uRestDensity) ) * invDj
+	            * spiky_coeffs(uSmoothingLength,
+	                           rij,
+	                           r);
+
+	// evaluate viscosity
+	fViscosity += vij * invDj
+	            * viscosity_coeffs(uSmoothingLength, r);
+}
+
 void sph_forces(in vec3 ri,
                 in float di,
                 in vec3 vi,
+                in int pairCount, // pairs of the density pass (-1: none)
                 out vec3 fPressure,
-                out vec3 fViscosity) {
+                out vec3 fViscosity,
+                out float densityRate) {
 	// variables
-	int buckets1d[27];
+#if defined _NEIGHBOUR_LIST
+	const int cellCount = 1; // the neighbour list replaces the 27 cells
+#elif defined _OCTANT_SEARCH
+	const int cellCount = 8; // cells of 2h (see sph_density.glsl)
+#else
+	const int cellCount = 27;
+#endif
 	int iter    = 0;     // iterator
 	int offset  = 0;     // texture offset
 	float invDi = 1.0/di;
 	fPressure  = vec3(0.0);
 	fViscosity = vec3(0.0);
-//	density    = 0.0; 
+	densityRate = 0.0;
 
+#ifndef _NEIGHBOUR_LIST
 	// 3d bucket texture (in [0,D]x[0,W]x[0,H])
 	vec3 relPos    = ri - uBucketBoundsMin;
 	vec3 bucket3d  = floor(relPos / uBucketCellSize);
 
-	// compute 1d bucket positions of neighbour cells
+	// compute 1d bucket positions of neighbour cells (on a dense grid, the
+	// cell and its stencil, see get_cell_stencil in SphSolver.cpp)
+#ifdef _OCTANT_SEARCH
+	vec3 side = mod(floor(2.0 * relPos / uBucketCellSize), 2.0)*2.0-1.0;
+#ifdef _HASHED_GRID
+	int buckets1d[8];
+	for(int i=0; i<2; ++i)
+	for(int j=0; j<2; ++j)
+	for(int k=0; k<2; ++k)
+		buckets1d[i+2*j+4*k]
+			= int(dot(vec3(ivec3(bucket3d + side*vec3(i,j,k)) & uBucketMask),
+			          uBucket1dCoeffs));
+#else
+	int bucket1d = int(dot(bucket3d, uBucket1dCoeffs));
+	int stencil  = 8 * int(dot(step(0.0, side), vec3(1,2,4)));
+#endif
+#else
+#ifdef _HASHED_GRID
+	int buckets1d[27];
 	for(int i=-1; i<2; ++i)
 	for(int j=-1; j<2; ++j)
 	for(int k=-1; k<2; ++k)
-		buckets1d[i+1+3*(j+1)+9*(k+1)] = int(dot(bucket3d + vec3(i,j,k),
-		                                         uBucket1dCoeffs));
+		buckets1d[i+1+3*(j+1)+9*(k+1)]
+			= int(dot(vec3((ivec3(bucket3d) + ivec3(i,j,k)) & uBucketMask),
+			          uBucket1dCoeffs));
+#else
+	int bucket1d = int(dot(bucket3d, uBucket1dCoeffs));
+	const int stencil = 0;
+#endif
+#endif
+#endif
+
+#ifdef _PAIR_REUSE
+	// replay the pairs recorded by the density pass (the cells are searched
+	// if they did not fit)
+	if(pairCount >= 0) {
+		int slot = gl_VertexID * _NEIGHBOUR_CAPACITY;
+		for(int p=0; p<pairCount; ++p)
+			sph_pair(imageLoad(imgNeighbours, slot + p).r, ri, di, vi,
+			         fPressure, fViscosity, densityRate);
+		iter = cellCount;
+	}
+#endif
 
 	// loop through neighbours
-	while(iter<27) {
+	while(iter<cellCount) {
+#if defined _HASHED_GRID && !defined _NEIGHBOUR_LIST
+		int cell = buckets1d[iter];
+#elif !defined _NEIGHBOUR_LIST
+		int cell = bucket1d + uCellStencil[stencil + iter];
+#endif
+#ifdef _OCCUPANCY
+		// skip empty cells (the bits start at word 1)
+		if(0 == (imageLoad(imgCellBits, 1 + (cell >> 5)).r
+		         & (1 << (cell & 31)))) {
+			++iter;
+			continue;
+		}
+#endif
+#if defined _NEIGHBOUR_LIST
+		// get range of the list
+		int slot    = gl_VertexID * _NEIGHBOUR_CAPACITY;
+		int slotEnd = slot + texelFetch(sNeighbourCounts, gl_VertexID).r;
+		while(slot != slotEnd) {
+			offset = imageLoad(imgNeighbours, slot++).r;
+#elif defined _SORTED_GRID
+		// get range of the cell
+		int slotEnd = texelFetch(sCellEnds, cell).r;
+		int slot    = slotEnd - imageLoad(imgHead, cell).r;
+		while(slot != slotEnd) {
+			offset = imageLoad(imgSorted, slot++).r;
+#else
 		// get offset
-		offset = imageLoad(imgHead, buckets1d[iter]).r;
+		offset = imageLoad(imgHead, cell).r;
 		while(offset != -1) {
-			if(offset != gl_VertexID) { 
-				// get neighbour attributes
-				vec3 rj  = texelFetch(sData0, offset).rgb;
-				float dj = texelFetch(sData0, offset).a;
-				vec3 vj  = texelFetch(sData1, offset).rgb;
-
-				// compute rij and vij
-				vec3 rij = ri - rj;
-				vec3 vij = vj - vi;
-
-				// precompute variables
-				float r = length(rij);
-				float invDj = 1.0/dj;
-
-//				// evaluate density
-//				density    -= dot(vij,poly6_coeffs(uSmoothingLengthSquared,
-//				                                   rij));
-
-				// evaluate pressure
-				fPressure  += ( pressure(uK, di, uRestDensity)
-				              + pressure(uK, dj, uRestDensity) ) * invDj
-				            * spiky_coeffs(uSmoothingLength,
-				                           rij,
-				                           r);
-
-				// evaluate viscosity
-				fViscosity += vij * invDj
-				            * viscosity_coeffs(uSmoothingLength, r);
-			}
+#endif
+			if(offset != gl_VertexID)
+				sph_pair(offset, ri, di, vi,
+				         fPressure, fViscosity, densityRate);
+#if !defined _SORTED_GRID && !defined _NEIGHBOUR_LIST
 			// get next offset (if any)
 			offset = imageLoad(imgList, offset).r;
+#endif
 		}
 		++iter;
 	}
@@ -122,7 +240,7 @@ void sph_forces(in vec3 ri,
 	// multiply results by constants
 	fPressure  *= (uPressureConstants * invDi);
 	fViscosity *= (uViscosityConstants * invDi);
-//	density    *= uDensityConstants;
+	densityRate *= uDensityConstants;
 }
 
 
@@ -168,9 +286,21 @@ void main()
 	// variables
 	vec3 acceleration;
 	vec3 fPressure, fViscosity, fBoundary, fGravity;
+	float densityRate;
+#ifdef _PAIR_REUSE
+	int pairCount = int(iData1.w); // written by the density pass
+#else
+	const int pairCount = -1;
+#endif
 
 	// compute forces
-	sph_forces(iPosition, iDensity, iVelocity, fPressure, fViscosity);
+	sph_forces(iPosition,
+	           iDensity,
+	           iVelocity,
+	           pairCount,
+	           fPressure,
+	           fViscosity,
+	           densityRate);
 	fBoundary = boundary_force(iPosition, iVelocity);
 	fGravity  = gravity_force();
 
@@ -179,7 +309,14 @@ void main()
 	             / uParticleMass;
 
 	// set attributes
-	oDensity  = iDensity;// + density * uTicks;
+#ifdef _FUSED_DENSITY
+	// density of the next step (the density pass is skipped), scaled so that
+	// it stays positive (see _integrate_density() in SphSolver.cpp)
+	oDensity  = iDensity > 0.0 ? iDensity * exp(densityRate * uTicks / iDensity)
+	                           : max(densityRate * uTicks, 0.0);
+#else
+	oDensity  = iDensity;
+#endif
 	oVelocity = iVelocity + acceleration * uTicks;
 	oPosition = iPosition + oVelocity * uTicks;
 
@@ -187,6 +324,21 @@ void main()
 	// check position
 	oPosition = clamp(oPosition, uSimBoundsMin+0.05, uSimBoundsMax-0.05);
 
+#ifdef _NEIGHBOUR_LIST
+	// track the displacement since the last list build (positive floats
+	// compare like integers)
+	vec3 displacement = oPosition - texelFetch(sNeighbourRefs, gl_VertexID).xyz;
+	imageAtomicMax(imgDisplacement,
+	               0,
+	               floatBitsToInt(dot(displacement, displacement)));
+#endif
+
+#ifdef _ADAPTIVE_TIME_STEP
+	// reduce the maxima of the next dt (positive floats compare like integers)
+	imageAtomicMax(imgStepMaxima, 0, floatBitsToInt(length(oVelocity)));
+	imageAtomicMax(imgStepMaxima, 1, floatBitsToInt(oData1.w));
+#endif
+
 }
 
 #endif // _VERTEX_
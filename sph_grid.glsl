@@ -1,13 +1,32 @@
 #version 420 core
 
 // images
-layout(r32i) coherent uniform iimageBuffer imgHead;
-layout(r32i) coherent uniform iimageBuffer imgList;
+layout(r32i) coherent uniform iimageBuffer imgHead; // heads or counts
+layout(r32i) coherent uniform iimageBuffer imgList; // next particles or ranks
+#ifdef _SORTED_GRID_SCATTER
+layout(r32i) writeonly uniform iimageBuffer imgSorted; // sorted particles
+
+// samplers
+uniform isamplerBuffer sCellEnds; // inclusive prefix sum of the counts
+#endif
+
+#ifdef _MORTON_ORDER
+uniform isamplerBuffer sCellMortonRanks; // rank of the cells in Z-order
+#endif
+
+#ifdef _OCCUPANCY
+// number of non-empty cells, then a bit per cell (cleared before the pass)
+layout(r32i) coherent uniform iimageBuffer imgCellBits;
+layout(r32i) writeonly uniform iimageBuffer imgActiveCells; // non-empty cells
+#endif
 
 // uniforms
 uniform vec3  uBucket1dCoeffs;
 uniform float uBucketCellSize;
 uniform vec3  uBucketBoundsMin;
+#ifdef _HASHED_GRID
+uniform ivec3 uBucketMask; // hashed grid size - 1 (cells wrap around)
+#endif
 
 #ifdef _VERTEX_
 
@@ -17,20 +36,56 @@ void main()
 {
 	// 3d bucket texture (in [0,D]x[0,W]x[0,H])
 	vec3 relPos    = iData.xyz - uBucketBoundsMin;
+#ifdef _HASHED_GRID
+	ivec3 bucket3d = ivec3(floor(relPos / uBucketCellSize)) & uBucketMask;
+#else
 	ivec3 bucket3d = ivec3(relPos / uBucketCellSize);
+#endif
 //	ivec3 bucket3d = ivec3(relPos / (2.0*uBucketCellSize));
 
 	// 1d bucket pos
 	int bucket1d = int(dot(bucket3d, uBucket1dCoeffs));
+#ifdef _MORTON_ORDER
+	bucket1d = texelFetch(sCellMortonRanks, bucket1d).r;
+#endif
 
+#if defined _SORTED_GRID_COUNT
+	// count particles in cell and store rank
+	int rank = imageAtomicAdd(imgHead, bucket1d, 1);
+	imageStore(imgList, gl_VertexID, ivec4(rank));
+#ifdef _OCCUPANCY
+	bool first = rank == 0;
+#endif
+#elif defined _SORTED_GRID_SCATTER
+	// store particle in the range of its cell
+	int cellStart = texelFetch(sCellEnds, bucket1d).r
+	              - imageLoad(imgHead, bucket1d).r;
+	imageStore(imgSorted,
+	           cellStart + imageLoad(imgList, gl_VertexID).r,
+	           ivec4(gl_VertexID));
+#else
 	// check position in grid
 	int index = imageAtomicExchange(imgHead,
 	                                bucket1d,
 	                                gl_VertexID);
+#ifdef _OCCUPANCY
+	bool first = index == -1;
+#endif
 	while(index != -1)
 		index = imageAtomicExchange(imgList,
 		                            gl_VertexID,
 		                            index);
+#endif
+
+#ifdef _OCCUPANCY
+	// the first particle of a cell sets its bit and lists it
+	if(first) {
+		imageAtomicOr(imgCellBits, 1 + (bucket1d >> 5), 1 << (bucket1d & 31));
+		imageStore(imgActiveCells,
+		           imageAtomicAdd(imgCellBits, 0, 1),
+		           ivec4(bucket1d));
+	}
+#endif
 }
 
 #endif // _VERTEX_
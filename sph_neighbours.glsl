@@ -0,0 +1,100 @@
+#version 420 core
+
+// _NEIGHBOUR_CAPACITY (entries per particle) is set by the application
+
+// images
+layout(r32i) readonly  uniform iimageBuffer imgHead;
+layout(r32i) readonly  uniform iimageBuffer imgList;
+#ifdef _SORTED_GRID
+layout(r32i) readonly  uniform iimageBuffer imgSorted;
+#endif
+layout(r32i) writeonly uniform iimageBuffer imgNeighbours; // neighbour lists
+layout(r32i) coherent  uniform iimageBuffer imgDisplacement; // overflows at 1
+
+// samplers
+uniform samplerBuffer sParticlePos;
+#ifdef _SORTED_GRID
+uniform isamplerBuffer sCellEnds; // inclusive prefix sum of the cell counts
+#endif
+
+// uniforms
+uniform vec3  uBucket1dCoeffs;    // for conversion from bucket 3d to bucket 1d
+uniform ivec3 uBucket3dSize;      // number of cells in each dimension
+uniform vec3  uBucketBoundsMin;   // constant
+uniform float uBucketCellSize;    // dimensions of the bucket
+uniform int   uCellRange;         // cell layers to visit around the particle
+                                  // (hashed grids: less than half the table)
+uniform float uSearchRadiusSquared; // (h + skin)^2
+#ifdef _HASHED_GRID
+uniform ivec3 uBucketMask;        // hashed grid size - 1 (cells wrap around)
+#endif
+
+#ifdef _VERTEX_
+
+layout(location=0) in  vec4 iData;      // position + reserved
+layout(location=0) out vec4 oPosition;  // position at build time
+layout(location=1) out int  oCount;     // number of neighbours
+
+void main()
+{
+	// 3d bucket texture (in [0,D]x[0,W]x[0,H])
+	vec3 relPos    = iData.xyz - uBucketBoundsMin;
+	ivec3 bucket3d = ivec3(floor(relPos / uBucketCellSize));
+	int first      = gl_VertexID * _NEIGHBOUR_CAPACITY;
+	bool truncated = false;
+
+	oPosition = vec4(iData.xyz, 0.0);
+	oCount    = 0;
+
+	// loop through the cells (lists are truncated if full, and counted so
+	// that the application grows them)
+	for(int k=-uCellRange; k<=uCellRange; ++k)
+	for(int j=-uCellRange; j<=uCellRange; ++j)
+	for(int i=-uCellRange; i<=uCellRange; ++i)
+	{
+		ivec3 cell = bucket3d + ivec3(i,j,k);
+#ifdef _HASHED_GRID
+		cell &= uBucketMask;
+#else
+		if(any(lessThan(cell, ivec3(0)))
+		|| any(greaterThanEqual(cell, uBucket3dSize)))
+			continue;
+#endif
+		int bucket1d = int(dot(vec3(cell), uBucket1dCoeffs));
+		int offset;
+
+#ifdef _SORTED_GRID
+		// get range of the cell
+		int slotEnd = texelFetch(sCellEnds, bucket1d).r;
+		int slot    = slotEnd - imageLoad(imgHead, bucket1d).r;
+		while(slot != slotEnd)
+		{
+			offset = imageLoad(imgSorted, slot++).r;
+#else
+		offset = imageLoad(imgHead, bucket1d).r;
+		while(offset != -1)
+		{
+#endif
+			vec3 rij = iData.xyz - texelFetch(sParticlePos, offset).rgb;
+			if(offset != gl_VertexID
+			&& dot(rij,rij) < uSearchRadiusSquared)
+			{
+				if(oCount < _NEIGHBOUR_CAPACITY)
+					imageStore(imgNeighbours, first + oCount++, ivec4(offset));
+				else
+					truncated = true;
+			}
+
+#ifndef _SORTED_GRID
+			// next offset
+			offset = imageLoad(imgList, offset).r;
+#endif
+		}
+	}
+
+	if(truncated)
+		imageAtomicAdd(imgDisplacement, 1, 1);
+}
+
+#endif // _VERTEX_
+
@@ -0,0 +1,213 @@
+#version 420 core
+
+// Position based fluids (Macklin and Mueller 2013), one pass per program:
+// _PBF_PREDICT      moves the particles with gravity
+// _PBF_LAMBDA       computes the densities and the constraint multipliers
+// _PBF_DISPLACEMENT moves the particles towards the rest density
+// _PBF_UPDATE       derives the velocities from the motion
+// Between the first and the last pass, the second attribute holds the
+// position at the start of the step (and the multiplier in w).
+
+// images
+layout(r32i) readonly uniform iimageBuffer imgHead;
+layout(r32i) readonly uniform iimageBuffer imgList;
+#ifdef _SORTED_GRID
+layout(r32i) readonly uniform iimageBuffer imgSorted;
+#endif
+#ifdef _OCCUPANCY
+layout(r32i) readonly uniform iimageBuffer imgCellBits; // a bit per cell
+#endif
+
+// samplers
+uniform samplerBuffer sData0; // pos + density
+uniform samplerBuffer sData1; // start pos + multiplier
+#ifdef _SORTED_GRID
+uniform isamplerBuffer sCellEnds; // inclusive prefix sum of the cell counts
+#endif
+
+// uniforms
+uniform vec3  uBucket1dCoeffs;     // for conversion from bucket 3d to bucket 1d
+uniform vec3  uBucketBoundsMin;    // constant
+uniform float uBucketCellSize;     // dimensions of the bucket
+#ifdef _HASHED_GRID
+uniform ivec3 uBucketMask;         // hashed grid size - 1 (cells wrap around)
+#elif defined _OCTANT_SEARCH
+uniform int   uCellStencil[64];    // offsets of the cells of each octant
+#else
+uniform int   uCellStencil[27];    // offsets of the cells around a cell
+#endif
+
+uniform float uSmoothingLength;        // h
+uniform float uSmoothingLengthSquared; // h2
+uniform float uDensityConstants;       // poly6 * mass
+uniform float uPressureConstants;      // -gradSpiky * mass / 2
+uniform float uRestDensity;            // rest density
+
+uniform vec3 uSimBoundsMin; // simulation bounds (min)
+uniform vec3 uSimBoundsMax; // simulation bounds (max)
+
+uniform vec3 uGravityDir;   // direction of gravity acceleration
+
+uniform float uTicks;    // dt
+
+// under relaxation of the projection (see _PBF_RELAXATION in SphSolver.cpp)
+#define RELAXATION 1.0
+
+#ifdef _VERTEX_
+
+layout(location=0) in vec4 iData0; // pos + density
+layout(location=1) in vec4 iData1; // velocity, or start pos + multiplier
+
+layout(location=0) out vec4 oData0;
+layout(location=1) out vec4 oData1;
+
+vec3 clamp_position(vec3 position) {
+	return clamp(position, uSimBoundsMin+0.05, uSimBoundsMax-0.05);
+}
+
+#if defined _PBF_PREDICT
+
+void main()
+{
+	vec3 velocity = iData1.xyz + 9.81 * uGravityDir * uTicks;
+	oData0 = vec4(clamp_position(iData0.xyz + velocity * uTicks), iData0.w);
+	oData1 = vec4(iData0.xyz, 0.0);
+}
+
+#elif defined _PBF_UPDATE
+
+void main()
+{
+	oData0 = iData0;
+	oData1 = vec4((iData0.xyz - iData1.xyz) / uTicks, 0.0);
+}
+
+#else
+
+void main()
+{
+	// variables
+#ifdef _OCTANT_SEARCH
+	const int cellCount = 8; // cells of 2h (see sph_density.glsl)
+#else
+	const int cellCount = 27;
+#endif
+	int iter   = 0; // iterator
+	int offset = 0; // texture offset
+	vec3 ri    = iData0.xyz;
+#ifdef _PBF_LAMBDA
+	float density       = 0.0;
+	vec3  gradient      = vec3(0.0); // sum of the spiky coeffs
+	float gradientNorm2 = 0.0;       // sum of their squared norms
+#else
+	vec3 displacement = vec3(0.0);
+#endif
+
+	// 3d bucket texture (in [0,D]x[0,W]x[0,H])
+	vec3 relPos   = ri - uBucketBoundsMin;
+	vec3 bucket3d = floor(relPos / uBucketCellSize);
+
+	// compute 1d bucket positions of neighbour cells (on a dense grid, the
+	// cell and its stencil, see get_cell_stencil in SphSolver.cpp)
+#ifdef _OCTANT_SEARCH
+	vec3 side = mod(floor(2.0 * relPos / uBucketCellSize), 2.0)*2.0-1.0;
+#ifdef _HASHED_GRID
+	int buckets1d[8];
+	for(int i=0; i<2; ++i)
+	for(int j=0; j<2; ++j)
+	for(int k=0; k<2; ++k)
+		buckets1d[i+2*j+4*k]
+			= int(dot(vec3(ivec3(bucket3d + side*vec3(i,j,k)) & uBucketMask),
+			          uBucket1dCoeffs));
+#else
+	int bucket1d = int(dot(bucket3d, uBucket1dCoeffs));
+	int stencil  = 8 * int(dot(step(0.0, side), vec3(1,2,4)));
+#endif
+#else
+#ifdef _HASHED_GRID
+	int buckets1d[27];
+	for(int i=-1; i<2; ++i)
+	for(int j=-1; j<2; ++j)
+	for(int k=-1; k<2; ++k)
+		buckets1d[i+1+3*(j+1)+9*(k+1)]
+			= int(dot(vec3((ivec3(bucket3d) + ivec3(i,j,k)) & uBucketMask),
+			          uBucket1dCoeffs));
+#else
+	int bucket1d = int(dot(bucket3d, uBucket1dCoeffs));
+	const int stencil = 0;
+#endif
+#endif
+
+	// loop through neighbours
+	while(iter<cellCount) {
+#ifdef _HASHED_GRID
+		int cell = buckets1d[iter];
+#else
+		int cell = bucket1d + uCellStencil[stencil + iter];
+#endif
+#ifdef _OCCUPANCY
+		// skip empty cells (the bits start at word 1)
+		if(0 == (imageLoad(imgCellBits, 1 + (cell >> 5)).r
+		         & (1 << (cell & 31)))) {
+			++iter;
+			continue;
+		}
+#endif
+#if defined _SORTED_GRID
+		// get range of the cell
+		int slotEnd = texelFetch(sCellEnds, cell).r;
+		int slot    = slotEnd - imageLoad(imgHead, cell).r;
+		while(slot != slotEnd) {
+			offset = imageLoad(imgSorted, slot++).r;
+#else
+		// get offset
+		offset = imageLoad(imgHead, cell).r;
+		while(offset != -1) {
+#endif
+			vec3 rij = ri - texelFetch(sData0, offset).xyz;
+			float r2 = dot(rij,rij);
+
+			// kernels vanish beyond h (and are undefined at r=0)
+			if(offset != gl_VertexID && r2 < uSmoothingLengthSquared
+			&& r2 > 0.0) {
+				float r    = sqrt(r2);
+				vec3 spiky = rij * pow(uSmoothingLength-r, 2.0) / r;
+#ifdef _PBF_LAMBDA
+				density       += pow(uSmoothingLengthSquared - r2, 3.0);
+				gradient      += spiky;
+				gradientNorm2 += dot(spiky,spiky);
+#else
+				displacement  += (iData1.w + texelFetch(sData1, offset).w)
+				               * spiky;
+#endif
+			}
+#if !defined _SORTED_GRID
+			// get next offset (if any)
+			offset = imageLoad(imgList, offset).r;
+#endif
+		}
+		++iter;
+	}
+
+	// mass weighted gradients over the rest density
+	float scale = -2.0 * uPressureConstants / uRestDensity;
+
+#ifdef _PBF_LAMBDA
+	// multiplier (compression only, so that the free surface does not clump)
+	density *= uDensityConstants;
+	float norm2  = scale * scale * (dot(gradient,gradient) + gradientNorm2);
+	float c      = max(density / uRestDensity - 1.0, 0.0);
+	float lambda = norm2 > 0.0 ? -c / ((1.0 + RELAXATION) * norm2) : 0.0;
+	oData0 = vec4(ri, density);
+	oData1 = vec4(iData1.xyz, lambda);
+#else
+	// sum (li + lj) Gij / d0
+	oData0 = vec4(clamp_position(ri + scale * displacement), iData0.w);
+	oData1 = iData1;
+#endif
+}
+
+#endif
+
+#endif // _VERTEX_
+
@@ -0,0 +1,24 @@
+#version 420 core
+
+// images
+layout(r32i) readonly uniform iimageBuffer imgSorted; // particles in Z-order
+
+// samplers
+uniform samplerBuffer sData0; // pos + density
+uniform samplerBuffer sData1; // velocity
+
+#ifdef _VERTEX_
+
+layout(location=0) out vec4 oData0; // pos + density
+layout(location=1) out vec4 oData1; // velocity
+
+void main()
+{
+	// fetch the particle which goes to this slot
+	int index = imageLoad(imgSorted, gl_VertexID).r;
+	oData0 = texelFetch(sData0, index);
+	oData1 = texelFetch(sData1, index);
+}
+
+#endif // _VERTEX_
+